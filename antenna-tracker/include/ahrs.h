@@ -0,0 +1,19 @@
+#ifndef AHRS_H
+#define AHRS_H
+
+struct ahrs_state {
+	/* body to earth rotation (w, x, y, z), earth frame is x north, z up */
+	float q[4];
+	/* integral feedback, i.e. the negated gyro bias estimate (rad/s) */
+	float integral[3];
+
+	float kp;
+	float ki;
+};
+
+void ahrs_init(struct ahrs_state *ahrs, const float *accel, const float *magn,
+		float kp, float ki);
+void ahrs_update(struct ahrs_state *ahrs, const float *gyro, const float *accel,
+		const float *magn, float dt);
+
+#endif /* AHRS_H */
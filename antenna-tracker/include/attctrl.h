@@ -3,31 +3,15 @@
 
 #include <zephyr.h>
 
-struct pid_state {
-	const float kp;
-	const float ki;
-	const float kd;
-
-	float integral;
-	float prev_error, cur_error;
-	int64_t prev_time, cur_time;
-};
-
-enum command_setpoint_type {
-	COMMAND_SETPOINT_TYPE_EULER = 0,
-	COMMAND_SETPOINT_TYPE_QUATERNION = 1,
-};
-
-struct command_setpoint {
-	enum command_setpoint_type type;
-
-	union {
-		float euler[3];
-		float quaternion[4];
-	} data;
-};
-
-void attctrl_init(struct k_msgq *imu_msgq, struct k_msgq *pwmctrl_msgq,
-		struct k_msgq *command_msgq);
+#include "estimator.h"
+#include "pwmctrl.h"
+#include "pid.h"
+#include "gimbal.h"
+
+void attctrl_init(struct k_msgq *pwmctrl_msgq);
+void attctrl_reset(const struct attitude_frame *att_frame);
+void attctrl_step(const struct attitude_frame *att_frame,
+		const struct command_setpoint *command_setpoint,
+		struct motor_setpoint *motor_setpoint);
 
 #endif /* ATTCTRL_H */
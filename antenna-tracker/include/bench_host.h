@@ -0,0 +1,10 @@
+#ifndef BENCH_HOST_H
+#define BENCH_HOST_H
+
+#include <stdint.h>
+
+/* the host's counters, for the benchmarks on native_posix */
+uint32_t bench_host_cycles(void);
+uint32_t bench_host_cycles_per_sec(void);
+
+#endif /* BENCH_HOST_H */
@@ -0,0 +1,31 @@
+#ifndef BLACKBOX_H
+#define BLACKBOX_H
+
+#include <zephyr.h>
+
+#include "records.h"
+
+/* a log file, numbered from 1 */
+struct blackbox_log {
+	uint16_t id;
+	uint32_t size; /* bytes */
+};
+
+/* most logs listed or kept at once */
+#define BLACKBOX_LOG_MAX 64
+
+#ifdef CONFIG_APS_BLACKBOX
+void blackbox_init(void);
+void blackbox_write(enum record_id id, const void *record, size_t len);
+
+int blackbox_list(struct blackbox_log *logs, int max);
+int blackbox_read(uint16_t id, uint32_t offset, void *data, size_t len);
+int blackbox_erase(void);
+#else
+static inline void blackbox_write(enum record_id id, const void *record,
+		size_t len)
+{
+}
+#endif
+
+#endif /* BLACKBOX_H */
@@ -7,6 +7,13 @@
 #define IMU_NODE DT_ALIAS(imu)
 #if DT_NODE_HAS_STATUS(IMU_NODE, okay)
 #define IMU_LABEL DT_LABEL(IMU_NODE)
+#define IMU_BUS_LABEL DT_BUS_LABEL(IMU_NODE)
+#define IMU_ADDR DT_REG_ADDR(IMU_NODE)
+#if DT_NODE_HAS_PROP(IMU_NODE, int_gpios)
+#define IMU_INT_LABEL DT_GPIO_LABEL(IMU_NODE, int_gpios)
+#define IMU_INT_PIN DT_GPIO_PIN(IMU_NODE, int_gpios)
+#define IMU_INT_FLAGS DT_GPIO_FLAGS(IMU_NODE, int_gpios)
+#endif
 #else
 #error "Unsupported board."
 #endif
@@ -24,6 +31,7 @@
 #define ALT_CHANNEL DT_PWMS_CHANNEL(ALT_NODE)
 #define ALT_PERIOD DT_PWMS_PERIOD(ALT_NODE)
 #define ALT_FLAGS DT_PWMS_FLAGS(ALT_NODE)
+#define ALT_TIMER DT_PARENT(DT_PWMS_CTLR(ALT_NODE))
 #else
 #error "Unsupported board."
 #endif
@@ -34,6 +42,7 @@
 #define AZM_CHANNEL DT_PWMS_CHANNEL(AZM_NODE)
 #define AZM_PERIOD DT_PWMS_PERIOD(AZM_NODE)
 #define AZM_FLAGS DT_PWMS_FLAGS(AZM_NODE)
+#define AZM_TIMER DT_PARENT(DT_PWMS_CTLR(AZM_NODE))
 #else
 #error "Unsupported board."
 #endif
@@ -0,0 +1,21 @@
+#ifndef CALIB_H
+#define CALIB_H
+
+#include <zephyr.h>
+
+struct gyro_calib {
+	float bias[3]; /* rad/s, sensor frame */
+	float temp; /* degrees C the bias was measured at */
+};
+
+/* corrected = soft_iron * (raw - offset), stored as MAG_* parameters */
+struct mag_calib {
+	float offset[3]; /* gauss */
+	float soft_iron[3][3];
+};
+
+int calib_init(void);
+int calib_get_gyro(struct gyro_calib *calib);
+void calib_save_gyro(const struct gyro_calib *calib);
+
+#endif /* CALIB_H */
@@ -3,12 +3,74 @@
 
 #include <zephyr.h>
 
+#include "ahrs.h"
+#include "calib.h"
+#include "imu.h"
+#include "mag.h"
+#include "statebus.h"
+
 struct attitude_frame {
-	int64_t timestamp;
+	int64_t timestamp; /* us, of the IMU sample this frame was computed from */
+	int64_t time_estimated; /* us, when the estimate was finished */
+	/* body to earth rotation (w, x, y, z), earth frame is x north, z up */
+	float q[4];
+	/* degrees: altitude (about body x), about body y, heading */
 	float angle[3];
+	/* degrees, the heading unwrapped: it keeps counting past +-180 */
+	float azimuth;
+	/* bias corrected body rates, rad/s */
+	float rate[3];
+};
+
+enum est_status {
+	/* averaging the gyro bias, only when nothing is stored */
+	EST_STATUS_CALIBRATING = 0,
+	/* waiting for the first mag sample to initialize the filter */
+	EST_STATUS_WAIT_MAG,
+	EST_STATUS_RUNNING,
 };
 
-void est_init(struct k_msgq *imu_msgq, struct k_msgq * mag_msgq,
-		struct k_msgq *attitude_msgq);
+struct est_state {
+	enum est_status status;
+
+	struct ahrs_state ahrs;
+	struct gyro_calib gyro_calib;
+	/* last gyro calibration written to flash, the refinement compares to it */
+	struct gyro_calib gyro_calib_saved;
+	struct mag_calib mag_calib;
+	int calib_count;
+
+	/* sensor to body frame rotation matrices, from the parameters */
+	float irot[3][3];
+	float mrot[3][3];
+
+	float magn_rot[3];
+	bool have_mag;
+
+	/* continuous heading, starts from the first heading estimated */
+	float azimuth;
+	bool have_azimuth;
+
+	int64_t time_prev, time_refine;
+	uint32_t param_generation;
+
+	/*
+	 * Set for a copy run beside the tracker's own estimator, such as a
+	 * benchmark: it records nothing and never saves a calibration.
+	 */
+	bool detached;
+};
+
+/* latest attitude estimate, published for every IMU sample */
+extern struct statebus_topic attitude_topic;
+
+void est_init(struct k_msgq *imu_msgq, struct k_msgq * mag_msgq);
+
+void est_state_init(struct est_state *est);
+void est_add_mag(struct est_state *est, const struct mag_sample *mag_sample);
+int est_add_imu(struct est_state *est, const struct imu_sample *imu_sample,
+		struct attitude_frame *att_frame);
+int est_step(struct est_state *est, const struct imu_sample *imu_sample,
+		const struct mag_sample *mag_sample, struct attitude_frame *att_frame);
 
 #endif /* __ESTIMATOR_H */
@@ -0,0 +1,65 @@
+#ifndef GIMBAL_H
+#define GIMBAL_H
+
+#include <zephyr.h>
+
+#include "statebus.h"
+
+/* manager flags, the same bits as MAVLink's GIMBAL_MANAGER_FLAGS */
+#define GIMBAL_FLAG_RETRACT BIT(0)
+#define GIMBAL_FLAG_NEUTRAL BIT(1)
+#define GIMBAL_FLAG_ROLL_LOCK BIT(2)
+#define GIMBAL_FLAG_PITCH_LOCK BIT(3)
+#define GIMBAL_FLAG_YAW_LOCK BIT(4)
+
+/* index of each axis in the setpoint arrays */
+enum gimbal_axis {
+	GIMBAL_AXIS_ALT = 0,
+	GIMBAL_AXIS_AZM,
+	GIMBAL_AXIS_COUNT,
+};
+
+enum command_setpoint_mode {
+	/* level and facing the front of the base, until a command arrives */
+	COMMAND_SETPOINT_MODE_NEUTRAL = 0,
+	/* angle moving at rate from timestamp */
+	COMMAND_SETPOINT_MODE_ANGLE,
+	/* pointing at the tracked vehicle or location, see track.h */
+	COMMAND_SETPOINT_MODE_TRACK,
+};
+
+/*
+ * The target of the attitude controllers. Angles are in degrees in the
+ * estimator's frame: altitude as attitude_frame.angle[0] and azimuth as the
+ * heading, counter-clockwise from north. Rates are in degrees/s.
+ */
+struct command_setpoint {
+	enum command_setpoint_mode mode;
+	int64_t timestamp;
+	float angle[GIMBAL_AXIS_COUNT];
+	float rate[GIMBAL_AXIS_COUNT];
+};
+
+struct gimbal_status {
+	uint32_t flags;
+	/* who may send setpoints, 0/0 when nobody is configured */
+	uint8_t primary_sysid, primary_compid;
+	uint8_t secondary_sysid, secondary_compid;
+};
+
+/* the latest command_setpoint, published by the MAVLink RX thread */
+extern struct statebus_topic setpoint_topic;
+
+int gimbal_configure(uint8_t sysid, uint8_t compid,
+		int primary_sysid, int primary_compid,
+		int secondary_sysid, int secondary_compid);
+int gimbal_set_angles(uint8_t sysid, uint8_t compid, uint32_t flags,
+		const float *angle, const float *rate);
+int gimbal_set_mode(uint8_t sysid, uint8_t compid,
+		enum command_setpoint_mode mode);
+void gimbal_get_status(struct gimbal_status *status);
+float gimbal_base_azimuth(void);
+void gimbal_target(const struct command_setpoint *setpoint, int64_t time,
+		float *angle, float *rate);
+
+#endif /* GIMBAL_H */
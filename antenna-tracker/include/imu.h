@@ -3,16 +3,20 @@
 
 #include <zephyr.h>
 #include <device.h>
+#include <drivers/sensor.h>
 
 struct imu_sample {
-	int64_t timestamp;
-	double accel[3];
-	double gyro[3];
-	double temp;
+	int64_t timestamp; /* us, see timestamp_us() */
+	float accel[3]; /* m/s^2 */
+	float gyro[3]; /* rad/s */
+	float temp; /* degrees C */
 };
 
 void init_imu(struct k_msgq *imu_msgq, struct k_msgq *attitude_msgq);
 int process_imu(const struct device *dev, struct imu_sample *imu_sample);
+int sample_imu(const struct device *dev, struct imu_sample *imu_sample);
+void imu_convert(const struct sensor_value *accel, const struct sensor_value *gyro,
+		const struct sensor_value *temp, struct imu_sample *imu_sample);
 
 #ifdef CONFIG_MPU6050_TRIGGER
 int setup_mpu6050_trigger(const struct device *dev);
@@ -22,4 +26,16 @@ int setup_mpu6050_trigger(const struct device *dev);
 extern void imu_poll_thread_entry(void *, void *, void *);
 #endif
 
+#ifdef CONFIG_APS_IMU_FIFO
+/* most samples pulled out of the FIFO (and pushed to the msgq) per drain */
+#define IMU_FIFO_BATCH_MAX 32
+#define IMU_MSGQ_DEPTH IMU_FIFO_BATCH_MAX
+
+int imu_fifo_init(void);
+int imu_fifo_read(struct imu_sample *samples, int max);
+extern void imu_fifo_thread_entry(void *, void *, void *);
+#else
+#define IMU_MSGQ_DEPTH 4
+#endif
+
 #endif /* IMU_H */
@@ -1,16 +1,9 @@
 #ifndef __MAG_H
 #define __MAG_H
 
-static const float MAG_OFFSET_X = -0.282569;
-static const float MAG_OFFSET_Y = -0.363303;
-static const float MAG_OFFSET_Z = -0.325688;
-static const float MAG_SCALE_X  =  1.125176;
-static const float MAG_SCALE_Y  =  0.976801;
-static const float MAG_SCALE_Z  =  0.919540;
-
 struct mag_sample {
-	int64_t timestamp;
-	double magn[3];
+	int64_t timestamp; /* us, see timestamp_us() */
+	float magn[3]; /* gauss */
 };
 
 void init_mag(struct k_msgq *imu_msgq, struct k_msgq *attitude_msgq);
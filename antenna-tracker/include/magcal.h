@@ -0,0 +1,15 @@
+#ifndef MAGCAL_H
+#define MAGCAL_H
+
+#include <stdbool.h>
+
+#include "calib.h"
+
+/* mag samples to collect during the calibration manoeuvre (~60s at 10Hz) */
+#define MAGCAL_SAMPLES 600
+
+void magcal_start(void);
+bool magcal_running(void);
+int magcal_add_sample(const float *magn, struct mag_calib *calib);
+
+#endif /* MAGCAL_H */
@@ -5,16 +5,36 @@
 #include <device.h>
 #include <sys/ring_buffer.h>
 
-struct parse_mavlink_data {
-	struct ring_buf *rx_ringbuf;
-	struct ring_buf *tx_ringbuf;
-	struct k_work work;
+/* parser channels, only the USB CDC link for now */
+#define MAVLINK_CHAN_USB 0
+#define MAVLINK_CHANNELS 1
+/* a parser channel for the benchmarks, never a link */
+#define MAVLINK_CHAN_BENCH MAVLINK_CHANNELS
+
+struct mavlink_rx_stats {
+	atomic_t bytes;
+	atomic_t messages;
+	/* bytes the parser rejected, including frames with a bad CRC */
+	atomic_t parse_errors;
+	/* messages missing from a sender's sequence numbers */
+	atomic_t lost;
+	/* bytes dropped before parsing because the rx ring was full */
+	atomic_t overrun;
 };
 
 void init_mavlink(const struct device *usb_dev,
 		struct ring_buf *rx_ringbuf, struct ring_buf *tx_ringbuf);
-void parse_mavlink(struct k_work *item);
+int mavlink_queue_raw(const uint8_t *data, uint32_t len);
+void mavlink_rx_notify(void);
+void mavlink_rx_overrun(int chan, uint32_t len);
+void mavlink_get_rx_stats(int chan, struct mavlink_rx_stats *stats);
 void mavlink_timer_start();
 void mavlink_timer_stop();
 
+#ifdef CONFIG_APS_BENCH
+uint32_t mavlink_bench_stream(uint8_t *data, uint32_t size);
+bool mavlink_bench_parse_char(uint8_t c);
+int mavlink_bench_queue(struct ring_buf *tx_ringbuf);
+#endif
+
 #endif /* __APS_MAVLINK_H */
@@ -0,0 +1,120 @@
+#ifndef PARAM_H
+#define PARAM_H
+
+#include <zephyr.h>
+
+/* longest name MAVLink can carry, not necessarily null terminated there */
+#define PARAM_NAME_LEN 16
+
+enum param_type {
+	PARAM_TYPE_FLOAT = 0,
+	PARAM_TYPE_INT32,
+	PARAM_TYPE_UINT8,
+};
+
+union param_value {
+	float f;
+	int32_t i;
+};
+
+/*
+ * Every tunable value. The index is also the MAVLink param_index, so only
+ * ever append to this list.
+ */
+enum param_id {
+	/* attitude controller gains, see struct pid_gains */
+	PARAM_ATT_ALT_KP = 0,
+	PARAM_ATT_ALT_KI,
+	PARAM_ATT_ALT_KD,
+	PARAM_ATT_ALT_KFF,
+	PARAM_ATT_ALT_ILIM,
+	PARAM_ATT_ALT_DCUT,
+	PARAM_ATT_AZM_KP,
+	PARAM_ATT_AZM_KI,
+	PARAM_ATT_AZM_KD,
+	PARAM_ATT_AZM_KFF,
+	PARAM_ATT_AZM_ILIM,
+	PARAM_ATT_AZM_DCUT,
+
+	/* setpoint motion profile limits, see struct profile_limits */
+	PARAM_ATT_ALT_VMAX,
+	PARAM_ATT_ALT_AMAX,
+	PARAM_ATT_ALT_JMAX,
+	PARAM_ATT_AZM_VMAX,
+	PARAM_ATT_AZM_AMAX,
+	PARAM_ATT_AZM_JMAX,
+
+	/* cable wrap limit either side of the base front, 0 for none */
+	PARAM_ATT_AZM_WRAP,
+
+	/* IMU sensor to body rotation, row major */
+	PARAM_EST_IROT_00,
+	PARAM_EST_IROT_01,
+	PARAM_EST_IROT_02,
+	PARAM_EST_IROT_10,
+	PARAM_EST_IROT_11,
+	PARAM_EST_IROT_12,
+	PARAM_EST_IROT_20,
+	PARAM_EST_IROT_21,
+	PARAM_EST_IROT_22,
+
+	/* mag sensor to body rotation, row major */
+	PARAM_EST_MROT_00,
+	PARAM_EST_MROT_01,
+	PARAM_EST_MROT_02,
+	PARAM_EST_MROT_10,
+	PARAM_EST_MROT_11,
+	PARAM_EST_MROT_12,
+	PARAM_EST_MROT_20,
+	PARAM_EST_MROT_21,
+	PARAM_EST_MROT_22,
+
+	/* mag calibration, see struct mag_calib */
+	PARAM_MAG_OFS_X,
+	PARAM_MAG_OFS_Y,
+	PARAM_MAG_OFS_Z,
+	PARAM_MAG_SI_00,
+	PARAM_MAG_SI_01,
+	PARAM_MAG_SI_02,
+	PARAM_MAG_SI_10,
+	PARAM_MAG_SI_11,
+	PARAM_MAG_SI_12,
+	PARAM_MAG_SI_20,
+	PARAM_MAG_SI_21,
+	PARAM_MAG_SI_22,
+
+	PARAM_MAV_SYS_ID,
+	PARAM_MAV_COMP_ID,
+	/* telemetry budget in bytes/s, 0 for unlimited */
+	PARAM_MAV_TX_RATE,
+	/* records sent on the binary telemetry stream, a bit per record_id */
+	PARAM_TLM_RECORDS,
+
+	/* heading of the front of the base, for yaw follow and neutral */
+	PARAM_GMB_YAW_BASE,
+
+	/* surveyed position of the tracker and link latency, see track.c */
+	PARAM_TRK_HOME_LAT,
+	PARAM_TRK_HOME_LON,
+	PARAM_TRK_HOME_ALT,
+	PARAM_TRK_LATENCY,
+
+	PARAM_COUNT,
+};
+
+int param_init(void);
+
+int param_find(const char *name, size_t len);
+const char *param_name(enum param_id id);
+enum param_type param_type(enum param_id id);
+
+float param_get_float(enum param_id id);
+int32_t param_get_int(enum param_id id);
+void param_get_float_array(enum param_id first, float *values, int count);
+int param_set(enum param_id id, union param_value value);
+int param_set_float(enum param_id id, float value);
+int param_set_int(enum param_id id, int32_t value);
+
+uint32_t param_generation(void);
+
+#endif /* PARAM_H */
@@ -0,0 +1,59 @@
+#ifndef PERF_H
+#define PERF_H
+
+#include <zephyr.h>
+
+/*
+ * Control loop timing. Every motor update carries the time its IMU sample
+ * was taken and the times it left the estimator and the controller, so
+ * each stage of the pipeline can be measured separately.
+ */
+enum perf_stage {
+	/* IMU sample to attitude frame, including time queued for the estimator */
+	PERF_STAGE_ESTIMATE = 0,
+	/* attitude frame to motor setpoint */
+	PERF_STAGE_CONTROL,
+	/* motor setpoint to PWM outputs written */
+	PERF_STAGE_OUTPUT,
+	/* IMU sample to PWM outputs written */
+	PERF_STAGE_TOTAL,
+	/* between consecutive PWM updates, its spread is the output jitter */
+	PERF_STAGE_PERIOD,
+	PERF_STAGE_COUNT,
+};
+
+/* queues that drop entries when they fill up */
+enum perf_drop {
+	PERF_DROP_IMU = 0,
+	PERF_DROP_MAG,
+	PERF_DROP_PWMCTRL,
+	/* whole MAVLink frames that did not fit in the tx ring */
+	PERF_DROP_TX,
+	/* blackbox records that did not fit in its RAM ring */
+	PERF_DROP_BLACKBOX,
+	/* binary telemetry frames that did not fit in the tx ring */
+	PERF_DROP_TELEMETRY,
+	PERF_DROP_COUNT,
+};
+
+/* bin i counts durations of [2^i, 2^(i+1)) us, the last bin everything above */
+#define PERF_HIST_BINS 16
+
+struct perf_stat {
+	uint32_t count;
+	int64_t sum; /* us */
+	uint32_t min, max; /* us */
+	uint32_t hist[PERF_HIST_BINS];
+};
+
+void perf_record_cycle(int64_t sampled, int64_t estimated, int64_t controlled,
+		int64_t output);
+void perf_record_drop(enum perf_drop drop);
+
+void perf_get_stat(enum perf_stage stage, struct perf_stat *stat);
+uint32_t perf_get_drops(enum perf_drop drop);
+const char *perf_stage_name(enum perf_stage stage);
+const char *perf_drop_name(enum perf_drop drop);
+void perf_reset(void);
+
+#endif /* PERF_H */
@@ -0,0 +1,41 @@
+#ifndef PID_H
+#define PID_H
+
+#include <zephyr.h>
+
+struct pid_gains {
+	float kp; /* per unit of error */
+	float ki; /* per unit of error, per second */
+	float kd; /* per unit/s of measured rate */
+	float kff; /* per unit/s of target rate */
+
+	/* largest contribution of the integral term to the output */
+	float i_limit;
+	/* cutoff of the low-pass filter on the measured rate, 0 to disable */
+	float d_cutoff_hz;
+	/* output is constrained to [-out_limit, out_limit] */
+	float out_limit;
+};
+
+struct pid_state {
+	/* gains can be changed from other threads, see pid_set_gains() */
+	struct k_spinlock lock;
+	struct pid_gains gains;
+
+	/* integral term, already scaled by ki */
+	float integral;
+	float rate_filtered;
+	int64_t prev_time; /* us */
+	float output; /* last output, before the limit was applied */
+};
+
+#define PID_STATE_INIT(...) { .gains = { __VA_ARGS__ } }
+
+void pid_reset(struct pid_state *pid, int64_t time);
+float pid_update(struct pid_state *pid, float error, float rate,
+		float target_rate, int64_t time);
+
+void pid_set_gains(struct pid_state *pid, const struct pid_gains *gains);
+void pid_get_gains(struct pid_state *pid, struct pid_gains *gains);
+
+#endif /* PID_H */
@@ -0,0 +1,9 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <zephyr.h>
+#include <device.h>
+
+void pipeline_init(const struct device *imu_dev, struct k_msgq *mag_msgq);
+
+#endif /* PIPELINE_H */
@@ -0,0 +1,77 @@
+#ifndef PLANT_H
+#define PLANT_H
+
+/*
+ * Model of the tracker hardware: two continuous rotation servos turning
+ * the altitude and azimuth axes, and the IMU and mag riding on them. Plain
+ * C with no Zephyr dependency, so the native_posix emulated drivers and
+ * the host simulator share it.
+ */
+
+#include <stdint.h>
+
+enum plant_axis_id {
+	PLANT_AXIS_ALT = 0,
+	PLANT_AXIS_AZM,
+	PLANT_AXIS_COUNT,
+};
+
+struct plant_axis_config {
+	/* degrees/s at full deflection (1000 or 2000us) */
+	float speed_max;
+	/* us either side of the center pulse the servo doesn't move in */
+	float deadband;
+	/* s, time constant of the servo speed, i.e. the load inertia */
+	float tau;
+	/* degrees of play between the servo and the axis */
+	float backlash;
+	/* degrees either side of level/the base front, 0 for none */
+	float limit;
+};
+
+struct plant_config {
+	struct plant_axis_config axis[PLANT_AXIS_COUNT];
+
+	/* rms noise and constant bias of the sensors, in their units */
+	float gyro_noise; /* rad/s */
+	float gyro_bias[3];
+	float accel_noise; /* m/s^2 */
+	float mag_noise; /* gauss */
+	float temp; /* degrees C */
+
+	/* earth field in gauss, north-west-up */
+	float mag_field[3];
+
+	/* how the sensors are mounted, body to sensor frame */
+	float imu_rot[3][3];
+	float mag_rot[3][3];
+	/* hard and soft iron: sensor = scale * field + offset, per axis */
+	float mag_scale[3];
+	float mag_offset[3];
+
+	uint32_t seed;
+};
+
+struct plant_axis {
+	float motor; /* degrees, the servo output */
+	float motor_rate; /* degrees/s */
+	float angle; /* degrees, the axis, within the backlash of motor */
+	float rate; /* degrees/s */
+};
+
+struct plant_state {
+	struct plant_config config;
+	struct plant_axis axis[PLANT_AXIS_COUNT];
+	uint32_t rng;
+};
+
+void plant_config_default(struct plant_config *config);
+void plant_init(struct plant_state *plant, const struct plant_config *config,
+		float alt, float azm);
+void plant_step(struct plant_state *plant, const int16_t *pwm, float dt);
+void plant_attitude(const struct plant_state *plant, float *q);
+void plant_sample_imu(struct plant_state *plant, float *accel, float *gyro,
+		float *temp);
+void plant_sample_mag(struct plant_state *plant, float *magn);
+
+#endif /* PLANT_H */
@@ -0,0 +1,31 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <zephyr.h>
+
+struct profile_limits {
+	/* units/s, units/s^2 and units/s^3, vel_max 0 disables the profile */
+	float vel_max;
+	float acc_max;
+	float jerk_max;
+};
+
+/*
+ * A jerk-limited reference that chases a target. It keeps its own
+ * position, velocity and acceleration, so a new target simply bends the
+ * current move instead of restarting it.
+ */
+struct profile_state {
+	struct profile_limits limits;
+
+	float pos;
+	float vel;
+	float acc;
+	int64_t prev_time; /* us */
+};
+
+void profile_reset(struct profile_state *profile, float pos, int64_t time);
+void profile_update(struct profile_state *profile, float target,
+		float target_vel, int64_t time);
+
+#endif /* PROFILE_H */
@@ -6,17 +6,26 @@
 enum motor {
 	MOTOR_ALTITUDE = 0,
 	MOTOR_AZIMUTH = 1,
+	MOTOR_COUNT,
 };
 
+/* both axes of one control cycle, always applied together */
 struct motor_setpoint {
-	enum motor motor;
-	int16_t pwm;
+	/* pulse width in us, per motor */
+	int16_t pwm[MOTOR_COUNT];
+	/* us, of the sensor sample the setpoint was computed from */
+	int64_t timestamp;
+	/* us, when the attitude frame and the setpoint were computed */
+	int64_t time_estimated;
+	int64_t time_controlled;
 };
 
 void pwmctrl_device_init(struct k_msgq *msgq);
+int pwmctrl_setup(void);
+void pwmctrl_apply(const struct motor_setpoint *setpoint);
 
-static const double PWM_MIN = 1000;
-static const double PWM_CENTER = 1500;
-static const double PWM_MAX = 2000;
+static const float PWM_MIN = 1000;
+static const float PWM_CENTER = 1500;
+static const float PWM_MAX = 2000;
 
 #endif /* PWMCTRL_H */
@@ -2,5 +2,8 @@
 #define __QUATERNION_H
 
 void quat_to_euler(float *q, float *e);
+void quat_from_euler_rad(float roll, float pitch, float yaw, float *q);
+void quat_normalize(float *q);
+void quat_rotate(const float *q, const float *v, float *out);
 
 #endif
@@ -0,0 +1,21 @@
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <zephyr.h>
+
+#include "records.h"
+#include "blackbox.h"
+#include "telemetry.h"
+
+/*
+ * Hands a record to everything that takes them: the blackbox log and the
+ * binary telemetry stream. Either may drop it, neither blocks.
+ */
+static inline void record_write(enum record_id id, const void *record,
+		size_t len)
+{
+	blackbox_write(id, record, len);
+	telemetry_write(id, record, len);
+}
+
+#endif /* RECORDER_H */
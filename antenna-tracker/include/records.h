@@ -0,0 +1,154 @@
+#ifndef RECORDS_H
+#define RECORDS_H
+
+/*
+ * Blackbox records, the ULog framing they are logged in and the framing
+ * of the binary telemetry stream. Plain C with no Zephyr dependency, so
+ * host tools can share the definitions.
+ *
+ * Every record is a ULog data message whose msg_id is its record_id. The
+ * structs are packed so they match their ULog format field for field,
+ * which is what lets the logger copy them in as they are. ULog is little
+ * endian, like every target and host this runs on.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ULOG_MAGIC {'U', 'L', 'o', 'g', 0x01, 0x12, 0x35}
+#define ULOG_VERSION 1
+
+/* message types, the msg_type of ulog_message_header */
+#define ULOG_MSG_FLAG_BITS 'B'
+#define ULOG_MSG_FORMAT 'F'
+#define ULOG_MSG_INFO 'I'
+#define ULOG_MSG_ADD_LOGGED 'A'
+#define ULOG_MSG_DATA 'D'
+#define ULOG_MSG_DROPOUT 'O'
+
+struct ulog_file_header {
+	uint8_t magic[7];
+	uint8_t version;
+	uint64_t timestamp; /* us */
+} __attribute__((packed));
+
+/* precedes every message, msg_size excludes the header itself */
+struct ulog_message_header {
+	uint16_t msg_size;
+	uint8_t msg_type;
+} __attribute__((packed));
+
+struct ulog_message_flag_bits {
+	uint8_t compat_flags[8];
+	uint8_t incompat_flags[8];
+	uint64_t appended_offsets[3];
+} __attribute__((packed));
+
+enum record_id {
+	RECORD_IMU = 0,
+	RECORD_MAG,
+	RECORD_ATTITUDE,
+	RECORD_SETPOINT,
+	RECORD_OUTPUT,
+	RECORD_COUNT,
+};
+
+/* a raw IMU sample, as the estimator gets it */
+struct record_imu {
+	uint64_t timestamp;
+	float accel[3]; /* m/s^2 */
+	float gyro[3]; /* rad/s */
+	float temp; /* degrees C */
+} __attribute__((packed));
+
+#define RECORD_IMU_FORMAT "imu:uint64_t timestamp;float[3] accel;" \
+	"float[3] gyro;float temp;"
+
+/* a raw magnetometer sample */
+struct record_mag {
+	uint64_t timestamp;
+	float magn[3]; /* gauss */
+} __attribute__((packed));
+
+#define RECORD_MAG_FORMAT "mag:uint64_t timestamp;float[3] magn;"
+
+/* an attitude frame, see struct attitude_frame */
+struct record_attitude {
+	uint64_t timestamp;
+	uint64_t time_estimated;
+	float q[4];
+	float angle[3]; /* degrees */
+	float azimuth; /* degrees, unwrapped */
+	float rate[3]; /* rad/s */
+} __attribute__((packed));
+
+#define RECORD_ATTITUDE_FORMAT "attitude:uint64_t timestamp;" \
+	"uint64_t time_estimated;float[4] q;float[3] angle;float azimuth;" \
+	"float[3] rate;"
+
+/*
+ * One controller step: the command setpoint evaluated at the frame time
+ * and the shaped reference the controllers followed, altitude then
+ * azimuth. The azimuth target and reference are unwrapped.
+ */
+struct record_setpoint {
+	uint64_t timestamp;
+	float target[2]; /* degrees */
+	float target_rate[2]; /* degrees/s */
+	float reference[2]; /* degrees */
+	float reference_rate[2]; /* degrees/s */
+	uint8_t mode; /* enum command_setpoint_mode */
+} __attribute__((packed));
+
+#define RECORD_SETPOINT_FORMAT "setpoint:uint64_t timestamp;float[2] target;" \
+	"float[2] target_rate;float[2] reference;float[2] reference_rate;" \
+	"uint8_t mode;"
+
+/* PWM outputs as written, with the times of each stage that produced them */
+struct record_output {
+	uint64_t timestamp;
+	uint64_t time_sampled;
+	uint64_t time_estimated;
+	uint64_t time_controlled;
+	int16_t pwm[2]; /* us, altitude then azimuth */
+} __attribute__((packed));
+
+#define RECORD_OUTPUT_FORMAT "output:uint64_t timestamp;uint64_t time_sampled;" \
+	"uint64_t time_estimated;uint64_t time_controlled;int16_t[2] pwm;"
+
+/*
+ * Binary telemetry frames carry one record each, interleaved with MAVLink
+ * on the same link. The sync bytes can't start a MAVLink frame (0xfd or
+ * 0xfe), and seq counts every frame sent, so gaps show the frames lost.
+ * The header is followed by len bytes of the record and the CRC of type
+ * through the record, little endian.
+ */
+#define TELEMETRY_SYNC0 0xa5
+#define TELEMETRY_SYNC1 0x5a
+#define TELEMETRY_PAYLOAD_MAX 64
+
+struct telemetry_header {
+	uint8_t sync[2];
+	uint8_t type; /* enum record_id */
+	uint8_t len;
+	uint16_t seq;
+} __attribute__((packed));
+
+#define TELEMETRY_FRAME_MAX (sizeof(struct telemetry_header) + \
+		TELEMETRY_PAYLOAD_MAX + sizeof(uint16_t))
+
+/* CRC-16/CCITT-FALSE: polynomial 0x1021, start with 0xffff */
+static inline uint16_t telemetry_crc16(uint16_t crc, const uint8_t *data,
+		size_t len)
+{
+	for (size_t i = 0;i < len;i++) {
+		crc ^= (uint16_t) data[i] << 8;
+		for (int bit = 0;bit < 8;bit++) {
+			crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+		}
+	}
+
+	return crc;
+}
+
+#endif /* RECORDS_H */
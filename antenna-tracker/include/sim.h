@@ -0,0 +1,11 @@
+#ifndef SIM_H
+#define SIM_H
+
+#include <zephyr.h>
+
+/* the simulated world behind the emulated drivers in src/sim */
+void sim_set_pulse(uint32_t channel, uint32_t pulse_us);
+void sim_sample_imu(float *accel, float *gyro, float *temp);
+void sim_sample_mag(float *magn);
+
+#endif /* SIM_H */
@@ -0,0 +1,34 @@
+#ifndef STATEBUS_H
+#define STATEBUS_H
+
+#include <zephyr.h>
+
+#define STATEBUS_MAX_SUBSCRIBERS 4
+
+/*
+ * A latest-value topic. There is a single publisher per topic, which never
+ * blocks, and any number of readers, which always get a consistent copy of
+ * the most recent value.
+ */
+struct statebus_topic {
+	/* number of values published so far, the newest is in data[seq & 1] */
+	atomic_t seq;
+	void *data[2];
+	size_t size;
+
+	struct k_sem *subscribers[STATEBUS_MAX_SUBSCRIBERS];
+	atomic_t num_subscribers;
+};
+
+#define STATEBUS_TOPIC_DEFINE(name, type) \
+	static type _statebus_data_##name[2]; \
+	struct statebus_topic name = { \
+		.data = {&_statebus_data_##name[0], &_statebus_data_##name[1]}, \
+		.size = sizeof(type), \
+	}
+
+int statebus_subscribe(struct statebus_topic *topic, struct k_sem *sem);
+void statebus_publish(struct statebus_topic *topic, const void *data);
+uint32_t statebus_read(struct statebus_topic *topic, void *data);
+
+#endif /* STATEBUS_H */
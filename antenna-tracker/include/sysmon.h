@@ -0,0 +1,36 @@
+#ifndef SYSMON_H
+#define SYSMON_H
+
+#include <zephyr.h>
+
+/* threads reported on, any past this are left out */
+#define SYSMON_THREADS_MAX 16
+#define SYSMON_NAME_LEN 16
+
+/* one thread over the last sampling period */
+struct sysmon_thread {
+	char name[SYSMON_NAME_LEN];
+	int priority;
+	/* share of the CPU, in hundredths of a percent */
+	uint16_t load;
+	/* times the thread was switched in, 0 without CONFIG_APS_SYSMON_SWITCHES */
+	uint32_t switches;
+	/*
+	 * bytes, used is the high-water mark since the thread started; both
+	 * are 0 when the kernel can't measure the thread's stack
+	 */
+	uint32_t stack_size, stack_used;
+};
+
+struct sysmon_report {
+	int64_t timestamp; /* us, end of the period, 0 before the first */
+	uint32_t period_us;
+	/* everything but the idle thread, in hundredths of a percent */
+	uint16_t load;
+	int count;
+	struct sysmon_thread threads[SYSMON_THREADS_MAX];
+};
+
+void sysmon_get_report(struct sysmon_report *report);
+
+#endif /* SYSMON_H */
@@ -0,0 +1,17 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <zephyr.h>
+
+#include "records.h"
+
+#ifdef CONFIG_APS_TELEMETRY_STREAM
+void telemetry_write(enum record_id id, const void *record, size_t len);
+#else
+static inline void telemetry_write(enum record_id id, const void *record,
+		size_t len)
+{
+}
+#endif
+
+#endif /* TELEMETRY_H */
@@ -0,0 +1,8 @@
+#ifndef TIMESTAMP_H
+#define TIMESTAMP_H
+
+#include <zephyr.h>
+
+int64_t timestamp_us(void);
+
+#endif /* TIMESTAMP_H */
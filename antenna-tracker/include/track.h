@@ -0,0 +1,36 @@
+#ifndef TRACK_H
+#define TRACK_H
+
+#include <zephyr.h>
+
+#include "statebus.h"
+
+/* where a position came from, GLOBAL_POSITION_INT is preferred over GPS_RAW_INT */
+enum track_source {
+	TRACK_SOURCE_GLOBAL_POSITION = 0,
+	TRACK_SOURCE_GPS_RAW,
+};
+
+/*
+ * Constant velocity estimate of the target, in meters east-north-up of
+ * the tracker's home position.
+ */
+struct track_state {
+	bool valid;
+	/* when the target was at pos, with the link latency taken off */
+	int64_t timestamp;
+	float pos[3];
+	float vel[3];
+};
+
+/* the latest track_state, published by the MAVLink RX thread */
+extern struct statebus_topic track_topic;
+
+void track_set_target(uint8_t sysid);
+void track_set_location(int32_t lat, int32_t lon, float alt);
+void track_add_position(uint8_t sysid, enum track_source source,
+		int32_t lat, int32_t lon, float alt, const float *vel_ned,
+		int64_t time_received);
+int track_target(int64_t time, float *angle, float *rate);
+
+#endif /* TRACK_H */
@@ -1,6 +1,11 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+#include <drivers/sensor.h>
+
 float constrain(float value, float low, float high);
+float sensor_value_to_float(const struct sensor_value *val);
+void sensor_value_from_float(struct sensor_value *val, float value);
+float wrap_180(float angle);
 
 #endif /* UTIL_H */
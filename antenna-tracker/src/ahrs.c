@@ -0,0 +1,120 @@
+/**
+ * ahrs.c
+ *
+ * This file contains a quaternion attitude and heading reference system
+ * based on the Mahony nonlinear complementary filter. Gyro rates are
+ * integrated on the quaternion, with accelerometer and tilt compensated
+ * magnetometer errors fed back through a PI controller whose integral term
+ * tracks the gyro bias online.
+ */
+
+#include <math.h>
+
+#include "quaternion.h"
+#include "ahrs.h"
+
+/* below this the horizontal mag field is too weak to trust for heading */
+static const float MAGN_HORIZ_MIN = 0.1f;
+
+static float inv_norm(const float *v)
+{
+	float norm = sqrtf(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+	return (norm > 0) ? 1.0f / norm : 0;
+}
+
+/*
+ * Initializes the filter to the attitude given by a single accelerometer
+ * and magnetometer sample so it doesn't have to converge from identity.
+ */
+void ahrs_init(struct ahrs_state *ahrs, const float *accel, const float *magn,
+		float kp, float ki)
+{
+	float roll = atan2f(accel[1], accel[2]);
+	float pitch = atan2f(-accel[0],
+			sqrtf(accel[1] * accel[1] + accel[2] * accel[2]));
+
+	/* rotate the mag vector into the level frame before taking heading */
+	float sinr = sinf(roll), cosr = cosf(roll);
+	float sinp = sinf(pitch), cosp = cosf(pitch);
+	float mx = magn[0] * cosp + (magn[1] * sinr + magn[2] * cosr) * sinp;
+	float my = magn[1] * cosr - magn[2] * sinr;
+	float yaw = atan2f(-my, mx);
+
+	quat_from_euler_rad(roll, pitch, yaw, ahrs->q);
+
+	for (int i = 0;i < 3;i++) {
+		ahrs->integral[i] = 0;
+	}
+	ahrs->kp = kp;
+	ahrs->ki = ki;
+}
+
+/*
+ * Advances the filter by one IMU sample.
+ *
+ * @param gyro body rates in rad/s
+ * @param accel specific force in any unit
+ * @param magn magnetic field in any unit, or NULL to skip heading correction
+ * @param dt time since the previous update in seconds
+ */
+void ahrs_update(struct ahrs_state *ahrs, const float *gyro, const float *accel,
+		const float *magn, float dt)
+{
+	float *q = ahrs->q;
+	float error[3] = {0};
+	float rate[3];
+
+	/* estimated direction of "up" in the body frame (third row of R) */
+	float vx = 2 * (q[1] * q[3] - q[0] * q[2]);
+	float vy = 2 * (q[0] * q[1] + q[2] * q[3]);
+	float vz = q[0] * q[0] - q[1] * q[1] - q[2] * q[2] + q[3] * q[3];
+
+	/* accel error is the rotation between measured and estimated gravity */
+	float anorm = inv_norm(accel);
+	if (anorm > 0) {
+		float ax = accel[0] * anorm, ay = accel[1] * anorm, az = accel[2] * anorm;
+		error[0] += ay * vz - az * vy;
+		error[1] += az * vx - ax * vz;
+		error[2] += ax * vy - ay * vx;
+	}
+
+	/*
+	 * Rotate the mag vector to the earth frame and only correct heading
+	 * about the vertical axis, so magnetic disturbances can't tilt the
+	 * estimate. This is the tilt compensation, no trig needed.
+	 */
+	float mnorm = magn ? inv_norm(magn) : 0;
+	if (mnorm > 0) {
+		float mx = magn[0] * mnorm, my = magn[1] * mnorm, mz = magn[2] * mnorm;
+		float hx = 2 * (mx * (0.5f - q[2] * q[2] - q[3] * q[3])
+				+ my * (q[1] * q[2] - q[0] * q[3])
+				+ mz * (q[1] * q[3] + q[0] * q[2]));
+		float hy = 2 * (mx * (q[1] * q[2] + q[0] * q[3])
+				+ my * (0.5f - q[1] * q[1] - q[3] * q[3])
+				+ mz * (q[2] * q[3] - q[0] * q[1]));
+		float hnorm = sqrtf(hx * hx + hy * hy);
+
+		if (hnorm > MAGN_HORIZ_MIN) {
+			/* sine of the heading error, applied about earth z */
+			float herr = -hy / hnorm;
+			error[0] += herr * vx;
+			error[1] += herr * vy;
+			error[2] += herr * vz;
+		}
+	}
+
+	for (int i = 0;i < 3;i++) {
+		ahrs->integral[i] += ahrs->ki * error[i] * dt;
+		rate[i] = gyro[i] + ahrs->integral[i] + ahrs->kp * error[i];
+	}
+
+	/* integrate q' = 0.5 * q * (0, rate) */
+	float hdt = 0.5f * dt;
+	float qw = q[0], qx = q[1], qy = q[2], qz = q[3];
+	q[0] += (-qx * rate[0] - qy * rate[1] - qz * rate[2]) * hdt;
+	q[1] += (qw * rate[0] + qy * rate[2] - qz * rate[1]) * hdt;
+	q[2] += (qw * rate[1] - qx * rate[2] + qz * rate[0]) * hdt;
+	q[3] += (qw * rate[2] + qx * rate[1] - qy * rate[0]) * hdt;
+
+	quat_normalize(q);
+}
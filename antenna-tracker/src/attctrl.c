@@ -1,11 +1,18 @@
-#include <stdio.h>
 #include <zephyr.h>
 #include <device.h>
 #include <logging/log.h>
 
 #include "util.h"
+#include "pid.h"
+#include "profile.h"
+#include "param.h"
+#include "quaternion.h"
+#include "timestamp.h"
+#include "perf.h"
+#include "recorder.h"
 #include "pwmctrl.h"
 #include "estimator.h"
+#include "gimbal.h"
 #include "attctrl.h"
 
 LOG_MODULE_REGISTER(attctrl, LOG_LEVEL_DBG);
@@ -18,145 +25,232 @@ extern void attctrl_thread_entry(void *, void *, void *);
 K_THREAD_STACK_DEFINE(attctrl_stack_area, ATTCTRL_STACK_SIZE);
 struct k_thread attctrl_thread_data;
 
-static struct pid_state altitude_pid = {
-	.kp = .025,
-	.ki = 0.00001,
-	.kd = 0.00001,
-
-	.integral = 0,
-	.prev_error = 0,
-	.cur_error = 0,
-	.prev_time = 0,
-	.cur_time = 0,
-};
-
-static struct pid_state azimuth_pid = {
-	.kp = .025,
-	.ki = 0.00001,
-	.kd = 0.00001,
-
-	.integral = 0,
-	.prev_error = 0,
-	.cur_error = 0,
-	.prev_time = 0,
-	.cur_time = 0,
-};
-
-void attctrl_init(struct k_msgq *attitude_msgq, struct k_msgq *pwmctrl_msgq,
-		struct k_msgq *command_msgq)
+/* given for every new attitude frame, multiple frames collapse into one */
+K_SEM_DEFINE(attitude_sem, 0, 1);
+
+static const float RAD_TO_DEG = 180.0f / 3.1415926f;
+
+/*
+ * Outputs are normalized servo commands, errors are in degrees and rates in
+ * degrees/s. The rate terms use the gyro, so kd damps the measured motion.
+ * Gains come from the ATT_* parameters.
+ */
+static struct pid_state altitude_pid = PID_STATE_INIT(.out_limit = 1);
+static struct pid_state azimuth_pid = PID_STATE_INIT(.out_limit = 1);
+
+/* setpoints are shaped into smooth moves before the controllers see them */
+static struct profile_state altitude_profile;
+static struct profile_state azimuth_profile;
+
+/*
+ * Whole turns added to the estimator's unwrapped heading, so that at reset
+ * it is within half a turn of the base front, where the cable is assumed
+ * untwisted.
+ */
+static float azimuth_offset;
+static float azimuth_wrap;
+
+static uint32_t param_gen;
+
+/* the gains of one axis, laid out as consecutive parameters from first */
+static void load_gains(struct pid_state *pid, enum param_id first)
+{
+	float values[6];
+	struct pid_gains gains;
+
+	param_get_float_array(first, values, ARRAY_SIZE(values));
+	pid_get_gains(pid, &gains);
+	gains.kp = values[0];
+	gains.ki = values[1];
+	gains.kd = values[2];
+	gains.kff = values[3];
+	gains.i_limit = values[4];
+	gains.d_cutoff_hz = values[5];
+	pid_set_gains(pid, &gains);
+}
+
+/* the velocity, acceleration and jerk limits of one axis, from first */
+static void load_limits(struct profile_state *profile, enum param_id first)
+{
+	float values[3];
+
+	param_get_float_array(first, values, ARRAY_SIZE(values));
+	profile->limits.vel_max = values[0];
+	profile->limits.acc_max = values[1];
+	profile->limits.jerk_max = values[2];
+}
+
+/* picks up gain changes between steps, so tuning never stalls the loop */
+static void load_params(void)
+{
+	param_gen = param_generation();
+
+	load_gains(&altitude_pid, PARAM_ATT_ALT_KP);
+	load_gains(&azimuth_pid, PARAM_ATT_AZM_KP);
+	load_limits(&altitude_profile, PARAM_ATT_ALT_VMAX);
+	load_limits(&azimuth_profile, PARAM_ATT_AZM_VMAX);
+	azimuth_wrap = param_get_float(PARAM_ATT_AZM_WRAP);
+}
+
+void attctrl_init(struct k_msgq *pwmctrl_msgq)
 {
 	LOG_INF("Initializing attctrl interface");
 
 	k_tid_t attctrl_tid = k_thread_create(&attctrl_thread_data, attctrl_stack_area,
 										  K_THREAD_STACK_SIZEOF(attctrl_stack_area),
 										  attctrl_thread_entry,
-										  (void *) attitude_msgq, (void *) pwmctrl_msgq, 
-										  (void *) command_msgq,
+										  (void *) pwmctrl_msgq, NULL, NULL,
 										  ATTCTRL_PRIORITY, 0, K_NO_WAIT);
+	k_thread_name_set(attctrl_tid, "attctrl");
+}
+
+/* scale the normalized setpoint value [-1, 1] to [PWM_MIN, PWM_MAX] */
+static int16_t setpoint_to_pwm(float setpoint)
+{
+	if (setpoint >= 0) {
+		return (setpoint * (PWM_MAX - PWM_CENTER)) + PWM_CENTER;
+	} else {
+		return (setpoint * (PWM_CENTER - PWM_MIN)) + PWM_CENTER;
+	}
+}
+
+/* starts both controllers from the given frame, call before the first step */
+void attctrl_reset(const struct attitude_frame *att_frame)
+{
+	load_params();
+	pid_reset(&altitude_pid, att_frame->timestamp);
+	pid_reset(&azimuth_pid, att_frame->timestamp);
+
+	float center = gimbal_base_azimuth();
+	azimuth_offset = center + wrap_180(att_frame->azimuth - center) -
+		att_frame->azimuth;
+
+	/* move off from where we are, not from wherever the last run stopped */
+	profile_reset(&altitude_profile, att_frame->angle[0], att_frame->timestamp);
+	profile_reset(&azimuth_profile, att_frame->azimuth + azimuth_offset,
+			att_frame->timestamp);
 }
 
-/* 
- * Processes the latest frame through a pid controller, and returns
- * the next setpoint to apply. This function is generic and is used for both
- * the altitude and azimuth controllers.
- *
- * @param state the state information for the pid controller
- * @param input the latest sensor value (IMU angle, compass heading, etc)
- * 				normalized from -1..1
- * @return setpoint normalized from -1..1
+/*
+ * Picks the unwrapped azimuth to head for: the closest turn of the target
+ * to the current reference, unless that winds the cable past its limit,
+ * in which case the other way round.
  */
-float pid_process(struct pid_state *state, float input, float target, int64_t cur_time)
+static float azimuth_target(float target, float reference)
 {
-	float setpoint;
-	
-	state->prev_error = state->cur_error;
-	state->prev_time = state->cur_time;
-	state->cur_time = cur_time;
-	state->cur_error = (target - input);
-	state->integral += state->cur_error;
-	float dtime = ((double) (state->cur_time - state->prev_time)) / 1000.0;
-
-	float p_term = state->kp * state->cur_error;
-	float i_term = state->ki * state->integral;
-	float d_term = state->kd * ((state->cur_error - state->prev_error) / (dtime));
-
-	setpoint = p_term + i_term + d_term;
-
-	/*printf("%f %f %f %f\n", p_term, i_term, d_term, setpoint);*/
+	float unwrapped = reference + wrap_180(target - reference);
+
+	if (azimuth_wrap <= 0) {
+		return unwrapped;
+	}
+
+	float center = gimbal_base_azimuth();
+	if (unwrapped - center > azimuth_wrap) {
+		unwrapped -= 360;
+	} else if (unwrapped - center < -azimuth_wrap) {
+		unwrapped += 360;
+	}
+
+	/* limits under half a turn leave a range the tracker can't reach */
+	return constrain(unwrapped, center - azimuth_wrap, center + azimuth_wrap);
+}
+
+/*
+ * Runs both controllers on a new attitude frame and fills in the motor
+ * setpoint to apply. The command setpoint is evaluated at the frame time
+ * and shaped by the motion profile, whose velocity is fed forward. The
+ * motor setpoint carries the frame
+ * timestamps, so the latency of each stage up to the motor outputs can be
+ * measured.
+ */
+void attctrl_step(const struct attitude_frame *att_frame,
+		const struct command_setpoint *command_setpoint,
+		struct motor_setpoint *motor_setpoint)
+{
+	if (param_gen != param_generation()) {
+		load_params();
+	}
+
+	float target[GIMBAL_AXIS_COUNT], target_rate[GIMBAL_AXIS_COUNT];
+	gimbal_target(command_setpoint, att_frame->timestamp, target, target_rate);
+
+	profile_update(&altitude_profile, target[GIMBAL_AXIS_ALT],
+			target_rate[GIMBAL_AXIS_ALT], att_frame->timestamp);
+	/* the azimuth reference is unwrapped, so it can follow orbits for good */
+	float azm_target = azimuth_target(target[GIMBAL_AXIS_AZM],
+			azimuth_profile.pos);
+	profile_update(&azimuth_profile, azm_target,
+			target_rate[GIMBAL_AXIS_AZM], att_frame->timestamp);
+
 	/*
-	 * we *should* do better normalization, but for now just
-	 * constrain the setpoint to [-1, 1] and make sure the gains
-	 * are scaled correctly
+	 * The altitude axis turns about body x. The azimuth motor turns about
+	 * the vertical, so take the heading rate in the earth frame.
 	 */
+	float rate_earth[3];
+	quat_rotate(att_frame->q, att_frame->rate, rate_earth);
+	float alt_rate = att_frame->rate[0] * RAD_TO_DEG;
+	float azm_rate = rate_earth[2] * RAD_TO_DEG;
+
+	float alt_error = altitude_profile.pos - att_frame->angle[0];
+	float azm_error = azimuth_profile.pos - (att_frame->azimuth + azimuth_offset);
 
-	setpoint = constrain(setpoint, -1.0, 1.0);
+	float alt_pid_setpoint = pid_update(&altitude_pid, alt_error, alt_rate,
+			altitude_profile.vel, att_frame->timestamp);
+	float azm_pid_setpoint = pid_update(&azimuth_pid, azm_error, azm_rate,
+			azimuth_profile.vel, att_frame->timestamp);
 
-	return setpoint;
+	struct record_setpoint record = {
+		.timestamp = att_frame->timestamp,
+		.target = {target[GIMBAL_AXIS_ALT], azm_target},
+		.target_rate = {target_rate[GIMBAL_AXIS_ALT],
+			target_rate[GIMBAL_AXIS_AZM]},
+		.reference = {altitude_profile.pos, azimuth_profile.pos},
+		.reference_rate = {altitude_profile.vel, azimuth_profile.vel},
+		.mode = command_setpoint->mode,
+	};
+	record_write(RECORD_SETPOINT, &record, sizeof(record));
+
+	int64_t time_controlled = timestamp_us();
+
+	motor_setpoint->pwm[MOTOR_ALTITUDE] = setpoint_to_pwm(alt_pid_setpoint);
+	motor_setpoint->pwm[MOTOR_AZIMUTH] = setpoint_to_pwm(azm_pid_setpoint);
+	motor_setpoint->timestamp = att_frame->timestamp;
+	motor_setpoint->time_estimated = att_frame->time_estimated;
+	motor_setpoint->time_controlled = time_controlled;
 }
 
-void attctrl_thread_entry(void *arg1, void *arg2, void *arg3)
+void attctrl_thread_entry(void *arg1, void *arg2, void *unused3)
 {
 	LOG_INF("Starting attctrl thread");
 
-	struct k_msgq *attitude_msgq = (struct k_msgq *) arg1;
-	struct k_msgq *pwmctrl_msgq = (struct k_msgq *) arg2;
-	struct k_msgq *command_msgq = (struct k_msgq *) arg3;
+	struct k_msgq *pwmctrl_msgq = (struct k_msgq *) arg1;
 
-	struct motor_setpoint altitude_setpoint = {
-		.motor = MOTOR_ALTITUDE,
-	};
-	struct motor_setpoint azimuth_setpoint = {
-		.motor = MOTOR_AZIMUTH,
-	};
+	struct motor_setpoint motor_setpoint;
 
-	struct attitude_frame att_frame;
-	k_msgq_get(attitude_msgq, &att_frame, K_FOREVER);
-	altitude_pid.prev_time = att_frame.timestamp;
+	statebus_subscribe(&attitude_topic, &attitude_sem);
 
-	float target_alt = 0, target_azm = 0;
+	struct attitude_frame att_frame;
+	k_sem_take(&attitude_sem, K_FOREVER);
+	statebus_read(&attitude_topic, &att_frame);
+	attctrl_reset(&att_frame);
 
 	struct command_setpoint command_setpoint;
 
 	while (1) {
-		/* wait for an attitude frame */
-		k_msgq_get(attitude_msgq, &att_frame, K_FOREVER);
-		/* check if there's a new command setpoint (without waiting)
-		 * but use the existing one if not */
-		k_msgq_get(command_msgq, &command_setpoint, K_NO_WAIT);
-
-		target_alt = command_setpoint.data.euler[0];
-		target_azm = 0;//command_setpoint.data.euler[2];
-
-		printf("Angle: %03.1f %03.1f %03.1f\n", att_frame.angle[0], att_frame.angle[1], att_frame.angle[2]);
-		float alt_pid_setpoint = pid_process(&altitude_pid, att_frame.angle[0],
-										 target_alt, att_frame.timestamp);
-
-		/* scale the normalized setpoint value [-1, 1] to [PWM_MIN, PWM_MAX] */
-		if (alt_pid_setpoint >= 0) {
-			altitude_setpoint.pwm = (alt_pid_setpoint * (PWM_MAX - PWM_CENTER)) + PWM_CENTER;
-		} else {
-			altitude_setpoint.pwm = (alt_pid_setpoint * (PWM_CENTER - PWM_MIN)) + PWM_CENTER;
-		}
-
-		float azm_pid_setpoint = pid_process(&azimuth_pid, att_frame.angle[2],
-				target_azm, att_frame.timestamp);
+		/* wait for a new attitude frame */
+		k_sem_take(&attitude_sem, K_FOREVER);
+		statebus_read(&attitude_topic, &att_frame);
+		/* always the newest setpoint, without waiting for it */
+		statebus_read(&setpoint_topic, &command_setpoint);
 
-		/* scale the normalized setpoint value [-1, 1] to [PWM_MIN, PWM_MAX] */
-		if (azm_pid_setpoint >= 0) {
-			azimuth_setpoint.pwm = (azm_pid_setpoint * (PWM_MAX - PWM_CENTER)) + PWM_CENTER;
-		} else {
-			azimuth_setpoint.pwm = (azm_pid_setpoint * (PWM_CENTER - PWM_MIN)) + PWM_CENTER;
-		}
-		/*printf("(%f - %f) = %f; %f %d\n",target, att_frame.angle[0],*/
-				/*(target - att_frame.angle[0]), pid_setpoint, altitude_setpoint.pwm);*/
+		attctrl_step(&att_frame, &command_setpoint,
+				&motor_setpoint);
 
-		while (k_msgq_put(pwmctrl_msgq, &altitude_setpoint, K_NO_WAIT) != 0) {
-			LOG_ERR("Dropping setpoint frames");
-			k_msgq_purge(pwmctrl_msgq);
-		}
-		while (k_msgq_put(pwmctrl_msgq, &azimuth_setpoint, K_NO_WAIT) != 0) {
+		while (k_msgq_put(pwmctrl_msgq, &motor_setpoint, K_NO_WAIT) != 0) {
 			LOG_ERR("Dropping setpoint frames");
+			perf_record_drop(PERF_DROP_PWMCTRL);
 			k_msgq_purge(pwmctrl_msgq);
 		}
 	}
 }
+
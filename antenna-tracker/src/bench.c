@@ -0,0 +1,348 @@
+/**
+ * bench.c
+ *
+ * This file contains microbenchmarks of the control loop's hot paths, run
+ * from the shell with "bench run [name] [iterations]". Every call is timed
+ * on its own with the cycle counter, the timer overhead taken off, and each
+ * benchmark prints one JSON object per line, so the output can be captured
+ * and compared against a baseline by a script. load_1khz is the share of a
+ * 1ms loop period one call takes at the median.
+ *
+ * The firmware keeps running underneath, so the control threads preempt
+ * the benchmarks now and then: min and p50 are the numbers to compare,
+ * max and p99 show the interference. On native_posix simulated time stands
+ * still while code runs, so the host's counters are read instead (see
+ * bench_host.c).
+ */
+
+#include <zephyr.h>
+#include <device.h>
+#include <drivers/sensor.h>
+#include <sys/ring_buffer.h>
+#include <stdlib.h>
+#include <string.h>
+#include <shell/shell.h>
+
+#include "board.h"
+#include "imu.h"
+#include "mag.h"
+#include "estimator.h"
+#include "pid.h"
+#include "quaternion.h"
+#include "util.h"
+#include "mavlink.h"
+
+#ifdef CONFIG_BOARD_NATIVE_POSIX
+#include "bench_host.h"
+#endif
+
+#define BENCH_ITERATIONS 1000
+#define BENCH_ITERATIONS_MAX 2000
+/* warm up the caches and branch predictors before timing */
+#define BENCH_WARMUP 16
+
+/* of the MAVLink byte stream the parser runs over */
+#define BENCH_STREAM_SIZE 1024
+/* room for one attitude status past the tx reserve kept for high priority */
+#define BENCH_RING_SIZE 1024
+
+struct bench {
+	const char *name;
+	/* prepares the inputs, returns 0 or a negative errno to skip */
+	int (*setup)(void);
+	/* one call of the code under test */
+	void (*run)(uint32_t i);
+};
+
+static uint32_t samples[BENCH_ITERATIONS_MAX];
+
+#ifdef CONFIG_BOARD_NATIVE_POSIX
+static inline uint32_t bench_cycles(void)
+{
+	return bench_host_cycles();
+}
+
+static uint32_t bench_cycles_per_sec(void)
+{
+	return bench_host_cycles_per_sec();
+}
+#else
+static inline uint32_t bench_cycles(void)
+{
+	return k_cycle_get_32();
+}
+
+static uint32_t bench_cycles_per_sec(void)
+{
+	return sys_clock_hw_cycles_per_sec();
+}
+#endif
+
+/* inputs of the benchmarks, set up before each run */
+static const struct device *imu_dev;
+static struct sensor_value raw_accel[3], raw_gyro[3], raw_temp;
+static struct imu_sample imu_sample;
+static struct mag_sample mag_sample;
+static struct est_state est;
+static struct attitude_frame att_frame;
+static struct pid_state pid = PID_STATE_INIT(.kp = 0.025f, .ki = 0.005f,
+		.kd = 0.0005f, .i_limit = 0.2f, .d_cutoff_hz = 20, .out_limit = 1);
+static float quat[4], euler[3];
+static uint8_t stream[BENCH_STREAM_SIZE];
+static uint32_t stream_len;
+static uint8_t ring_data[BENCH_RING_SIZE];
+static struct ring_buf ring;
+
+static int imu_convert_setup(void)
+{
+	static const float accel[3] = {-9.7f, 0.12f, 0.35f};
+	static const float gyro[3] = {0.011f, -0.019f, 0.004f};
+
+	for (int i = 0;i < 3;i++) {
+		sensor_value_from_float(&raw_accel[i], accel[i]);
+		sensor_value_from_float(&raw_gyro[i], gyro[i]);
+	}
+	sensor_value_from_float(&raw_temp, 31.5f);
+
+	return 0;
+}
+
+static void imu_convert_run(uint32_t i)
+{
+	imu_convert(raw_accel, raw_gyro, &raw_temp, &imu_sample);
+}
+
+static int sample_imu_setup(void)
+{
+	imu_dev = device_get_binding(IMU_LABEL);
+	if (imu_dev == NULL) {
+		return -ENODEV;
+	}
+
+	return 0;
+}
+
+static void sample_imu_run(uint32_t i)
+{
+	sample_imu(imu_dev, &imu_sample);
+}
+
+/* a tracker sitting level with its front to the north, 1kHz IMU, 10Hz mag */
+static void est_input(uint32_t i)
+{
+	static const float accel[3] = {-9.80665f, 0, 0};
+	static const float gyro[3] = {0.0005f, -0.0003f, 0.0002f};
+	static const float magn[3] = {-0.1f, -0.36f, -0.69f};
+
+	imu_sample.timestamp = (int64_t) i * 1000;
+	memcpy(imu_sample.accel, accel, sizeof(accel));
+	memcpy(imu_sample.gyro, gyro, sizeof(gyro));
+	/* stir the bits a little, so nothing runs on constants */
+	imu_sample.gyro[i % 3] += (i % 7) * 1e-5f;
+	imu_sample.temp = 30;
+
+	mag_sample.timestamp = imu_sample.timestamp;
+	memcpy(mag_sample.magn, magn, sizeof(magn));
+}
+
+static int est_step_setup(void)
+{
+	est_state_init(&est);
+	est.detached = true;
+
+	/* through calibration and initialization, to the running filter */
+	for (uint32_t i = 0;i < 1000;i++) {
+		est_input(i);
+		if (est_step(&est, &imu_sample, &mag_sample, &att_frame) == 0) {
+			return 0;
+		}
+	}
+
+	return -EAGAIN;
+}
+
+static void est_step_run(uint32_t i)
+{
+	/* after the setup's samples, in time */
+	est_input(i + 1000);
+	est_step(&est, &imu_sample, i % 100 == 0 ? &mag_sample : NULL,
+			&att_frame);
+}
+
+static int pid_update_setup(void)
+{
+	pid_reset(&pid, 0);
+	return 0;
+}
+
+static void pid_update_run(uint32_t i)
+{
+	float error = (float) ((int) (i % 64) - 32) * 0.1f;
+
+	pid_update(&pid, error, error * 2, 1.0f, (int64_t) (i + 1) * 1000);
+}
+
+static int quat_to_euler_setup(void)
+{
+	quat[0] = 0.8660254f;
+	quat[1] = 0.1f;
+	quat[2] = 0.3f;
+	quat[3] = 0.3774917f;
+	return 0;
+}
+
+static void quat_to_euler_run(uint32_t i)
+{
+	quat_to_euler(quat, euler);
+}
+
+static int mavlink_parse_setup(void)
+{
+	stream_len = mavlink_bench_stream(stream, sizeof(stream));
+	return 0;
+}
+
+static void mavlink_parse_run(uint32_t i)
+{
+	mavlink_bench_parse_char(stream[i % stream_len]);
+}
+
+static int queue_message_setup(void)
+{
+	ring_buf_init(&ring, sizeof(ring_data), ring_data);
+	return 0;
+}
+
+static void queue_message_run(uint32_t i)
+{
+	/* nothing drains it, start over each time instead */
+	ring_buf_reset(&ring);
+	mavlink_bench_queue(&ring);
+}
+
+static const struct bench benches[] = {
+	{"imu_convert", imu_convert_setup, imu_convert_run},
+	{"sample_imu", sample_imu_setup, sample_imu_run},
+	{"est_step", est_step_setup, est_step_run},
+	{"pid_update", pid_update_setup, pid_update_run},
+	{"quat_to_euler", quat_to_euler_setup, quat_to_euler_run},
+	/* per byte */
+	{"mavlink_parse_char", mavlink_parse_setup, mavlink_parse_run},
+	{"queue_message", queue_message_setup, queue_message_run},
+};
+
+/* insertion sort, a couple of thousand samples at most */
+static void sort_samples(uint32_t *values, uint32_t count)
+{
+	for (uint32_t i = 1;i < count;i++) {
+		uint32_t value = values[i];
+		uint32_t j = i;
+
+		for (;j > 0 && values[j - 1] > value;j--) {
+			values[j] = values[j - 1];
+		}
+		values[j] = value;
+	}
+}
+
+/* cycles two back to back counter reads take */
+static uint32_t timer_overhead(void)
+{
+	uint32_t overhead = UINT32_MAX;
+
+	for (int i = 0;i < 100;i++) {
+		uint32_t start = bench_cycles();
+		uint32_t end = bench_cycles();
+
+		overhead = MIN(overhead, end - start);
+	}
+
+	return overhead;
+}
+
+static void run_bench(const struct shell *shell, const struct bench *bench,
+		uint32_t iterations)
+{
+	int ret = bench->setup();
+	if (ret != 0) {
+		shell_print(shell, "{\"name\":\"%s\",\"error\":%d}", bench->name, ret);
+		return;
+	}
+
+	for (uint32_t i = 0;i < BENCH_WARMUP;i++) {
+		bench->run(i);
+	}
+
+	uint32_t overhead = timer_overhead();
+	uint64_t total = 0;
+
+	for (uint32_t i = 0;i < iterations;i++) {
+		uint32_t start = bench_cycles();
+		bench->run(BENCH_WARMUP + i);
+		uint32_t cycles = bench_cycles() - start;
+
+		samples[i] = cycles > overhead ? cycles - overhead : 0;
+		total += samples[i];
+	}
+
+	sort_samples(samples, iterations);
+
+	uint32_t hz = bench_cycles_per_sec();
+	uint32_t avg = total / iterations;
+	uint32_t p50 = samples[iterations / 2];
+	uint32_t p99 = samples[iterations * 99 / 100];
+	uint32_t ns = (uint64_t) avg * NSEC_PER_SEC / hz;
+	uint32_t per_sec = avg > 0 ? (uint64_t) hz / avg : 0;
+	/* in hundredths of a percent of a 1ms period */
+	uint32_t load = (uint64_t) p50 * 1000 * 10000 / hz;
+
+	shell_print(shell, "{\"name\":\"%s\",\"iterations\":%u,\"clock_hz\":%u,"
+			"\"cycles\":{\"min\":%u,\"p50\":%u,\"p99\":%u,\"max\":%u,"
+			"\"avg\":%u},\"ns_avg\":%u,\"per_sec\":%u,\"load_1khz\":%u.%02u}",
+			bench->name, iterations, hz, samples[0], p50, p99,
+			samples[iterations - 1], avg, ns, per_sec,
+			load / 100, load % 100);
+}
+
+static int cmd_bench_run(const struct shell *shell, size_t argc, char **argv)
+{
+	const char *name = argc > 1 ? argv[1] : "all";
+	uint32_t iterations = argc > 2 ? strtoul(argv[2], NULL, 0) : BENCH_ITERATIONS;
+	bool found = false;
+
+	if (iterations < 1 || iterations > BENCH_ITERATIONS_MAX) {
+		shell_error(shell, "Iterations must be 1 to %d", BENCH_ITERATIONS_MAX);
+		return -EINVAL;
+	}
+
+	for (int i = 0;i < ARRAY_SIZE(benches);i++) {
+		if (strcmp(name, "all") == 0 || strcmp(name, benches[i].name) == 0) {
+			run_bench(shell, &benches[i], iterations);
+			found = true;
+		}
+	}
+
+	if (!found) {
+		shell_error(shell, "No benchmark %s", name);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int cmd_bench_list(const struct shell *shell, size_t argc, char **argv)
+{
+	for (int i = 0;i < ARRAY_SIZE(benches);i++) {
+		shell_print(shell, "%s", benches[i].name);
+	}
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_bench,
+	SHELL_CMD_ARG(run, NULL, "Run benchmarks as JSON lines: [name|all] [iterations]",
+			cmd_bench_run, 1, 2),
+	SHELL_CMD(list, NULL, "List the benchmarks", cmd_bench_list),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(bench, &sub_bench, "Hot path microbenchmarks", NULL);
@@ -0,0 +1,70 @@
+/**
+ * bench_host.c
+ *
+ * This file contains the host side of the benchmarks on native_posix.
+ * Simulated time stands still while code runs there, so the benchmarks
+ * are timed with the host's own counters instead: the time stamp counter
+ * on x86, calibrated against the host's monotonic clock, or that clock
+ * itself elsewhere. It is built against the host C library and includes
+ * no Zephyr headers.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <time.h>
+
+#include "bench_host.h"
+
+/* of host time the TSC is calibrated over */
+#define BENCH_HOST_CALIB_NS 20000000
+
+static uint64_t host_time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+uint32_t bench_host_cycles(void)
+{
+	uint32_t lo, hi;
+
+	__asm__ volatile("rdtsc" : "=a" (lo), "=d" (hi));
+	return lo;
+}
+
+/* the TSC rate, from a busy wait on the host clock */
+uint32_t bench_host_cycles_per_sec(void)
+{
+	static uint32_t hz;
+
+	if (hz == 0) {
+		uint64_t start_ns = host_time_ns();
+		uint32_t start = bench_host_cycles();
+		uint64_t now_ns;
+
+		do {
+			now_ns = host_time_ns();
+		} while (now_ns - start_ns < BENCH_HOST_CALIB_NS);
+
+		hz = (uint64_t) (bench_host_cycles() - start) * 1000000000
+			/ (now_ns - start_ns);
+	}
+
+	return hz;
+}
+#else
+/* no portable cycle counter, count nanoseconds */
+uint32_t bench_host_cycles(void)
+{
+	return (uint32_t) host_time_ns();
+}
+
+uint32_t bench_host_cycles_per_sec(void)
+{
+	return 1000000000;
+}
+#endif
@@ -0,0 +1,608 @@
+/**
+ * blackbox.c
+ *
+ * This file contains the blackbox logger. Raw sensor samples, attitude
+ * frames, controller setpoints and PWM outputs are copied into a RAM ring
+ * as ULog data messages by whichever thread produces them, which costs
+ * the control path a memcpy. A low priority thread drains the ring into a
+ * ULog file on the littlefs partition, so the logs open directly in the
+ * PX4 tools (pyulog, PlotJuggler, Flight Review) once downloaded over
+ * MAVLink.
+ *
+ * Each boot starts a new logNNNNN.ulg. The oldest logs are removed at boot
+ * while the partition is more than three quarters full.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+
+#include <zephyr.h>
+#include <fs/fs.h>
+#include <fs/littlefs.h>
+#include <storage/flash_map.h>
+#include <sys/ring_buffer.h>
+#include <logging/log.h>
+#ifdef CONFIG_SHELL
+#include <shell/shell.h>
+#endif
+
+#include "timestamp.h"
+#include "perf.h"
+#include "records.h"
+#include "blackbox.h"
+
+LOG_MODULE_REGISTER(blackbox, LOG_LEVEL_DBG);
+
+/* littlefs recurses through the metadata, give it room */
+#define BLACKBOX_STACK_SIZE 3000
+#define BLACKBOX_PRIORITY K_LOWEST_APPLICATION_THREAD_PRIO
+
+/* the ring is drained at least this often, and the file synced every second */
+#define BLACKBOX_DRAIN_MS 100
+#define BLACKBOX_SYNC_MS 1000
+
+#define BLACKBOX_MOUNT_POINT "/lfs"
+#define BLACKBOX_PATH_LEN 24
+
+extern void blackbox_thread_entry(void *, void *, void *);
+
+K_THREAD_STACK_DEFINE(blackbox_stack_area, BLACKBOX_STACK_SIZE);
+struct k_thread blackbox_thread_data;
+
+/* given by the producers once the ring is half full */
+K_SEM_DEFINE(blackbox_sem, 0, 1);
+
+FS_LITTLEFS_DECLARE_DEFAULT_CONFIG(blackbox_fs);
+static struct fs_mount_t blackbox_mount = {
+	.type = FS_LITTLEFS,
+	.fs_data = &blackbox_fs,
+	.storage_dev = (void *) FLASH_AREA_ID(blackbox),
+	.mnt_point = BLACKBOX_MOUNT_POINT,
+};
+
+static const struct {
+	const char *name;
+	const char *format;
+	/* only every div-th record is logged */
+	uint8_t div;
+} records[RECORD_COUNT] = {
+	[RECORD_IMU] = {"imu", RECORD_IMU_FORMAT, 1},
+	[RECORD_MAG] = {"mag", RECORD_MAG_FORMAT, 1},
+	[RECORD_ATTITUDE] = {"attitude", RECORD_ATTITUDE_FORMAT,
+		CONFIG_APS_BLACKBOX_STATE_DIV},
+	[RECORD_SETPOINT] = {"setpoint", RECORD_SETPOINT_FORMAT,
+		CONFIG_APS_BLACKBOX_STATE_DIV},
+	[RECORD_OUTPUT] = {"output", RECORD_OUTPUT_FORMAT,
+		CONFIG_APS_BLACKBOX_STATE_DIV},
+};
+
+RING_BUF_DECLARE(blackbox_ring, CONFIG_APS_BLACKBOX_BUFFER_SIZE);
+
+/*
+ * Records come from the sensor, estimator, control and output threads,
+ * so the producers are serialized. The writer thread is the only
+ * consumer and needs no lock.
+ */
+static struct k_spinlock blackbox_lock;
+static bool blackbox_enabled = true;
+/* when records started being dropped, 0 while none are */
+static int64_t dropout_start;
+
+/* each record type has a single producer, which owns its counter */
+static uint8_t record_skip[RECORD_COUNT];
+
+/* the log being written, only the writer thread touches the file */
+static struct fs_file_t log_file;
+static uint16_t log_id;
+static atomic_t log_bytes;
+
+/* serializes the readers and everything that walks the log directory */
+K_MUTEX_DEFINE(log_lock);
+static struct fs_file_t read_file;
+static uint16_t read_id;
+static struct blackbox_log scan_logs[BLACKBOX_LOG_MAX];
+
+struct ulog_message_dropout {
+	struct ulog_message_header header;
+	uint16_t duration; /* ms */
+} __attribute__((packed));
+
+struct ulog_message_add_logged {
+	uint8_t multi_id;
+	uint16_t msg_id;
+} __attribute__((packed));
+
+/*
+ * Queues a record for the log. Never blocks: when the ring is full the
+ * record is dropped, and the gap is marked in the log with a dropout
+ * message ahead of the next record that fits.
+ */
+void blackbox_write(enum record_id id, const void *record, size_t len)
+{
+	if (++record_skip[id] < records[id].div) {
+		return;
+	}
+	record_skip[id] = 0;
+
+	struct ulog_message_header header = {
+		.msg_size = sizeof(uint16_t) + len,
+		.msg_type = ULOG_MSG_DATA,
+	};
+	uint16_t msg_id = id;
+	uint32_t msg_len = sizeof(header) + header.msg_size;
+	bool wake;
+
+	k_spinlock_key_t key = k_spin_lock(&blackbox_lock);
+	if (!blackbox_enabled) {
+		k_spin_unlock(&blackbox_lock, key);
+		return;
+	}
+
+	uint32_t dropout_len = dropout_start != 0 ?
+		sizeof(struct ulog_message_dropout) : 0;
+	if (ring_buf_space_get(&blackbox_ring) < msg_len + dropout_len) {
+		if (dropout_start == 0) {
+			dropout_start = timestamp_us();
+		}
+		k_spin_unlock(&blackbox_lock, key);
+		perf_record_drop(PERF_DROP_BLACKBOX);
+		return;
+	}
+
+	if (dropout_start != 0) {
+		struct ulog_message_dropout dropout = {
+			.header = {
+				.msg_size = sizeof(dropout.duration),
+				.msg_type = ULOG_MSG_DROPOUT,
+			},
+			.duration = MIN((timestamp_us() - dropout_start) / 1000,
+					UINT16_MAX),
+		};
+		ring_buf_put(&blackbox_ring, (uint8_t *) &dropout, sizeof(dropout));
+		dropout_start = 0;
+	}
+
+	ring_buf_put(&blackbox_ring, (uint8_t *) &header, sizeof(header));
+	ring_buf_put(&blackbox_ring, (uint8_t *) &msg_id, sizeof(msg_id));
+	ring_buf_put(&blackbox_ring, record, len);
+	wake = ring_buf_space_get(&blackbox_ring) < CONFIG_APS_BLACKBOX_BUFFER_SIZE / 2;
+	k_spin_unlock(&blackbox_lock, key);
+
+	if (wake) {
+		k_sem_give(&blackbox_sem);
+	}
+}
+
+static void log_path(char *path, uint16_t id)
+{
+	snprintk(path, BLACKBOX_PATH_LEN, BLACKBOX_MOUNT_POINT "/log%05u.ulg", id);
+}
+
+/* the id of a log file name, 0 if it isn't one */
+static uint16_t log_name_id(const char *name)
+{
+	char *end;
+
+	if (strncmp(name, "log", 3) != 0) {
+		return 0;
+	}
+
+	unsigned long id = strtoul(name + 3, &end, 10);
+	if (end == name + 3 || strcmp(end, ".ulg") != 0 || id > UINT16_MAX) {
+		return 0;
+	}
+
+	return id;
+}
+
+/*
+ * Lists the logs on the partition, oldest first. Fills in up to max of
+ * them and the newest id in last_id, call with log_lock held.
+ *
+ * @return the number of logs, or a negative error
+ */
+static int scan(struct blackbox_log *logs, int max, uint16_t *last_id)
+{
+	struct fs_dir_t dir;
+	struct fs_dirent entry;
+	int count = 0;
+
+	if (last_id != NULL) {
+		*last_id = 0;
+	}
+
+	fs_dir_t_init(&dir);
+	int ret = fs_opendir(&dir, BLACKBOX_MOUNT_POINT);
+	if (ret != 0) {
+		return ret;
+	}
+
+	while ((ret = fs_readdir(&dir, &entry)) == 0 && entry.name[0] != '\0') {
+		uint16_t id = log_name_id(entry.name);
+		if (entry.type != FS_DIR_ENTRY_FILE || id == 0) {
+			continue;
+		}
+
+		if (last_id != NULL && id > *last_id) {
+			*last_id = id;
+		}
+
+		/* insertion sort, keeping the oldest max */
+		int i = MIN(count, max);
+		while (i > 0 && logs[i - 1].id > id) {
+			if (i < max) {
+				logs[i] = logs[i - 1];
+			}
+			i--;
+		}
+		if (i < max) {
+			logs[i].id = id;
+			logs[i].size = entry.size;
+		}
+		count++;
+	}
+
+	fs_closedir(&dir);
+	return ret < 0 ? ret : count;
+}
+
+static int remove_log(uint16_t id)
+{
+	char path[BLACKBOX_PATH_LEN];
+
+	if (id == read_id) {
+		fs_close(&read_file);
+		read_id = 0;
+	}
+
+	log_path(path, id);
+	return fs_unlink(path);
+}
+
+/* frees space for the new log, and finds its id */
+static int rotate_logs(uint16_t *last_id)
+{
+	struct fs_statvfs stat;
+
+	k_mutex_lock(&log_lock, K_FOREVER);
+	int count = scan(scan_logs, ARRAY_SIZE(scan_logs), last_id);
+	for (int i = 0;i < MIN(count, ARRAY_SIZE(scan_logs));i++) {
+		if (fs_statvfs(BLACKBOX_MOUNT_POINT, &stat) != 0) {
+			break;
+		}
+
+		bool full = stat.f_bfree < stat.f_blocks / 4;
+		if (!full && count - i < BLACKBOX_LOG_MAX) {
+			break;
+		}
+
+		LOG_INF("Removing log %u to free space", scan_logs[i].id);
+		remove_log(scan_logs[i].id);
+	}
+	k_mutex_unlock(&log_lock);
+
+	return MIN(count, 0);
+}
+
+static int write_all(const void *data, size_t len)
+{
+	ssize_t ret = fs_write(&log_file, data, len);
+	if (ret < 0) {
+		return ret;
+	}
+
+	atomic_add(&log_bytes, ret);
+	return ret == len ? 0 : -ENOSPC;
+}
+
+/* writes a message made of a fixed part followed by an optional string */
+static int write_message(uint8_t type, const void *data, size_t len,
+		const char *str)
+{
+	size_t str_len = str != NULL ? strlen(str) : 0;
+	struct ulog_message_header header = {
+		.msg_size = len + str_len,
+		.msg_type = type,
+	};
+
+	int ret = write_all(&header, sizeof(header));
+	if (ret == 0) {
+		ret = write_all(data, len);
+	}
+	if (ret == 0 && str_len > 0) {
+		ret = write_all(str, str_len);
+	}
+
+	return ret;
+}
+
+/* the file header and definitions, everything before the first record */
+static int write_definitions(void)
+{
+	struct ulog_file_header file_header = {
+		.magic = ULOG_MAGIC,
+		.version = ULOG_VERSION,
+		.timestamp = timestamp_us(),
+	};
+	int ret = write_all(&file_header, sizeof(file_header));
+	if (ret != 0) {
+		return ret;
+	}
+
+	/* nothing optional is used, all flags clear */
+	struct ulog_message_flag_bits flag_bits = {0};
+	ret = write_message(ULOG_MSG_FLAG_BITS, &flag_bits, sizeof(flag_bits), NULL);
+	if (ret != 0) {
+		return ret;
+	}
+
+	/* key length, then the typed key, then the value */
+	static const char sys_name[] = "antenna-tracker";
+	uint8_t info[24];
+	info[0] = snprintk((char *) &info[1], sizeof(info) - 1, "char[%u] sys_name",
+			strlen(sys_name));
+	ret = write_message(ULOG_MSG_INFO, info, 1 + info[0], sys_name);
+	if (ret != 0) {
+		return ret;
+	}
+
+	for (int i = 0;i < RECORD_COUNT;i++) {
+		ret = write_message(ULOG_MSG_FORMAT, NULL, 0, records[i].format);
+		if (ret != 0) {
+			return ret;
+		}
+	}
+
+	for (int i = 0;i < RECORD_COUNT;i++) {
+		struct ulog_message_add_logged add_logged = {
+			.multi_id = 0,
+			.msg_id = i,
+		};
+		ret = write_message(ULOG_MSG_ADD_LOGGED, &add_logged,
+				sizeof(add_logged), records[i].name);
+		if (ret != 0) {
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+static int blackbox_start(void)
+{
+	char path[BLACKBOX_PATH_LEN];
+	uint16_t last_id;
+
+	int ret = fs_mount(&blackbox_mount);
+	if (ret != 0) {
+		LOG_ERR("Unable to mount %s: %d", BLACKBOX_MOUNT_POINT, ret);
+		return ret;
+	}
+
+	ret = rotate_logs(&last_id);
+	if (ret != 0) {
+		LOG_ERR("Unable to list logs: %d", ret);
+		return ret;
+	}
+	if (last_id == UINT16_MAX) {
+		LOG_ERR("Out of log ids, erase the logs");
+		return -ENOSPC;
+	}
+
+	log_path(path, last_id + 1);
+	fs_file_t_init(&log_file);
+	ret = fs_open(&log_file, path, FS_O_CREATE | FS_O_WRITE);
+	if (ret != 0) {
+		LOG_ERR("Unable to create %s: %d", path, ret);
+		return ret;
+	}
+
+	ret = write_definitions();
+	if (ret != 0) {
+		LOG_ERR("Unable to write %s: %d", path, ret);
+		fs_close(&log_file);
+		return ret;
+	}
+
+	log_id = last_id + 1;
+	LOG_INF("Logging to %s", path);
+	return 0;
+}
+
+static void blackbox_stop(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&blackbox_lock);
+	blackbox_enabled = false;
+	k_spin_unlock(&blackbox_lock, key);
+}
+
+/* writes out everything queued so far */
+static int drain(void)
+{
+	uint8_t *data;
+	uint32_t len;
+
+	while ((len = ring_buf_get_claim(&blackbox_ring, &data,
+					CONFIG_APS_BLACKBOX_BUFFER_SIZE)) > 0) {
+		int ret = write_all(data, len);
+		ring_buf_get_finish(&blackbox_ring, len);
+		if (ret != 0) {
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+void blackbox_thread_entry(void *unused1, void *unused2, void *unused3)
+{
+	LOG_INF("Starting blackbox thread");
+
+	if (blackbox_start() != 0) {
+		blackbox_stop();
+		return;
+	}
+
+	int64_t sync_time = k_uptime_get();
+
+	while (1) {
+		k_sem_take(&blackbox_sem, K_MSEC(BLACKBOX_DRAIN_MS));
+
+		int ret = drain();
+		if (ret == 0 && k_uptime_get() - sync_time >= BLACKBOX_SYNC_MS) {
+			sync_time = k_uptime_get();
+			ret = fs_sync(&log_file);
+		}
+
+		if (ret != 0) {
+			LOG_ERR("Stopping log %u: %d", log_id, ret);
+			blackbox_stop();
+			fs_close(&log_file);
+			return;
+		}
+	}
+}
+
+/* records queue up from boot, they are written out once the log is open */
+void blackbox_init(void)
+{
+	k_thread_create(&blackbox_thread_data, blackbox_stack_area,
+			K_THREAD_STACK_SIZEOF(blackbox_stack_area),
+			blackbox_thread_entry,
+			NULL, NULL, NULL,
+			BLACKBOX_PRIORITY, 0, K_NO_WAIT);
+	k_thread_name_set(&blackbox_thread_data, "blackbox");
+}
+
+/*
+ * Lists the logs, oldest first. The one being written only shows what
+ * has been synced, up to a second behind.
+ *
+ * @return the number of logs filled in, or a negative error
+ */
+int blackbox_list(struct blackbox_log *logs, int max)
+{
+	k_mutex_lock(&log_lock, K_FOREVER);
+	int ret = scan(logs, max, NULL);
+	k_mutex_unlock(&log_lock);
+
+	return MIN(ret, max);
+}
+
+/*
+ * Reads part of a log. The file is kept open between calls, so reading a
+ * log through in order is cheap.
+ *
+ * @return the number of bytes read, 0 past the end, or a negative error
+ */
+int blackbox_read(uint16_t id, uint32_t offset, void *data, size_t len)
+{
+	char path[BLACKBOX_PATH_LEN];
+	int ret;
+
+	k_mutex_lock(&log_lock, K_FOREVER);
+	if (read_id != id) {
+		if (read_id != 0) {
+			fs_close(&read_file);
+			read_id = 0;
+		}
+
+		log_path(path, id);
+		fs_file_t_init(&read_file);
+		ret = fs_open(&read_file, path, FS_O_READ);
+		if (ret != 0) {
+			goto end;
+		}
+		read_id = id;
+	}
+
+	ret = fs_seek(&read_file, offset, FS_SEEK_SET);
+	if (ret == 0) {
+		ret = fs_read(&read_file, data, len);
+	}
+
+end:
+	k_mutex_unlock(&log_lock);
+	return ret;
+}
+
+/*
+ * Removes every log but the one being written.
+ *
+ * @return the number of logs removed, or a negative error
+ */
+int blackbox_erase(void)
+{
+	int removed = 0;
+	int count, pass;
+
+	k_mutex_lock(&log_lock, K_FOREVER);
+	do {
+		count = scan(scan_logs, ARRAY_SIZE(scan_logs), NULL);
+		pass = 0;
+		for (int i = 0;i < MIN(count, ARRAY_SIZE(scan_logs));i++) {
+			if (scan_logs[i].id != log_id && remove_log(scan_logs[i].id) == 0) {
+				pass++;
+			}
+		}
+		removed += pass;
+	} while (count > ARRAY_SIZE(scan_logs) && pass > 0);
+	k_mutex_unlock(&log_lock);
+
+	return count < 0 ? count : removed;
+}
+
+#ifdef CONFIG_SHELL
+static int cmd_blackbox_status(const struct shell *shell, size_t argc, char **argv)
+{
+	k_spinlock_key_t key = k_spin_lock(&blackbox_lock);
+	bool enabled = blackbox_enabled;
+	uint32_t queued = CONFIG_APS_BLACKBOX_BUFFER_SIZE -
+		ring_buf_space_get(&blackbox_ring);
+	k_spin_unlock(&blackbox_lock, key);
+
+	shell_print(shell, "log %u: %s, %u bytes written, %u queued, %u dropped",
+			log_id, enabled ? "logging" : "stopped",
+			(uint32_t) atomic_get(&log_bytes), queued,
+			perf_get_drops(PERF_DROP_BLACKBOX));
+	return 0;
+}
+
+static int cmd_blackbox_list(const struct shell *shell, size_t argc, char **argv)
+{
+	static struct blackbox_log logs[BLACKBOX_LOG_MAX];
+
+	int count = blackbox_list(logs, ARRAY_SIZE(logs));
+	if (count < 0) {
+		shell_error(shell, "Unable to list logs: %d", count);
+		return count;
+	}
+
+	for (int i = 0;i < count;i++) {
+		shell_print(shell, "log%05u.ulg %10u", logs[i].id, logs[i].size);
+	}
+
+	return 0;
+}
+
+static int cmd_blackbox_erase(const struct shell *shell, size_t argc, char **argv)
+{
+	int ret = blackbox_erase();
+	if (ret < 0) {
+		shell_error(shell, "Unable to erase logs: %d", ret);
+		return ret;
+	}
+
+	shell_print(shell, "Removed %d logs", ret);
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_blackbox,
+	SHELL_CMD(status, NULL, "Show the log being written", cmd_blackbox_status),
+	SHELL_CMD(list, NULL, "List the logs", cmd_blackbox_list),
+	SHELL_CMD(erase, NULL, "Remove all but the current log", cmd_blackbox_erase),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(blackbox, &sub_blackbox, "Flight data logs", NULL);
+#endif /* CONFIG_SHELL */
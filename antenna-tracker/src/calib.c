@@ -0,0 +1,150 @@
+/**
+ * calib.c
+ *
+ * This file contains persistent storage for sensor calibration, kept in
+ * flash through the settings subsystem so the estimator can start from the
+ * last known calibration instead of recalibrating on every boot.
+ */
+
+#include <string.h>
+
+#include <zephyr.h>
+#include <settings/settings.h>
+#include <logging/log.h>
+
+#include "calib.h"
+
+LOG_MODULE_REGISTER(calib, LOG_LEVEL_DBG);
+
+struct calib_entry {
+	const char *name;
+	void *data;
+	void *pending;
+	size_t size;
+	bool valid;
+	struct k_work save_work;
+};
+
+static struct gyro_calib gyro_calib, gyro_calib_pending;
+
+static struct calib_entry calib_entries[] = {
+	{
+		.name = "gyro",
+		.data = &gyro_calib,
+		.pending = &gyro_calib_pending,
+		.size = sizeof(gyro_calib),
+	},
+};
+
+#define CALIB_GYRO (&calib_entries[0])
+
+static struct k_spinlock calib_lock;
+
+static int calib_set(const char *key, size_t len, settings_read_cb read_cb,
+		void *cb_arg)
+{
+	const char *next;
+
+	for (int i = 0;i < ARRAY_SIZE(calib_entries);i++) {
+		struct calib_entry *entry = &calib_entries[i];
+		if (!settings_name_steq(key, entry->name, &next) || next) {
+			continue;
+		}
+
+		if (len != entry->size) {
+			return -EINVAL;
+		}
+
+		int ret = read_cb(cb_arg, entry->pending, entry->size);
+		if (ret < 0) {
+			return ret;
+		}
+
+		k_spinlock_key_t lock_key = k_spin_lock(&calib_lock);
+		memcpy(entry->data, entry->pending, entry->size);
+		entry->valid = true;
+		k_spin_unlock(&calib_lock, lock_key);
+
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(calib, "calib", NULL, calib_set, NULL, NULL);
+
+/*
+ * Flash writes can take a while (and on the F4 stall the CPU while a sector
+ * is erased), so never do them from the estimator thread.
+ */
+static void calib_save_handler(struct k_work *item)
+{
+	struct calib_entry *entry = CONTAINER_OF(item, struct calib_entry, save_work);
+	uint8_t data[sizeof(struct gyro_calib)];
+	char name[16];
+
+	k_spinlock_key_t key = k_spin_lock(&calib_lock);
+	memcpy(data, entry->pending, entry->size);
+	k_spin_unlock(&calib_lock, key);
+
+	snprintk(name, sizeof(name), "calib/%s", entry->name);
+	int ret = settings_save_one(name, data, entry->size);
+	if (ret != 0) {
+		LOG_ERR("Failed to save %s calibration: %d", entry->name, ret);
+		return;
+	}
+
+	LOG_INF("Saved %s calibration", entry->name);
+}
+
+static int calib_get(struct calib_entry *entry, void *data)
+{
+	int ret = -ENOENT;
+
+	k_spinlock_key_t key = k_spin_lock(&calib_lock);
+	if (entry->valid) {
+		memcpy(data, entry->data, entry->size);
+		ret = 0;
+	}
+	k_spin_unlock(&calib_lock, key);
+
+	return ret;
+}
+
+static void calib_save(struct calib_entry *entry, const void *data)
+{
+	k_spinlock_key_t key = k_spin_lock(&calib_lock);
+	memcpy(entry->data, data, entry->size);
+	memcpy(entry->pending, data, entry->size);
+	entry->valid = true;
+	k_spin_unlock(&calib_lock, key);
+
+	k_work_submit(&entry->save_work);
+}
+
+int calib_init(void)
+{
+	for (int i = 0;i < ARRAY_SIZE(calib_entries);i++) {
+		k_work_init(&calib_entries[i].save_work, calib_save_handler);
+	}
+
+	int ret = settings_subsys_init();
+	if (ret != 0) {
+		LOG_ERR("Failed to initialize settings: %d", ret);
+		return ret;
+	}
+
+	return settings_load_subtree("calib");
+}
+
+/* returns -ENOENT if no calibration has been stored yet */
+int calib_get_gyro(struct gyro_calib *calib)
+{
+	return calib_get(CALIB_GYRO, calib);
+}
+
+/* stores a new calibration, the flash write happens in the background */
+void calib_save_gyro(const struct gyro_calib *calib)
+{
+	calib_save(CALIB_GYRO, calib);
+}
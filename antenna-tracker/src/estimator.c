@@ -1,13 +1,15 @@
 /**
  * estimator.c
  *
- * This file contains a simple state estimator that uses a complimentary filter
- * to estimate the attitude of the antenna tracker, using IMU and magnetometer data.
+ * This file contains the state estimator thread, which runs the quaternion
+ * AHRS in ahrs.c to estimate the attitude of the antenna tracker, using IMU
+ * and magnetometer data.
  *
  * @author Kalyan Sriram <kalyan@coderkalyan.com>
  */
 
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 
 #include <zephyr.h>
@@ -15,6 +17,14 @@
 #include <drivers/sensor.h>
 #include <logging/log.h>
 
+#include "ahrs.h"
+#include "calib.h"
+#include "param.h"
+#include "magcal.h"
+#include "quaternion.h"
+#include "timestamp.h"
+#include "util.h"
+#include "recorder.h"
 #include "estimator.h"
 #include "imu.h"
 #include "mag.h"
@@ -24,164 +34,408 @@ LOG_MODULE_REGISTER(estimator, LOG_LEVEL_DBG);
 #define EST_STACK_SIZE 2000
 #define EST_PRIORITY 0
 
-static const float M_PI = 3.1415926;
+/* AHRS feedback gains: accel/mag trust (rad/s per rad) and gyro bias tracking */
+static const float AHRS_KP = 1.0f;
+static const float AHRS_KI = 0.05f;
+
+/* gyro bias averaging on first boot, when no calibration is stored */
+#define CALIB_SAMPLES 250
+/* how often to check whether the stored gyro calibration needs updating */
+#define CALIB_REFINE_INTERVAL_US (60 * USEC_PER_SEC)
+/* stored calibration further than this from the current temperature is stale */
+static const float CALIB_TEMP_TOLERANCE = 5.0f; /* degrees C */
+/* only rewrite the stored calibration when it has moved by this much */
+static const float CALIB_SAVE_BIAS_DELTA = 0.002f; /* rad/s */
+static const float CALIB_SAVE_TEMP_DELTA = 2.0f; /* degrees C */
 
 extern void est_thread_entry(void *, void *, void *);
 
 K_THREAD_STACK_DEFINE(est_stack_area, EST_STACK_SIZE);
 struct k_thread est_thread_data;
 
-void est_init(struct k_msgq *imu_msgq, struct k_msgq *mag_msgq,
-		struct k_msgq *attitude_msgq)
+STATEBUS_TOPIC_DEFINE(attitude_topic, struct attitude_frame);
+
+#ifdef CONFIG_APS_EST_PROFILE
+#define EST_PROFILE_SAMPLES 1000
+
+/* accumulates the per-sample processing cost and reports the average */
+static void est_profile_record(uint32_t cycles)
+{
+	static uint64_t total_cycles;
+	static uint32_t max_cycles;
+	static uint32_t samples;
+
+	total_cycles += cycles;
+	max_cycles = MAX(max_cycles, cycles);
+	if (++samples < EST_PROFILE_SAMPLES) {
+		return;
+	}
+
+	LOG_INF("%u cycles/sample avg, %u max (%u Hz clock)",
+			(uint32_t) (total_cycles / samples), max_cycles,
+			sys_clock_hw_cycles_per_sec());
+	total_cycles = 0;
+	max_cycles = 0;
+	samples = 0;
+}
+#endif /* CONFIG_APS_EST_PROFILE */
+
+void est_init(struct k_msgq *imu_msgq, struct k_msgq *mag_msgq)
 {
 	LOG_INF("Initializing estimator");
 
 	k_tid_t est_tid = k_thread_create(&est_thread_data, est_stack_area,
 									  K_THREAD_STACK_SIZEOF(est_stack_area),
 									  est_thread_entry,
-									  (void *) imu_msgq, (void *) mag_msgq, 
-									  (void *) attitude_msgq,
+									  (void *) imu_msgq, (void *) mag_msgq, NULL,
 									  EST_PRIORITY, 0, K_NO_WAIT);
+	k_thread_name_set(est_tid, "estimator");
 }
 
 
-void est_thread_entry(void *arg1, void *arg2, void *arg3)
+/* out = m * v */
+static void rotate(const float m[3][3], const float *v, float *out)
 {
-	LOG_DBG("Initializing estimator thread");
+	for (int i = 0;i < 3;i++) {
+		out[i] = (m[i][0] * v[0]) + (m[i][1] * v[1]) + (m[i][2] * v[2]);
+	}
+}
 
-	struct k_msgq *imu_msgq = (struct k_msgq *) arg1;
-	struct k_msgq *mag_msgq = (struct k_msgq *) arg2;
-	struct k_msgq *attitude_msgq = (struct k_msgq *) arg3;
+/* the mag calibration lives in the parameters, so it can be tuned by hand */
+static void load_mag_calib(struct mag_calib *calib)
+{
+	param_get_float_array(PARAM_MAG_OFS_X, calib->offset, 3);
+	param_get_float_array(PARAM_MAG_SI_00, &calib->soft_iron[0][0], 9);
+}
 
-	int64_t time_now, time_prev;
-	double time_delta; /* in seconds */
+static void save_mag_calib(const struct mag_calib *calib)
+{
+	int ret = 0;
 
-	/* imu data */
-	struct imu_sample imu_sample;
-	float gyro_error[3] = {0};
-	float gyro_dangle[3] = {0}, gyro_danglep[3] = {0};
-	float accel_error[3] = {0};
-	float accel_rawp[3] = {0};
-	float accel_angle[3] = {0};
-	float angle[3] = {0};
-
-	/* mag data */
-	struct mag_sample mag_sample;
-	float magn_scaled[3] = {0};
-	float magn_rot[3] = {0};
-	float heading = 0;
-
-	/* imu rotation matrix */
-	float irot[3][3] =
-	{
-		{0, 0, 1},
-		{0, 1, 0},
-		{-1, 0, 0}
+	for (int i = 0;i < 3;i++) {
+		ret |= param_set_float(PARAM_MAG_OFS_X + i, calib->offset[i]);
+	}
+	for (int i = 0;i < 9;i++) {
+		ret |= param_set_float(PARAM_MAG_SI_00 + i, calib->soft_iron[i / 3][i % 3]);
+	}
+
+	if (ret != 0) {
+		LOG_ERR("Mag calibration out of parameter range, not fully applied");
+	}
+}
+
+/*
+ * Picks up parameter changes. Only called between samples, so the loop
+ * never waits on a parameter write.
+ */
+static void load_params(struct est_state *est)
+{
+	est->param_generation = param_generation();
+
+	param_get_float_array(PARAM_EST_IROT_00, &est->irot[0][0], 9);
+	param_get_float_array(PARAM_EST_MROT_00, &est->mrot[0][0], 9);
+	load_mag_calib(&est->mag_calib);
+}
+
+/* applies the mag calibration and rotates the sample into the body frame */
+static void correct_mag(const float mrot[3][3], const struct mag_calib *calib,
+		const struct mag_sample *mag_sample, float *magn_rot)
+{
+	float magn_offset[3], magn_scaled[3];
+
+	for (int i = 0;i < 3;i++) {
+		magn_offset[i] = mag_sample->magn[i] - calib->offset[i];
+	}
+	rotate(calib->soft_iron, magn_offset, magn_scaled);
+
+	rotate(mrot, magn_scaled, magn_rot);
+}
+
+/*
+ * The AHRS integral term holds whatever bias the stored calibration missed,
+ * in the body frame. Rotate it back to the sensor frame and store the
+ * refined bias when it (or the temperature) has drifted noticeably, so the
+ * next boot starts from a better calibration.
+ */
+static void refine_gyro_calib(struct est_state *est, float temp)
+{
+	struct gyro_calib calib;
+	float delta = 0;
+
+	for (int i = 0;i < 3;i++) {
+		calib.bias[i] = est->gyro_calib.bias[i]
+			- ((est->irot[0][i] * est->ahrs.integral[0])
+				+ (est->irot[1][i] * est->ahrs.integral[1])
+				+ (est->irot[2][i] * est->ahrs.integral[2]));
+		delta = MAX(delta, fabsf(calib.bias[i] - est->gyro_calib_saved.bias[i]));
+	}
+	calib.temp = temp;
+
+	if (delta < CALIB_SAVE_BIAS_DELTA &&
+			fabsf(temp - est->gyro_calib_saved.temp) < CALIB_SAVE_TEMP_DELTA) {
+		return;
+	}
+
+	/* the AHRS keeps its integral, only the stored copy moves */
+	if (!est->detached) {
+		calib_save_gyro(&calib);
+	}
+	est->gyro_calib_saved = calib;
+}
+
+/*
+ * Averages the gyro while the tracker is stationary.
+ *
+ * @return true once enough samples have been averaged
+ */
+static bool calibrate_gyro(struct est_state *est,
+		const struct imu_sample *imu_sample)
+{
+	struct gyro_calib *calib = &est->gyro_calib;
+
+	for (int i = 0;i < 3;i++) {
+		calib->bias[i] += imu_sample->gyro[i];
+	}
+	calib->temp += imu_sample->temp;
+
+	if (++est->calib_count < CALIB_SAMPLES) {
+		return false;
+	}
+
+	for (int i = 0;i < 3;i++) {
+		calib->bias[i] /= CALIB_SAMPLES;
+	}
+	calib->temp /= CALIB_SAMPLES;
+
+	if (!est->detached) {
+		calib_save_gyro(calib);
+	}
+	est->gyro_calib_saved = *calib;
+	return true;
+}
+
+/*
+ * Sets up the estimator from the stored calibration, so the loop can close
+ * right away; the AHRS tracks the remaining gyro bias online. Only the very
+ * first boot has to hold still and average.
+ */
+void est_state_init(struct est_state *est)
+{
+	*est = (struct est_state) {
+		.status = EST_STATUS_WAIT_MAG,
+	};
+	load_params(est);
+
+	if (calib_get_gyro(&est->gyro_calib) != 0) {
+		LOG_INF("No stored gyro calibration, calibrating");
+		est->gyro_calib = (struct gyro_calib) {0};
+		est->status = EST_STATUS_CALIBRATING;
+	}
+	est->gyro_calib_saved = est->gyro_calib;
+}
+
+/* takes a new mag sample, which is reused for every IMU sample until the next */
+void est_add_mag(struct est_state *est, const struct mag_sample *mag_sample)
+{
+	if (!est->detached) {
+		struct record_mag record = {
+			.timestamp = mag_sample->timestamp,
+		};
+		memcpy(record.magn, mag_sample->magn, sizeof(record.magn));
+		record_write(RECORD_MAG, &record, sizeof(record));
+	}
+
+	if (est->param_generation != param_generation()) {
+		load_params(est);
+	}
+
+	/* an active calibration takes raw samples as they arrive */
+	if (!est->detached && magcal_add_sample(mag_sample->magn, &est->mag_calib)) {
+		LOG_INF("Applying new mag calibration");
+		save_mag_calib(&est->mag_calib);
+	}
+
+	correct_mag(est->mrot, &est->mag_calib, mag_sample, est->magn_rot);
+	est->have_mag = true;
+}
+
+/* raw samples are logged before anything else, so logs can be replayed */
+static void log_imu(const struct est_state *est,
+		const struct imu_sample *imu_sample)
+{
+	if (est->detached) {
+		return;
+	}
+
+	struct record_imu record = {
+		.timestamp = imu_sample->timestamp,
+		.temp = imu_sample->temp,
 	};
-	/* mag rotation matrix */
-	float mrot[3][3] =
-	{
-		{1, 0, 0},
-		{0, 1, 0},
-		{0, 0, 1},
+	memcpy(record.accel, imu_sample->accel, sizeof(record.accel));
+	memcpy(record.gyro, imu_sample->gyro, sizeof(record.gyro));
+	record_write(RECORD_IMU, &record, sizeof(record));
+}
+
+static void log_attitude(const struct est_state *est,
+		const struct attitude_frame *att_frame)
+{
+	if (est->detached) {
+		return;
+	}
+
+	struct record_attitude record = {
+		.timestamp = att_frame->timestamp,
+		.time_estimated = att_frame->time_estimated,
+		.azimuth = att_frame->azimuth,
 	};
+	memcpy(record.q, att_frame->q, sizeof(record.q));
+	memcpy(record.angle, att_frame->angle, sizeof(record.angle));
+	memcpy(record.rate, att_frame->rate, sizeof(record.rate));
+	record_write(RECORD_ATTITUDE, &record, sizeof(record));
+}
 
-	const float calib_samples = 250;
-	for (int i = 0;i < calib_samples;i++) {
-		k_msgq_get(imu_msgq, &imu_sample, K_FOREVER);
+/*
+ * Runs one estimator step on an IMU sample.
+ *
+ * @return 0 if att_frame holds a new estimate, -EAGAIN while still starting up
+ */
+int est_add_imu(struct est_state *est, const struct imu_sample *imu_sample,
+		struct attitude_frame *att_frame)
+{
+	float gyro_corrected[3];
+	float gyro_rot[3];
+	float accel_rot[3];
+	float euler[3];
 
-		for (int j = 0;j < 3;j++) {
-			gyro_error[j] += imu_sample.gyro[j];
+	log_imu(est, imu_sample);
+
+	if (est->param_generation != param_generation()) {
+		load_params(est);
+	}
+
+	switch (est->status) {
+	case EST_STATUS_CALIBRATING:
+		if (calibrate_gyro(est, imu_sample)) {
+			est->status = EST_STATUS_WAIT_MAG;
+		}
+		return -EAGAIN;
+	case EST_STATUS_WAIT_MAG:
+		if (!est->have_mag) {
+			return -EAGAIN;
+		}
+
+		if (fabsf(imu_sample->temp - est->gyro_calib.temp) > CALIB_TEMP_TOLERANCE) {
+			LOG_WRN("Gyro calibrated at %dC, now %dC; refining online",
+					(int) est->gyro_calib.temp, (int) imu_sample->temp);
 		}
-		accel_error[0] += atan2f(imu_sample.accel[1], imu_sample.accel[2]) * 180.0 / M_PI;
-		accel_error[1] += atan2f(-imu_sample.accel[0], imu_sample.accel[2]) * 180.0 / M_PI;
-		accel_error[2] += atan2f(imu_sample.accel[1], imu_sample.accel[0]) * 180.0 / M_PI;
+
+		/* start the filter from the attitude the first samples give */
+		rotate(est->irot, imu_sample->accel, accel_rot);
+		ahrs_init(&est->ahrs, accel_rot, est->magn_rot, AHRS_KP, AHRS_KI);
+
+		est->time_prev = imu_sample->timestamp;
+		est->time_refine = imu_sample->timestamp;
+		est->status = EST_STATUS_RUNNING;
+		return -EAGAIN;
+	case EST_STATUS_RUNNING:
+		break;
+	}
+
+	float time_delta = (float) (imu_sample->timestamp - est->time_prev) / 1000000.0f;
+	est->time_prev = imu_sample->timestamp;
+
+	/* apply gyro offset and rotate to body frame */
+	for (int i = 0;i < 3;i++) {
+		gyro_corrected[i] = imu_sample->gyro[i] - est->gyro_calib.bias[i];
+	}
+	rotate(est->irot, gyro_corrected, gyro_rot);
+	rotate(est->irot, imu_sample->accel, accel_rot);
+
+	ahrs_update(&est->ahrs, gyro_rot, accel_rot, est->magn_rot, time_delta);
+
+	/*
+	 * Euler angles are only needed by the controllers, so only convert
+	 * once per published frame. quat_to_euler gives pitch, roll, yaw;
+	 * the altitude axis of the tracker is rotation about body x.
+	 */
+	quat_to_euler(est->ahrs.q, euler);
+
+	att_frame->timestamp = imu_sample->timestamp;
+	att_frame->angle[0] = euler[1];
+	att_frame->angle[1] = euler[0];
+	att_frame->angle[2] = euler[2];
+
+	/* add up heading changes, which are never anywhere near half a turn per sample */
+	if (!est->have_azimuth) {
+		est->azimuth = euler[2];
+		est->have_azimuth = true;
+	} else {
+		est->azimuth += wrap_180(euler[2] - est->azimuth);
+	}
+	att_frame->azimuth = est->azimuth;
+	for (int i = 0;i < 4;i++) {
+		att_frame->q[i] = est->ahrs.q[i];
 	}
 	for (int i = 0;i < 3;i++) {
-		gyro_error[i] /= calib_samples;
-		accel_error[i] /= calib_samples;
+		att_frame->rate[i] = gyro_rot[i] + est->ahrs.integral[i];
 	}
 
-	time_now = imu_sample.timestamp;
+	if (imu_sample->timestamp - est->time_refine >= CALIB_REFINE_INTERVAL_US) {
+		est->time_refine = imu_sample->timestamp;
+		refine_gyro_calib(est, imu_sample->temp);
+	}
+
+	att_frame->time_estimated = timestamp_us();
+	log_attitude(est, att_frame);
+
+	return 0;
+}
 
+/*
+ * One iteration of the estimator thread: the mag sample if a new one has
+ * arrived (NULL otherwise), then the IMU sample. Returns as est_add_imu().
+ */
+int est_step(struct est_state *est, const struct imu_sample *imu_sample,
+		const struct mag_sample *mag_sample, struct attitude_frame *att_frame)
+{
+	if (mag_sample != NULL) {
+		est_add_mag(est, mag_sample);
+	}
+
+	return est_add_imu(est, imu_sample, att_frame);
+}
+
+void est_thread_entry(void *arg1, void *arg2, void *unused3)
+{
+	LOG_DBG("Initializing estimator thread");
+
+	struct k_msgq *imu_msgq = (struct k_msgq *) arg1;
+	struct k_msgq *mag_msgq = (struct k_msgq *) arg2;
+
+	static struct est_state est;
+	struct imu_sample imu_sample;
+	struct mag_sample mag_sample;
 	struct attitude_frame att_frame;
 
-	/* make sure we have at least something for both imu and mag */
-	k_msgq_get(imu_msgq, &imu_sample, K_FOREVER);
-	k_msgq_get(mag_msgq, &mag_sample, K_FOREVER);
+	est_state_init(&est);
 
 	while (1) {
 		/* IMU samples much faster than the mag, so synchronize to
 		 * IMU sample rate and reuse mag samples until new ones arrive */
 		k_msgq_get(imu_msgq, &imu_sample, K_FOREVER);
-		k_msgq_get(mag_msgq, &mag_sample, K_NO_WAIT);
-
-		time_prev = time_now;
-		time_now = imu_sample.timestamp;
-		time_delta = ((double) (time_now - time_prev)) / 1000.0;
-
-		/* apply gyro offset, convert to degrees, and calculate
-		 * the difference in angle since previous sample */
-		for (int i = 0;i < 3;i++) {
-			imu_sample.gyro[i] -= gyro_error[i];
-			imu_sample.gyro[i] *= 180.0 / M_PI;
-			gyro_dangle[i] = imu_sample.gyro[i] * time_delta;
+		bool have_mag = k_msgq_get(mag_msgq, &mag_sample, K_NO_WAIT) == 0;
+#ifdef CONFIG_APS_EST_PROFILE
+		uint32_t cycles_start = k_cycle_get_32();
+#endif
+
+		if (est_step(&est, &imu_sample, have_mag ? &mag_sample : NULL,
+					&att_frame) != 0) {
+			continue;
 		}
 
-		/* rotate gyro angle delta to body frame */
-		gyro_danglep[0] = (irot[0][0]*gyro_dangle[0]) + (irot[0][1]*gyro_dangle[1])
-			+ (irot[0][2]*gyro_dangle[2]);
-		gyro_danglep[1] = (irot[1][0]*gyro_dangle[0]) + (irot[1][1]*gyro_dangle[1])
-			+ (irot[1][2]*gyro_dangle[2]);
-		gyro_danglep[2] = (irot[2][0]*gyro_dangle[0]) + (irot[2][1]*gyro_dangle[1])
-			+ (irot[2][2]*gyro_dangle[2]);
-
-		/* rotate accelerometer raw data to body frame */
-		accel_rawp[0] = (irot[0][0]*imu_sample.accel[0]) + (irot[0][1]*imu_sample.accel[1])
-			+ (irot[0][2]*imu_sample.accel[2]);
-		accel_rawp[1] = (irot[1][0]*imu_sample.accel[0]) + (irot[1][1]*imu_sample.accel[1])
-			+ (irot[1][2]*imu_sample.accel[2]);
-		accel_rawp[2] = (irot[2][0]*imu_sample.accel[0]) + (irot[2][1]*imu_sample.accel[1])
-			+ (irot[2][2]*imu_sample.accel[2]);
-
-		/* calculate accelerometer gravity vector angle in degrees */
-		accel_angle[0] = atan2f(accel_rawp[1], accel_rawp[2]) * 180.0 / M_PI;
-		accel_angle[1] = atan2f(-accel_rawp[0], accel_rawp[2]) * 180.0 / M_PI;
-		accel_angle[2] = atan2f(-accel_rawp[1], -accel_rawp[0]) * 180.0 / M_PI;
-		/* and apply offset */
-		/*accel_angle[0] -= accel_error[0];*/
-		/*accel_angle[1] -= accel_error[1];*/
-		/*accel_angle[2] -= accel_error[2];*/
-
-		/* apply mag calibration */
-		magn_scaled[0] = (mag_sample.magn[0] - MAG_OFFSET_X) * MAG_SCALE_X;
-		magn_scaled[1] = (mag_sample.magn[1] - MAG_OFFSET_Y) * MAG_SCALE_Y;
-		magn_scaled[2] = (mag_sample.magn[2] - MAG_OFFSET_Z) * MAG_SCALE_Z;
-
-		/* rotate mag data to body frame */
-		magn_rot[0] = (mrot[0][0]*magn_scaled[0]) + (mrot[0][1]*magn_scaled[1])
-			+ (mrot[0][2]*magn_scaled[2]);
-		magn_rot[1] = (mrot[1][0]*magn_scaled[0]) + (mrot[1][1]*magn_scaled[1])
-			+ (mrot[1][2]*magn_scaled[2]);
-		magn_rot[2] = (mrot[2][0]*magn_scaled[0]) + (mrot[2][1]*magn_scaled[1])
-			+ (mrot[2][2]*magn_scaled[2]);
-
-		/* compute heading */
-		heading = atan2f(magn_rot[1], magn_rot[0]) * 180 / M_PI;
-
-		angle[0] = (0.98 * (angle[0] + gyro_danglep[0])) + (0.02 * accel_angle[0]);
-		angle[1] = (0.98 * (angle[1] + gyro_danglep[1])) + (0.02 * accel_angle[1]);
-		angle[2] = gyro_danglep[2];
-
-		att_frame.timestamp = imu_sample.timestamp;
-		att_frame.angle[0] = angle[0];
-		att_frame.angle[1] = angle[1];
-		att_frame.angle[2] = heading;
-		/*att_frame.angle[2] = angle[2];*/
-
-		while (k_msgq_put(attitude_msgq, &att_frame, K_NO_WAIT) != 0) {
-			LOG_ERR("Dropping attitude frames");
-			k_msgq_purge(attitude_msgq);
-		}
+		statebus_publish(&attitude_topic, &att_frame);
+#ifdef CONFIG_APS_EST_PROFILE
+		est_profile_record(k_cycle_get_32() - cycles_start);
+#endif
 	}
 }
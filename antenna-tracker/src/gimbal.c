@@ -0,0 +1,278 @@
+/**
+ * gimbal.c
+ *
+ * This file contains the gimbal manager: it decides who may point the
+ * tracker (primary/secondary control from MAV_CMD_DO_GIMBAL_MANAGER_CONFIGURE),
+ * turns their angle, rate and lock requests into a command_setpoint, and
+ * publishes it for the attitude controllers.
+ *
+ * Setpoints only change from the MAVLink RX thread, which makes it the single
+ * publisher of setpoint_topic. The controllers evaluate the setpoint at each
+ * attitude frame, so rate and tracking targets move smoothly between
+ * messages.
+ */
+
+#include <math.h>
+
+#include <zephyr.h>
+#include <logging/log.h>
+
+#include "util.h"
+#include "param.h"
+#include "timestamp.h"
+#include "track.h"
+#include "gimbal.h"
+
+LOG_MODULE_REGISTER(gimbal, LOG_LEVEL_DBG);
+
+/* a secondary controller only takes over once the primary has been quiet this long */
+#define GIMBAL_PRIMARY_TIMEOUT_US 1000000
+
+/* rates are streamed setpoints, stop moving if they aren't refreshed */
+static const float COMMAND_RATE_TIMEOUT_S = 1.0f;
+
+/* special ids of MAV_CMD_DO_GIMBAL_MANAGER_CONFIGURE */
+#define GIMBAL_CONFIGURE_UNCHANGED -1
+#define GIMBAL_CONFIGURE_SELF -2
+#define GIMBAL_CONFIGURE_RELEASE -3
+
+STATEBUS_TOPIC_DEFINE(setpoint_topic, struct command_setpoint);
+
+/* control state, written by the RX thread and read by telemetry */
+static struct k_spinlock gimbal_lock;
+static struct gimbal_status gimbal_status = {
+	.flags = GIMBAL_FLAG_PITCH_LOCK | GIMBAL_FLAG_YAW_LOCK,
+};
+static int64_t primary_time = INT64_MIN / 2;
+
+/* the last published setpoint, only the RX thread touches it */
+static struct command_setpoint current;
+
+/* heading the front of the base faces, GMB_YAW_BASE is clockwise from north */
+float gimbal_base_azimuth(void)
+{
+	return -param_get_float(PARAM_GMB_YAW_BASE);
+}
+
+static bool is_sender(uint8_t sysid, uint8_t compid,
+		uint8_t control_sysid, uint8_t control_compid)
+{
+	return sysid == control_sysid && compid == control_compid;
+}
+
+/*
+ * Anyone may point the tracker until a controller is configured. After
+ * that the primary always may, and the secondary only while the primary
+ * isn't sending setpoints.
+ */
+static bool in_control(uint8_t sysid, uint8_t compid)
+{
+	int64_t now = timestamp_us();
+	bool allowed;
+
+	k_spinlock_key_t key = k_spin_lock(&gimbal_lock);
+	struct gimbal_status *status = &gimbal_status;
+	bool has_primary = status->primary_sysid != 0;
+	bool has_secondary = status->secondary_sysid != 0;
+
+	if (!has_primary && !has_secondary) {
+		allowed = true;
+	} else if (has_primary && is_sender(sysid, compid,
+				status->primary_sysid, status->primary_compid)) {
+		primary_time = now;
+		allowed = true;
+	} else if (has_secondary && is_sender(sysid, compid,
+				status->secondary_sysid, status->secondary_compid)) {
+		allowed = !has_primary || now - primary_time > GIMBAL_PRIMARY_TIMEOUT_US;
+	} else {
+		allowed = false;
+	}
+	k_spin_unlock(&gimbal_lock, key);
+
+	return allowed;
+}
+
+static void configure_control(uint8_t sysid, uint8_t compid,
+		int new_sysid, int new_compid,
+		uint8_t *control_sysid, uint8_t *control_compid)
+{
+	switch (new_sysid) {
+	case GIMBAL_CONFIGURE_UNCHANGED:
+		break;
+	case GIMBAL_CONFIGURE_SELF:
+		*control_sysid = sysid;
+		*control_compid = compid;
+		break;
+	case GIMBAL_CONFIGURE_RELEASE:
+		if (is_sender(sysid, compid, *control_sysid, *control_compid)) {
+			*control_sysid = 0;
+			*control_compid = 0;
+		}
+		break;
+	default:
+		*control_sysid = new_sysid;
+		*control_compid = new_compid;
+		break;
+	}
+}
+
+/*
+ * Applies MAV_CMD_DO_GIMBAL_MANAGER_CONFIGURE from sysid/compid. Each pair
+ * takes an id, -1 to leave it, -2 to take control or -3 to release it.
+ *
+ * @return 0, or -EINVAL if an id is out of range
+ */
+int gimbal_configure(uint8_t sysid, uint8_t compid,
+		int primary_sysid, int primary_compid,
+		int secondary_sysid, int secondary_compid)
+{
+	if (primary_sysid < GIMBAL_CONFIGURE_RELEASE || primary_sysid > UINT8_MAX ||
+			secondary_sysid < GIMBAL_CONFIGURE_RELEASE ||
+			secondary_sysid > UINT8_MAX) {
+		return -EINVAL;
+	}
+
+	k_spinlock_key_t key = k_spin_lock(&gimbal_lock);
+	configure_control(sysid, compid, primary_sysid, primary_compid,
+			&gimbal_status.primary_sysid, &gimbal_status.primary_compid);
+	configure_control(sysid, compid, secondary_sysid, secondary_compid,
+			&gimbal_status.secondary_sysid, &gimbal_status.secondary_compid);
+	LOG_INF("Control: primary %u/%u, secondary %u/%u",
+			gimbal_status.primary_sysid, gimbal_status.primary_compid,
+			gimbal_status.secondary_sysid, gimbal_status.secondary_compid);
+	k_spin_unlock(&gimbal_lock, key);
+
+	return 0;
+}
+
+static void publish(const struct command_setpoint *setpoint)
+{
+	current = *setpoint;
+	statebus_publish(&setpoint_topic, &current);
+}
+
+static void set_flags(uint32_t flags)
+{
+	k_spinlock_key_t key = k_spin_lock(&gimbal_lock);
+	gimbal_status.flags = flags;
+	k_spin_unlock(&gimbal_lock, key);
+}
+
+/*
+ * Sets an angle and/or rate target for each axis, NAN where not given. An
+ * axis with only a rate moves on from where its previous target is now, an
+ * axis with neither keeps it. Without GIMBAL_FLAG_YAW_LOCK the azimuth is
+ * relative to the front of the base instead of north. Neutral or retract
+ * ignore the angles and go to the neutral position.
+ *
+ * @return 0, or -EACCES if sysid/compid isn't in control
+ */
+int gimbal_set_angles(uint8_t sysid, uint8_t compid, uint32_t flags,
+		const float *angle, const float *rate)
+{
+	if (!in_control(sysid, compid)) {
+		return -EACCES;
+	}
+
+	set_flags(flags);
+
+	struct command_setpoint setpoint = {
+		.timestamp = timestamp_us(),
+	};
+
+	if (flags & (GIMBAL_FLAG_NEUTRAL | GIMBAL_FLAG_RETRACT)) {
+		setpoint.mode = COMMAND_SETPOINT_MODE_NEUTRAL;
+		publish(&setpoint);
+		return 0;
+	}
+
+	float previous_angle[GIMBAL_AXIS_COUNT], previous_rate[GIMBAL_AXIS_COUNT];
+	gimbal_target(&current, setpoint.timestamp, previous_angle, previous_rate);
+
+	setpoint.mode = COMMAND_SETPOINT_MODE_ANGLE;
+	for (int i = 0;i < GIMBAL_AXIS_COUNT;i++) {
+		if (isfinite(angle[i])) {
+			setpoint.angle[i] = angle[i];
+			if (i == GIMBAL_AXIS_AZM && !(flags & GIMBAL_FLAG_YAW_LOCK)) {
+				setpoint.angle[i] += gimbal_base_azimuth();
+			}
+			setpoint.rate[i] = isfinite(rate[i]) ? rate[i] : 0;
+		} else if (isfinite(rate[i])) {
+			setpoint.angle[i] = previous_angle[i];
+			setpoint.rate[i] = rate[i];
+		} else {
+			setpoint.angle[i] = previous_angle[i];
+			setpoint.rate[i] = previous_rate[i];
+		}
+	}
+
+	publish(&setpoint);
+	return 0;
+}
+
+/*
+ * Switches to neutral or tracking, on behalf of sysid/compid.
+ *
+ * @return 0, or -EACCES if sysid/compid isn't in control
+ */
+int gimbal_set_mode(uint8_t sysid, uint8_t compid,
+		enum command_setpoint_mode mode)
+{
+	if (!in_control(sysid, compid)) {
+		return -EACCES;
+	}
+
+	struct command_setpoint setpoint = {
+		.mode = mode,
+		.timestamp = timestamp_us(),
+	};
+	publish(&setpoint);
+	return 0;
+}
+
+void gimbal_get_status(struct gimbal_status *status)
+{
+	k_spinlock_key_t key = k_spin_lock(&gimbal_lock);
+	*status = gimbal_status;
+	k_spin_unlock(&gimbal_lock, key);
+}
+
+/*
+ * Evaluates a setpoint at the given time: where the controllers should
+ * point and how fast that target is moving. Cheap enough to run on every
+ * attitude frame.
+ */
+void gimbal_target(const struct command_setpoint *setpoint, int64_t time,
+		float *angle, float *rate)
+{
+	switch (setpoint->mode) {
+	case COMMAND_SETPOINT_MODE_ANGLE: {
+		float dt = (time - setpoint->timestamp) / 1000000.0f;
+		bool moving = dt < COMMAND_RATE_TIMEOUT_S;
+		dt = constrain(dt, 0, COMMAND_RATE_TIMEOUT_S);
+
+		for (int i = 0;i < GIMBAL_AXIS_COUNT;i++) {
+			angle[i] = setpoint->angle[i] + setpoint->rate[i] * dt;
+			rate[i] = moving ? setpoint->rate[i] : 0;
+		}
+		break;
+	}
+	case COMMAND_SETPOINT_MODE_TRACK:
+		if (track_target(time, angle, rate) == 0) {
+			break;
+		}
+
+		/* nothing to point at yet, wait in neutral */
+		/* fallthrough */
+	case COMMAND_SETPOINT_MODE_NEUTRAL:
+	default:
+		angle[GIMBAL_AXIS_ALT] = 0;
+		angle[GIMBAL_AXIS_AZM] = gimbal_base_azimuth();
+		rate[GIMBAL_AXIS_ALT] = 0;
+		rate[GIMBAL_AXIS_AZM] = 0;
+		break;
+	}
+
+	angle[GIMBAL_AXIS_ALT] = constrain(angle[GIMBAL_AXIS_ALT], -90, 90);
+	angle[GIMBAL_AXIS_AZM] = wrap_180(angle[GIMBAL_AXIS_AZM]);
+}
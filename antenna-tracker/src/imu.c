@@ -13,13 +13,33 @@
 #include <zephyr.h>
 #include <device.h>
 #include <drivers/sensor.h>
+#include <drivers/i2c.h>
+#include <drivers/gpio.h>
+#include <sys/byteorder.h>
 #include <logging/log.h>
 
 #include "threads.h"
+#include "util.h"
+#include "timestamp.h"
+#include "board.h"
+#include "perf.h"
 #include "imu.h"
 
 LOG_MODULE_REGISTER(imu, LOG_LEVEL_DBG);
 
+/* the channel values of one sensor fetch, in the units of imu_sample */
+void imu_convert(const struct sensor_value *accel, const struct sensor_value *gyro,
+		const struct sensor_value *temp, struct imu_sample *imu_sample)
+{
+	imu_sample->gyro[0] = sensor_value_to_float(&gyro[0]);
+	imu_sample->gyro[1] = sensor_value_to_float(&gyro[1]);
+	imu_sample->gyro[2] = sensor_value_to_float(&gyro[2]);
+	imu_sample->accel[0] = sensor_value_to_float(&accel[0]);
+	imu_sample->accel[1] = sensor_value_to_float(&accel[1]);
+	imu_sample->accel[2] = sensor_value_to_float(&accel[2]);
+	imu_sample->temp = sensor_value_to_float(temp);
+}
+
 int sample_imu(const struct device *dev, struct imu_sample *imu_sample)
 {
 	int64_t time_now;
@@ -27,7 +47,7 @@ int sample_imu(const struct device *dev, struct imu_sample *imu_sample)
 	struct sensor_value accel[3];
 	struct sensor_value temperature;
 
-	time_now = k_uptime_get();
+	time_now = timestamp_us();
 
 	int ret;
 	ret = sensor_sample_fetch(dev);
@@ -41,13 +61,7 @@ int sample_imu(const struct device *dev, struct imu_sample *imu_sample)
 	if (ret != 0) goto end;
 
 	imu_sample->timestamp = time_now;
-	imu_sample->gyro[0] = sensor_value_to_double(&gyro[0]);
-	imu_sample->gyro[1] = sensor_value_to_double(&gyro[1]);
-	imu_sample->gyro[2] = sensor_value_to_double(&gyro[2]);
-	imu_sample->accel[0] = sensor_value_to_double(&accel[0]);
-	imu_sample->accel[1] = sensor_value_to_double(&accel[1]);
-	imu_sample->accel[2] = sensor_value_to_double(&accel[2]);
-	imu_sample->temp = sensor_value_to_double(&temperature);
+	imu_convert(accel, gyro, &temperature, imu_sample);
 
 end:
 	return ret;
@@ -88,6 +102,7 @@ static void handle_mpu6050_trigger(const struct device *dev,
 
 	while (k_msgq_put(&imu_msgq, &imu_sample, K_NO_WAIT) != 0) {
 		LOG_ERR("Dropping IMU samples");
+		perf_record_drop(PERF_DROP_IMU);
 		k_msgq_purge(&imu_msgq);
 	}
 }
@@ -113,6 +128,7 @@ void imu_poll_thread_entry(void *arg1, void *arg2, void *unused3)
 
 		while (k_msgq_put(imu_msgq, &imu_sample, K_NO_WAIT) != 0) {
 			LOG_ERR("Dropping IMU samples");
+			perf_record_drop(PERF_DROP_IMU);
 			k_msgq_purge(imu_msgq);
 		}
 
@@ -121,3 +137,286 @@ void imu_poll_thread_entry(void *arg1, void *arg2, void *unused3)
 }
 #endif /* IMU_POLL_THREAD */
 #endif /* !CONFIG_MPU6050_TRIGGER */
+
+#ifdef CONFIG_APS_IMU_FIFO
+#define MPU6050_REG_SMPLRT_DIV 0x19
+#define MPU6050_REG_CONFIG 0x1A
+#define MPU6050_REG_GYRO_CONFIG 0x1B
+#define MPU6050_REG_ACCEL_CONFIG 0x1C
+#define MPU6050_REG_FIFO_EN 0x23
+#define MPU6050_REG_INT_ENABLE 0x38
+#define MPU6050_REG_USER_CTRL 0x6A
+#define MPU6050_REG_FIFO_COUNTH 0x72
+#define MPU6050_REG_FIFO_R_W 0x74
+
+#define MPU6050_DLPF_188HZ 0x01
+#define MPU6050_FS_SHIFT 3
+#define MPU6050_FS_MASK 0x03
+#define MPU6050_FIFO_EN_TEMP_GYRO_ACCEL 0xF8
+#define MPU6050_USER_CTRL_FIFO_EN BIT(6)
+#define MPU6050_USER_CTRL_FIFO_RESET BIT(2)
+#define MPU6050_INT_ENABLE_DATA_RDY BIT(0)
+
+#define MPU6050_FIFO_SIZE 1024
+/* accel xyz, temp, gyro xyz; 16 bit big endian each */
+#define MPU6050_FIFO_FRAME_SIZE 14
+#define MPU6050_GYRO_RATE_HZ 1000
+
+#define IMU_FIFO_PERIOD_US (USEC_PER_SEC / CONFIG_APS_IMU_FIFO_RATE_HZ)
+
+static const float GRAVITY = 9.80665f;
+static const float DEG_TO_RAD = 3.1415926f / 180.0f;
+
+/* largest burst read; the rest stays in the FIFO until the next drain */
+static uint8_t fifo_buffer[IMU_FIFO_BATCH_MAX * MPU6050_FIFO_FRAME_SIZE];
+
+struct imu_fifo_data {
+	const struct device *i2c;
+	float accel_scale; /* m/s^2 per LSB */
+	float gyro_scale; /* rad/s per LSB */
+	/* frames read out since the last FIFO reset */
+	uint32_t frames_read;
+};
+
+#ifdef IMU_INT_LABEL
+/*
+ * Every sample written to the FIFO raises a data ready pulse. Stamp the
+ * latest one in the interrupt and count them, so that each frame read out
+ * of the FIFO can be matched to the time it was actually sampled.
+ */
+static struct gpio_callback drdy_cb;
+static struct k_spinlock drdy_lock;
+static int64_t drdy_timestamp;
+static uint32_t drdy_count;
+
+static void imu_drdy_handler(const struct device *dev, struct gpio_callback *cb,
+		uint32_t pins)
+{
+	int64_t time_now = timestamp_us();
+
+	k_spinlock_key_t key = k_spin_lock(&drdy_lock);
+	drdy_timestamp = time_now;
+	drdy_count++;
+	k_spin_unlock(&drdy_lock, key);
+}
+
+static int imu_drdy_setup(struct imu_fifo_data *fifo)
+{
+	const struct device *gpio = device_get_binding(IMU_INT_LABEL);
+	if (!gpio) {
+		LOG_ERR("Failed to find GPIO %s", IMU_INT_LABEL);
+		return -ENODEV;
+	}
+
+	int ret = gpio_pin_configure(gpio, IMU_INT_PIN, GPIO_INPUT | IMU_INT_FLAGS);
+	if (ret != 0) return ret;
+
+	gpio_init_callback(&drdy_cb, imu_drdy_handler, BIT(IMU_INT_PIN));
+	ret = gpio_add_callback(gpio, &drdy_cb);
+	if (ret != 0) return ret;
+
+	ret = gpio_pin_interrupt_configure(gpio, IMU_INT_PIN, GPIO_INT_EDGE_TO_ACTIVE);
+	if (ret != 0) return ret;
+
+	return i2c_reg_write_byte(fifo->i2c, IMU_ADDR, MPU6050_REG_INT_ENABLE,
+			MPU6050_INT_ENABLE_DATA_RDY);
+}
+#endif /* IMU_INT_LABEL */
+
+static int imu_fifo_reset(struct imu_fifo_data *fifo)
+{
+	int ret;
+
+	ret = i2c_reg_write_byte(fifo->i2c, IMU_ADDR, MPU6050_REG_USER_CTRL,
+			MPU6050_USER_CTRL_FIFO_RESET);
+	if (ret != 0) return ret;
+
+#ifdef IMU_INT_LABEL
+	k_spinlock_key_t key = k_spin_lock(&drdy_lock);
+	drdy_count = 0;
+	k_spin_unlock(&drdy_lock, key);
+#endif
+	fifo->frames_read = 0;
+
+	return i2c_reg_write_byte(fifo->i2c, IMU_ADDR, MPU6050_REG_USER_CTRL,
+			MPU6050_USER_CTRL_FIFO_EN);
+}
+
+/*
+ * Returns the timestamp of the newest frame read and how many frames
+ * were sampled after it, according to the data ready interrupt. Without
+ * the interrupt, fall back to assuming the newest frame was just sampled.
+ */
+static int64_t imu_fifo_timestamp(struct imu_fifo_data *fifo, int frames,
+		int *frames_after)
+{
+#ifdef IMU_INT_LABEL
+	k_spinlock_key_t key = k_spin_lock(&drdy_lock);
+	int64_t timestamp = drdy_timestamp;
+	uint32_t count = drdy_count;
+	k_spin_unlock(&drdy_lock, key);
+
+	if (count >= fifo->frames_read + frames) {
+		*frames_after = count - (fifo->frames_read + frames);
+		return timestamp;
+	}
+#endif
+	*frames_after = 0;
+	return timestamp_us();
+}
+
+/*
+ * Configures the sample rate and enables the FIFO. The MPU6050 driver has
+ * already woken the chip and programmed the full scale ranges, so read those
+ * back to derive the conversion factors for the raw FIFO data.
+ */
+static int imu_fifo_setup(struct imu_fifo_data *fifo)
+{
+	uint8_t accel_config, gyro_config;
+	int ret;
+
+	fifo->i2c = device_get_binding(IMU_BUS_LABEL);
+	if (!fifo->i2c) {
+		LOG_ERR("Failed to find I2C bus %s", IMU_BUS_LABEL);
+		return -ENODEV;
+	}
+
+	ret = i2c_reg_read_byte(fifo->i2c, IMU_ADDR, MPU6050_REG_ACCEL_CONFIG,
+			&accel_config);
+	if (ret != 0) return ret;
+	ret = i2c_reg_read_byte(fifo->i2c, IMU_ADDR, MPU6050_REG_GYRO_CONFIG,
+			&gyro_config);
+	if (ret != 0) return ret;
+
+	accel_config = (accel_config >> MPU6050_FS_SHIFT) & MPU6050_FS_MASK;
+	gyro_config = (gyro_config >> MPU6050_FS_SHIFT) & MPU6050_FS_MASK;
+	fifo->accel_scale = (2 << accel_config) * GRAVITY / 32768.0f;
+	fifo->gyro_scale = (250 << gyro_config) * DEG_TO_RAD / 32768.0f;
+
+	/* the DLPF fixes the gyro output rate at 1kHz, divide down from there */
+	ret = i2c_reg_write_byte(fifo->i2c, IMU_ADDR, MPU6050_REG_CONFIG,
+			MPU6050_DLPF_188HZ);
+	if (ret != 0) return ret;
+	ret = i2c_reg_write_byte(fifo->i2c, IMU_ADDR, MPU6050_REG_SMPLRT_DIV,
+			MPU6050_GYRO_RATE_HZ / CONFIG_APS_IMU_FIFO_RATE_HZ - 1);
+	if (ret != 0) return ret;
+
+	ret = i2c_reg_write_byte(fifo->i2c, IMU_ADDR, MPU6050_REG_FIFO_EN,
+			MPU6050_FIFO_EN_TEMP_GYRO_ACCEL);
+	if (ret != 0) return ret;
+
+#ifdef IMU_INT_LABEL
+	ret = imu_drdy_setup(fifo);
+	if (ret != 0) {
+		LOG_WRN("No data ready interrupt (%d), stamping at drain time", ret);
+	}
+#endif
+
+	return imu_fifo_reset(fifo);
+}
+
+static void imu_fifo_unpack(struct imu_fifo_data *fifo, const uint8_t *frame,
+		struct imu_sample *imu_sample)
+{
+	for (int i = 0;i < 3;i++) {
+		imu_sample->accel[i] = (int16_t) sys_get_be16(&frame[2 * i])
+			* fifo->accel_scale;
+		imu_sample->gyro[i] = (int16_t) sys_get_be16(&frame[8 + 2 * i])
+			* fifo->gyro_scale;
+	}
+	imu_sample->temp = (int16_t) sys_get_be16(&frame[6]) / 340.0f + 36.53f;
+}
+
+static struct imu_fifo_data imu_fifo;
+
+int imu_fifo_init(void)
+{
+	return imu_fifo_setup(&imu_fifo);
+}
+
+/*
+ * Reads whatever the MPU6050 FIFO holds, up to max samples.
+ * Samples are clocked by the sensor, so timestamps are reconstructed
+ * backwards from the latest data ready time at the configured sample period.
+ *
+ * @return number of samples read, or a negative error code
+ */
+int imu_fifo_read(struct imu_sample *samples, int max)
+{
+	struct imu_fifo_data *fifo = &imu_fifo;
+	uint8_t count_buf[2];
+	uint16_t count;
+	int64_t time_newest;
+	int frames_after;
+	int ret;
+
+	ret = i2c_burst_read(fifo->i2c, IMU_ADDR, MPU6050_REG_FIFO_COUNTH,
+			count_buf, sizeof(count_buf));
+	if (ret != 0) return ret;
+
+	count = sys_get_be16(count_buf);
+	if (count >= MPU6050_FIFO_SIZE - MPU6050_FIFO_FRAME_SIZE ||
+			count % MPU6050_FIFO_FRAME_SIZE != 0) {
+		/* overflowed or lost frame alignment, nothing in there is usable */
+		LOG_ERR("IMU FIFO overflow (%u bytes), resetting", count);
+		ret = imu_fifo_reset(fifo);
+		return (ret != 0) ? ret : 0;
+	}
+
+	int frames = MIN(count / MPU6050_FIFO_FRAME_SIZE, MIN(max, IMU_FIFO_BATCH_MAX));
+	if (frames == 0) {
+		return 0;
+	}
+
+	ret = i2c_burst_read(fifo->i2c, IMU_ADDR, MPU6050_REG_FIFO_R_W,
+			fifo_buffer, frames * MPU6050_FIFO_FRAME_SIZE);
+	if (ret != 0) return ret;
+
+	time_newest = imu_fifo_timestamp(fifo, frames, &frames_after);
+	time_newest -= frames_after * IMU_FIFO_PERIOD_US;
+	fifo->frames_read += frames;
+
+	for (int i = 0;i < frames;i++) {
+		imu_fifo_unpack(fifo, &fifo_buffer[i * MPU6050_FIFO_FRAME_SIZE],
+				&samples[i]);
+		samples[i].timestamp = time_newest - (frames - 1 - i) * IMU_FIFO_PERIOD_US;
+	}
+
+	return frames;
+}
+
+/* IMU FIFO drain loop, replaces the poll loop when the FIFO is enabled */
+void imu_fifo_thread_entry(void *arg1, void *arg2, void *unused3)
+{
+	LOG_DBG("Initializing IMU FIFO thread");
+
+	struct k_msgq *imu_msgq = (struct k_msgq *) arg2;
+
+	static struct imu_sample samples[IMU_FIFO_BATCH_MAX];
+
+	int ret = imu_fifo_init();
+	if (ret != 0) {
+		LOG_ERR("Failed to configure IMU FIFO: %d", ret);
+		return;
+	}
+
+	while (1) {
+		k_sleep(K_MSEC(CONFIG_APS_IMU_FIFO_DRAIN_MS));
+
+		ret = imu_fifo_read(samples, IMU_FIFO_BATCH_MAX);
+		if (ret < 0) {
+			LOG_ERR("Error draining IMU FIFO: %d", ret);
+			continue;
+		}
+
+		/* push the whole batch to the estimator */
+		for (int i = 0;i < ret;i++) {
+			while (k_msgq_put(imu_msgq, &samples[i], K_NO_WAIT) != 0) {
+				LOG_ERR("Dropping IMU samples");
+				perf_record_drop(PERF_DROP_IMU);
+				k_msgq_purge(imu_msgq);
+			}
+		}
+	}
+}
+#endif /* CONFIG_APS_IMU_FIFO */
@@ -14,6 +14,9 @@
 #include <drivers/sensor.h>
 #include <logging/log.h>
 
+#include "util.h"
+#include "timestamp.h"
+#include "perf.h"
 #include "mag.h"
 
 LOG_MODULE_REGISTER(mag, LOG_LEVEL_DBG);
@@ -29,7 +32,7 @@ int sample_mag(const struct device *dev, struct mag_sample *mag_sample)
 	int64_t time_now;
 	struct sensor_value magn[3];
 
-	time_now = k_uptime_get();
+	time_now = timestamp_us();
 
 	int ret;
 	ret = sensor_sample_fetch(dev);
@@ -39,9 +42,9 @@ int sample_mag(const struct device *dev, struct mag_sample *mag_sample)
 	if (ret != 0) goto end;
 
 	mag_sample->timestamp = time_now;
-	mag_sample->magn[0] = sensor_value_to_double(&magn[0]);
-	mag_sample->magn[1] = sensor_value_to_double(&magn[1]);
-	mag_sample->magn[2] = sensor_value_to_double(&magn[2]);
+	mag_sample->magn[0] = sensor_value_to_float(&magn[0]);
+	mag_sample->magn[1] = sensor_value_to_float(&magn[1]);
+	mag_sample->magn[2] = sensor_value_to_float(&magn[2]);
 
 end:
 	return ret;
@@ -84,6 +87,7 @@ static void handle_hmc5883l_trigger(const struct device *dev,
 
 	while (k_msgq_put(mag_trigger_data.mag_msgq, &mag_sample, K_NO_WAIT) != 0) {
 		LOG_ERR("Dropping mag samples");
+		perf_record_drop(PERF_DROP_MAG);
 		k_msgq_purge(mag_trigger_data.mag_msgq);
 	}
 }
@@ -108,6 +112,7 @@ void mag_poll_thread_entry(void *arg1, void *arg2, void *unused3)
 
 		while (k_msgq_put(mag_msgq, &mag_sample, K_NO_WAIT) != 0) {
 			LOG_ERR("Dropping mag samples");
+			perf_record_drop(PERF_DROP_MAG);
 			k_msgq_purge(mag_msgq);
 		}
 
@@ -0,0 +1,309 @@
+/**
+ * magcal.c
+ *
+ * This file contains an on-device magnetometer calibration. While the
+ * tracker is rotated through as many orientations as possible, raw mag
+ * samples are reduced to the normal equations of a general ellipsoid fit
+ *
+ *   a x^2 + b y^2 + c z^2 + 2f yz + 2g xz + 2h xy + 2p x + 2q y + 2r z = 1
+ *
+ * which are solved once enough samples are in. The ellipsoid center is the
+ * hard iron offset and the square root of its shape matrix is the soft iron
+ * correction that maps it back onto a sphere.
+ *
+ * This runs at the mag rate, well off the IMU hot path, so it uses double
+ * precision where the fit needs it.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include <zephyr.h>
+#include <logging/log.h>
+
+#include "magcal.h"
+
+LOG_MODULE_REGISTER(magcal, LOG_LEVEL_DBG);
+
+#define MAGCAL_PARAMS 9
+#define JACOBI_SWEEPS 16
+
+enum magcal_state {
+	MAGCAL_IDLE = 0,
+	MAGCAL_REQUESTED,
+	MAGCAL_COLLECTING,
+};
+
+static atomic_t magcal_state;
+
+/* sufficient statistics: D^T D and D^T 1 for the design matrix D */
+static double dtd[MAGCAL_PARAMS][MAGCAL_PARAMS];
+static double dt1[MAGCAL_PARAMS];
+static int samples;
+
+/* requests a calibration; safe to call from any thread */
+void magcal_start(void)
+{
+	atomic_cas(&magcal_state, MAGCAL_IDLE, MAGCAL_REQUESTED);
+}
+
+bool magcal_running(void)
+{
+	return atomic_get(&magcal_state) != MAGCAL_IDLE;
+}
+
+/* solves a x = b in place for symmetric positive definite a */
+static int cholesky_solve(double a[MAGCAL_PARAMS][MAGCAL_PARAMS], double *b,
+		int n)
+{
+	for (int j = 0;j < n;j++) {
+		double d = a[j][j];
+		for (int k = 0;k < j;k++) {
+			d -= a[j][k] * a[j][k];
+		}
+		if (d <= 0) {
+			return -EDOM;
+		}
+		a[j][j] = sqrt(d);
+
+		for (int i = j + 1;i < n;i++) {
+			double s = a[i][j];
+			for (int k = 0;k < j;k++) {
+				s -= a[i][k] * a[j][k];
+			}
+			a[i][j] = s / a[j][j];
+		}
+	}
+
+	/* forward then back substitution with L and L^T */
+	for (int i = 0;i < n;i++) {
+		for (int k = 0;k < i;k++) {
+			b[i] -= a[i][k] * b[k];
+		}
+		b[i] /= a[i][i];
+	}
+	for (int i = n - 1;i >= 0;i--) {
+		for (int k = i + 1;k < n;k++) {
+			b[i] -= a[k][i] * b[k];
+		}
+		b[i] /= a[i][i];
+	}
+
+	return 0;
+}
+
+/* eigen decomposition of a symmetric 3x3 matrix, m = v diag(e) v^T */
+static void jacobi_eigen(double m[3][3], double e[3], double v[3][3])
+{
+	for (int i = 0;i < 3;i++) {
+		for (int j = 0;j < 3;j++) {
+			v[i][j] = (i == j) ? 1 : 0;
+		}
+	}
+
+	for (int sweep = 0;sweep < JACOBI_SWEEPS;sweep++) {
+		double off = fabs(m[0][1]) + fabs(m[0][2]) + fabs(m[1][2]);
+		if (off < 1e-15) {
+			break;
+		}
+
+		for (int p = 0;p < 2;p++) {
+			for (int q = p + 1;q < 3;q++) {
+				if (m[p][q] == 0) {
+					continue;
+				}
+
+				double theta = (m[q][q] - m[p][p]) / (2 * m[p][q]);
+				double t = ((theta >= 0) ? 1 : -1)
+					/ (fabs(theta) + sqrt(theta * theta + 1));
+				double c = 1 / sqrt(t * t + 1);
+				double s = t * c;
+
+				for (int k = 0;k < 3;k++) {
+					double mkp = m[k][p], mkq = m[k][q];
+					m[k][p] = c * mkp - s * mkq;
+					m[k][q] = s * mkp + c * mkq;
+				}
+				for (int k = 0;k < 3;k++) {
+					double mpk = m[p][k], mqk = m[q][k];
+					m[p][k] = c * mpk - s * mqk;
+					m[q][k] = s * mpk + c * mqk;
+				}
+				for (int k = 0;k < 3;k++) {
+					double vkp = v[k][p], vkq = v[k][q];
+					v[k][p] = c * vkp - s * vkq;
+					v[k][q] = s * vkp + c * vkq;
+				}
+			}
+		}
+	}
+
+	for (int i = 0;i < 3;i++) {
+		e[i] = m[i][i];
+	}
+}
+
+/* 3x3 inverse, returns -EDOM if singular */
+static int invert3(const double m[3][3], double inv[3][3])
+{
+	double det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])
+		- m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+		+ m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+	if (fabs(det) < 1e-30) {
+		return -EDOM;
+	}
+
+	inv[0][0] = (m[1][1] * m[2][2] - m[1][2] * m[2][1]) / det;
+	inv[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) / det;
+	inv[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) / det;
+	inv[1][0] = (m[1][2] * m[2][0] - m[1][0] * m[2][2]) / det;
+	inv[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) / det;
+	inv[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) / det;
+	inv[2][0] = (m[1][0] * m[2][1] - m[1][1] * m[2][0]) / det;
+	inv[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) / det;
+	inv[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) / det;
+
+	return 0;
+}
+
+/* fits the ellipsoid to the accumulated statistics */
+static int magcal_fit(struct mag_calib *calib)
+{
+	double a[MAGCAL_PARAMS][MAGCAL_PARAMS];
+	double p[MAGCAL_PARAMS];
+
+	/* only the lower triangle is accumulated */
+	for (int i = 0;i < MAGCAL_PARAMS;i++) {
+		for (int j = 0;j <= i;j++) {
+			a[i][j] = a[j][i] = dtd[i][j];
+		}
+		p[i] = dt1[i];
+	}
+
+	int ret = cholesky_solve(a, p, MAGCAL_PARAMS);
+	if (ret != 0) {
+		return ret;
+	}
+
+	double shape[3][3] = {
+		{p[0], p[5], p[4]},
+		{p[5], p[1], p[3]},
+		{p[4], p[3], p[2]},
+	};
+	double shape_inv[3][3];
+	ret = invert3(shape, shape_inv);
+	if (ret != 0) {
+		return ret;
+	}
+
+	/* center = -shape^-1 [p q r] */
+	double center[3];
+	for (int i = 0;i < 3;i++) {
+		center[i] = -(shape_inv[i][0] * p[6] + shape_inv[i][1] * p[7]
+				+ shape_inv[i][2] * p[8]);
+	}
+
+	/*
+	 * (x - c)^T shape (x - c) = 1 + c^T shape c. This is negative when
+	 * the offset puts the origin outside the ellipsoid, which flips the
+	 * sign of the fitted shape matrix, so only zero is degenerate.
+	 */
+	double k = 1;
+	for (int i = 0;i < 3;i++) {
+		for (int j = 0;j < 3;j++) {
+			k += center[i] * shape[i][j] * center[j];
+		}
+	}
+	if (fabs(k) < 1e-12) {
+		return -EDOM;
+	}
+
+	double eigval[3], eigvec[3][3];
+	for (int i = 0;i < 3;i++) {
+		for (int j = 0;j < 3;j++) {
+			shape[i][j] /= k;
+		}
+	}
+	jacobi_eigen(shape, eigval, eigvec);
+
+	/* not an ellipsoid, the samples didn't cover enough orientations */
+	if (eigval[0] <= 0 || eigval[1] <= 0 || eigval[2] <= 0) {
+		return -EDOM;
+	}
+
+	/*
+	 * The symmetric square root maps the ellipsoid to the unit sphere
+	 * without rotating it. Scale by the mean radius to stay in gauss.
+	 */
+	double radius = pow(eigval[0] * eigval[1] * eigval[2], -1.0 / 6.0);
+	double root[3];
+	for (int i = 0;i < 3;i++) {
+		root[i] = sqrt(eigval[i]) * radius;
+	}
+
+	for (int i = 0;i < 3;i++) {
+		calib->offset[i] = center[i];
+		for (int j = 0;j < 3;j++) {
+			calib->soft_iron[i][j] = eigvec[i][0] * root[0] * eigvec[j][0]
+				+ eigvec[i][1] * root[1] * eigvec[j][1]
+				+ eigvec[i][2] * root[2] * eigvec[j][2];
+		}
+	}
+
+	LOG_INF("Mag offset %d %d %d mG, radius %d mG",
+			(int) (center[0] * 1000), (int) (center[1] * 1000),
+			(int) (center[2] * 1000), (int) (radius * 1000));
+
+	return 0;
+}
+
+/*
+ * Feeds a raw (uncorrected, sensor frame) mag sample to the calibration.
+ * Called from the estimator thread for every mag sample; does nothing unless
+ * a calibration was requested.
+ *
+ * @return 1 when a new calibration was written to calib, 0 otherwise
+ */
+int magcal_add_sample(const float *magn, struct mag_calib *calib)
+{
+	int state = atomic_get(&magcal_state);
+
+	if (state == MAGCAL_IDLE) {
+		return 0;
+	}
+
+	if (state == MAGCAL_REQUESTED) {
+		LOG_INF("Starting mag calibration, rotate the tracker");
+		memset(dtd, 0, sizeof(dtd));
+		memset(dt1, 0, sizeof(dt1));
+		samples = 0;
+		atomic_set(&magcal_state, MAGCAL_COLLECTING);
+	}
+
+	double x = magn[0], y = magn[1], z = magn[2];
+	double d[MAGCAL_PARAMS] = {
+		x * x, y * y, z * z,
+		2 * y * z, 2 * x * z, 2 * x * y,
+		2 * x, 2 * y, 2 * z,
+	};
+
+	for (int i = 0;i < MAGCAL_PARAMS;i++) {
+		for (int j = 0;j <= i;j++) {
+			dtd[i][j] += d[i] * d[j];
+		}
+		dt1[i] += d[i];
+	}
+
+	if (++samples < MAGCAL_SAMPLES) {
+		return 0;
+	}
+
+	int ret = magcal_fit(calib);
+	atomic_set(&magcal_state, MAGCAL_IDLE);
+	if (ret != 0) {
+		LOG_ERR("Mag calibration failed: %d", ret);
+		return 0;
+	}
+
+	return 1;
+}
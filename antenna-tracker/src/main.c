@@ -5,21 +5,25 @@
 #include "board.h"
 #include "imu.h"
 #include "mag.h"
+#include "calib.h"
+#include "param.h"
 #include "estimator.h"
 #include "pwmctrl.h"
 #include "attctrl.h"
+#include "pipeline.h"
+#include "blackbox.h"
 #include "usb.h"
 #include "mavlink.h"
 
 LOG_MODULE_REGISTER(antenna_tracker, LOG_LEVEL_DBG);
 
-#ifndef CONFIG_MPU6050_TRIGGER
+#if !defined(CONFIG_MPU6050_TRIGGER) && !defined(CONFIG_APS_FUSED_PIPELINE)
 #define IMU_POLL_STACK_SIZE 500
 #define IMU_POLL_PRIORITY 0
 K_THREAD_STACK_DEFINE(imu_poll_stack_area, IMU_POLL_STACK_SIZE);
 struct k_thread imu_poll_thread_data;
 k_tid_t imu_poll_tid;
-#endif /* !CONFIG_MPU6050_TRIGGER */
+#endif /* !CONFIG_MPU6050_TRIGGER && !CONFIG_APS_FUSED_PIPELINE */
 
 #ifndef CONFIG_HMC5883L_TRIGGER
 #define MAG_POLL_STACK_SIZE 500
@@ -29,11 +33,9 @@ struct k_thread mag_poll_thread_data;
 k_tid_t mag_poll_tid;
 #endif /* !CONFIG_HMC5883L_TRIGGER */
 
-K_MSGQ_DEFINE(pwmctrl_msgq, sizeof(struct motor_setpoint), 4, 16);
-K_MSGQ_DEFINE(imu_msgq, sizeof(struct imu_sample), 4, 16);
+K_MSGQ_DEFINE(pwmctrl_msgq, sizeof(struct motor_setpoint), 2, 16);
+K_MSGQ_DEFINE(imu_msgq, sizeof(struct imu_sample), IMU_MSGQ_DEPTH, 16);
 K_MSGQ_DEFINE(mag_msgq, sizeof(struct mag_sample), 4, 16);
-K_MSGQ_DEFINE(attitude_msgq, sizeof(struct attitude_frame), 4, 16);
-K_MSGQ_DEFINE(command_msgq, sizeof(struct command_setpoint), 2, 32);
 
 #define RING_BUF_SIZE 2048
 uint8_t rx_ring_buffer[RING_BUF_SIZE];
@@ -50,7 +52,7 @@ void main(void)
 		return;
 	}
 
-#ifdef CONFIG_MPU6050_TRIGGER
+#if defined(CONFIG_MPU6050_TRIGGER) && !defined(CONFIG_APS_FUSED_PIPELINE)
 	int ret;
 	ret = setup_mpu6050_trigger(mpu6050);
 	if (ret != 0) {
@@ -59,12 +61,22 @@ void main(void)
 	}
 #endif
 
-#ifndef CONFIG_MPU6050_TRIGGER
+#if defined(CONFIG_APS_FUSED_PIPELINE)
+	/* the pipeline samples the IMU itself */
+#elif defined(CONFIG_APS_IMU_FIFO)
+	imu_poll_tid = k_thread_create(&imu_poll_thread_data, imu_poll_stack_area,
+			K_THREAD_STACK_SIZEOF(imu_poll_stack_area),
+			imu_fifo_thread_entry,
+			(void *) mpu6050, (void *) &imu_msgq, NULL,
+			IMU_POLL_PRIORITY, 0, K_NO_WAIT);
+	k_thread_name_set(imu_poll_tid, "imu");
+#elif !defined(CONFIG_MPU6050_TRIGGER)
 	imu_poll_tid = k_thread_create(&imu_poll_thread_data, imu_poll_stack_area,
 			K_THREAD_STACK_SIZEOF(imu_poll_stack_area),
 			imu_poll_thread_entry,
 			(void *) mpu6050, (void *) &imu_msgq, NULL,
 			IMU_POLL_PRIORITY, 0, K_NO_WAIT);
+	k_thread_name_set(imu_poll_tid, "imu");
 #endif
 
 	/* mag setup */
@@ -89,13 +101,30 @@ void main(void)
 			mag_poll_thread_entry,
 			(void *) hmc5883l, (void *) &mag_msgq, NULL,
 			MAG_POLL_PRIORITY, 0, K_NO_WAIT);
+	k_thread_name_set(mag_poll_tid, "mag");
+#endif
+
+	/* load stored calibration and parameters before the estimator needs them */
+	if (calib_init() != 0) {
+		LOG_WRN("Unable to load calibration, starting uncalibrated");
+	}
+	if (param_init() != 0) {
+		LOG_WRN("Unable to load parameters, using defaults");
+	}
+
+#ifdef CONFIG_APS_BLACKBOX
+	blackbox_init();
 #endif
 
+#ifdef CONFIG_APS_FUSED_PIPELINE
+	pipeline_init(mpu6050, &mag_msgq);
+#else
 	/* initialize the attitude estimator */
-	est_init(&imu_msgq, &mag_msgq, &attitude_msgq);
+	est_init(&imu_msgq, &mag_msgq);
 
 	pwmctrl_device_init(&pwmctrl_msgq);
-	attctrl_init(&attitude_msgq, &pwmctrl_msgq, &command_msgq);
+	attctrl_init(&pwmctrl_msgq);
+#endif
 
 	const struct device *usb_dev = usb_init("CDC_ACM_0", &rx_ringbuf, &tx_ringbuf);
 	if (!usb_dev) {
@@ -106,26 +135,6 @@ void main(void)
 	ring_buf_init(&rx_ringbuf, sizeof(rx_ring_buffer), rx_ring_buffer);
 	ring_buf_init(&tx_ringbuf, sizeof(tx_ring_buffer), tx_ring_buffer);
 
+	/* setpoints arrive over MAVLink from here on */
 	init_mavlink(usb_dev, &rx_ringbuf, &tx_ringbuf);
-
-	struct command_setpoint setpoint = {
-		.type = COMMAND_SETPOINT_TYPE_EULER,
-		.data.euler[0] = 0,
-		.data.euler[1] = 0,
-		.data.euler[2] = 0,
-	};
-
-	while (1) {
-		setpoint.data.euler[0] += 15;
-		if (setpoint.data.euler[0] > 60) {
-			setpoint.data.euler[0] = 0;
-		}
-
-		while (k_msgq_put(&command_msgq, &setpoint, K_NO_WAIT) != 0) {
-			LOG_ERR("Dropping setpoint frames");
-			k_msgq_purge(&command_msgq);
-		}
-		
-		k_sleep(K_MSEC(2000));
-	}
 }
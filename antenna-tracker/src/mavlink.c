@@ -1,44 +1,170 @@
+#include <string.h>
+#include <math.h>
 #include <zephyr.h>
 #include <device.h>
 #include <drivers/uart.h>
 #include <sys/ring_buffer.h>
 #include <logging/log.h>
+#ifdef CONFIG_SHELL
+#include <shell/shell.h>
+#endif
 
 #include "mavlink/common/mavlink.h"
 #include "mavlink/mavlink_helpers.h"
 
+#include "util.h"
+#include "timestamp.h"
 #include "quaternion.h"
+#include "magcal.h"
+#include "estimator.h"
+#include "perf.h"
+#include "sysmon.h"
+#include "param.h"
+#include "gimbal.h"
+#include "track.h"
+#include "blackbox.h"
 #include "mavlink.h"
 
 LOG_MODULE_REGISTER(mavlink, LOG_LEVEL_DBG);
 
-int chan = MAVLINK_COMM_0;
-mavlink_status_t rstatus;
-mavlink_message_t rmsg;
-
-uint8_t aps_sys_id = 220;
-uint8_t aps_comp_id = MAV_COMP_ID_GIMBAL;
-
-uint8_t sysid_primary_control;
-uint8_t compid_primary_control;
-uint8_t sysid_secondary_control;
-uint8_t compid_secondary_control;
-
-#define MAVLINK_BUFFER_LEN 2041
-uint8_t send_buffer[MAVLINK_BUFFER_LEN];
-
-struct k_timer tim_heartbeat;
-struct k_work heartbeat_work;
-struct k_timer tim_gimbal_status;
-struct k_work gimbal_status_work;
-struct k_timer tim_attitude_status;
-struct k_work attitude_status_work;
-struct k_work gimbal_manager_info_work;
-
-float gimbal_quat[4];
-float gimbal_angular_vel_x;
-float gimbal_angular_vel_y;
-float gimbal_angular_vel_z;
+#define MAVLINK_RX_STACK_SIZE 2000
+#define MAVLINK_RX_PRIORITY 0
+
+extern void mavlink_rx_thread_entry(void *, void *, void *);
+
+K_THREAD_STACK_DEFINE(mavlink_rx_stack_area, MAVLINK_RX_STACK_SIZE);
+struct k_thread mavlink_rx_thread_data;
+
+/* given by the USB ISR whenever bytes land in the rx ring */
+K_SEM_DEFINE(mavlink_rx_sem, 0, 1);
+
+/* per channel parser state, only the RX thread touches these */
+struct mavlink_channel {
+	mavlink_status_t status;
+	mavlink_message_t msg;
+	uint8_t last_parse_error;
+
+	/* sender and sequence of the last message, to count lost ones */
+	uint8_t last_sysid, last_compid, last_seq;
+	bool have_seq;
+};
+
+static struct mavlink_channel channels[MAVLINK_CHANNELS];
+static struct mavlink_rx_stats rx_stats[MAVLINK_CHANNELS];
+
+/* parameter list is sent a few at a time so it never floods the tx buffer */
+#define PARAM_LIST_INTERVAL_MS 10
+#define PARAM_LIST_BURST 4
+
+static const float RAD_TO_DEG = 180.0f / 3.1415926f;
+
+/* the gimbal manager keeps MAVLink's flag bits, so they pass straight through */
+BUILD_ASSERT(GIMBAL_FLAG_RETRACT == GIMBAL_MANAGER_FLAGS_RETRACT &&
+		GIMBAL_FLAG_NEUTRAL == GIMBAL_MANAGER_FLAGS_NEUTRAL &&
+		GIMBAL_FLAG_ROLL_LOCK == GIMBAL_MANAGER_FLAGS_ROLL_LOCK &&
+		GIMBAL_FLAG_PITCH_LOCK == GIMBAL_MANAGER_FLAGS_PITCH_LOCK &&
+		GIMBAL_FLAG_YAW_LOCK == GIMBAL_MANAGER_FLAGS_YAW_LOCK,
+		"gimbal flags differ from GIMBAL_MANAGER_FLAGS");
+#define GIMBAL_FLAGS_MASK (GIMBAL_FLAG_RETRACT | GIMBAL_FLAG_NEUTRAL | \
+		GIMBAL_FLAG_ROLL_LOCK | GIMBAL_FLAG_PITCH_LOCK | GIMBAL_FLAG_YAW_LOCK)
+
+/*
+ * Telemetry is only queued while this much of the tx ring stays free, so
+ * heartbeats, acks and parameter replies always find room.
+ */
+#define MAVLINK_TX_RESERVE 512
+
+enum mavlink_tx_priority {
+	MAVLINK_TX_PRIORITY_LOW = 0,
+	MAVLINK_TX_PRIORITY_HIGH,
+};
+
+/* queue_message can be called from any context, serialize the producers */
+static struct k_spinlock tx_lock;
+
+/* fastest a stream can be set to, 1kHz */
+#define MAVLINK_STREAM_MIN_INTERVAL_US 1000
+/* slowest, once a minute */
+#define MAVLINK_STREAM_MAX_INTERVAL_US 60000000
+
+/* the bandwidth budget can build up to this much of a burst */
+#define MAVLINK_TX_BURST_MS 100
+
+/*
+ * A periodic telemetry stream. The scheduler walks the table in order, so
+ * earlier streams win when the bandwidth budget runs short.
+ */
+struct mavlink_stream {
+	uint32_t msgid;
+	/* queues the message(s), returns the number of bytes queued */
+	int (*send)(void);
+	/* 0 if the stream is only sent on request */
+	uint32_t default_interval_us;
+	/* sent on time even when over budget */
+	bool essential;
+};
+
+/* runtime state of each stream, protected by stream_lock */
+struct mavlink_stream_state {
+	/* 0 when disabled */
+	uint32_t interval_us;
+	int64_t next_us;
+	/* one-off send from MAV_CMD_REQUEST_MESSAGE */
+	bool requested;
+};
+
+struct k_timer tim_stream;
+struct k_work stream_work;
+static struct k_spinlock stream_lock;
+static bool streams_running;
+
+/*
+ * Token bucket for telemetry, in bytes scaled by USEC_PER_SEC so slow rates
+ * don't lose fractions of a byte on every refill. Goes negative when a
+ * stream overdraws it, only the stream work touches it.
+ */
+static int64_t tx_credit;
+static int64_t tx_refill_us;
+
+struct k_timer tim_param_list;
+struct k_work param_list_work;
+static atomic_t param_list_index = ATOMIC_INIT(PARAM_COUNT);
+
+#ifdef CONFIG_APS_BLACKBOX
+/* logs are sent a few messages at a time, as fast as the tx reserve allows */
+#define LOG_TRANSFER_INTERVAL_MS 10
+#define LOG_TRANSFER_BURST 4
+
+enum log_transfer_state {
+	LOG_TRANSFER_IDLE = 0,
+	LOG_TRANSFER_LIST,
+	LOG_TRANSFER_DATA,
+};
+
+/* the log list or log data being sent, a new request replaces it */
+struct log_transfer {
+	enum log_transfer_state state;
+	uint32_t generation;
+	/* LOG_REQUEST_LIST: ids from first to last, next is the index in log_list */
+	uint16_t first, last;
+	int next;
+	/* LOG_REQUEST_DATA: bytes [offset, end) of log id */
+	uint16_t id;
+	uint32_t offset, end;
+};
+
+struct k_timer tim_log_transfer;
+struct k_work log_transfer_work;
+/* erasing takes a while, so it runs from the workqueue like the transfers */
+struct k_work log_erase_work;
+static struct k_spinlock log_transfer_lock;
+static struct log_transfer log_transfer;
+
+/* only the transfer work touches the list */
+static struct blackbox_log log_list[BLACKBOX_LOG_MAX];
+static int log_count;
+#endif /* CONFIG_APS_BLACKBOX */
+
 uint32_t gimbal_failures = 0;
 
 struct timer_callback_data {
@@ -48,209 +174,1196 @@ struct timer_callback_data {
 };
 struct timer_callback_data timer_callback_data;
 
-struct command_ack_data {
-	int16_t command;
-	uint8_t result;
-	uint8_t target_sys;
-	uint8_t target_comp;
-	struct k_work work;
-};
+/* our ids are parameters, so read them whenever a message is packed */
+static inline uint8_t mav_sys_id(void)
+{
+	return param_get_int(PARAM_MAV_SYS_ID);
+}
+
+static inline uint8_t mav_comp_id(void)
+{
+	return param_get_int(PARAM_MAV_COMP_ID);
+}
 
-void queue_message(mavlink_message_t *msg)
+/* link control and replies to requests are high priority, everything else is telemetry */
+static enum mavlink_tx_priority message_priority(uint32_t msgid)
+{
+	switch (msgid) {
+	case MAVLINK_MSG_ID_HEARTBEAT:
+	case MAVLINK_MSG_ID_COMMAND_ACK:
+	case MAVLINK_MSG_ID_PARAM_VALUE:
+	case MAVLINK_MSG_ID_GIMBAL_MANAGER_INFORMATION:
+	case MAVLINK_MSG_ID_MESSAGE_INTERVAL:
+		return MAVLINK_TX_PRIORITY_HIGH;
+	default:
+		return MAVLINK_TX_PRIORITY_LOW;
+	}
+}
+
+/*
+ * Serializes a message into a tx ring, whole or not at all: a frame is never
+ * truncated. Safe to call from any context.
+ *
+ * @return the number of bytes queued, or -ENOBUFS if the message didn't fit
+ */
+static int serialize_message(struct ring_buf *tx_ringbuf, mavlink_message_t *msg)
+{
+	enum mavlink_tx_priority priority = message_priority(msg->msgid);
+	uint16_t msg_len = mavlink_msg_get_send_buffer_length(msg);
+	uint8_t *data;
+	int ret = msg_len;
+
+	k_spinlock_key_t key = k_spin_lock(&tx_lock);
+
+	/* the consumer only ever frees space, so this can't go stale */
+	uint32_t space = ring_buf_space_get(tx_ringbuf);
+	if (space < msg_len ||
+			(priority == MAVLINK_TX_PRIORITY_LOW &&
+			 space - msg_len < MAVLINK_TX_RESERVE)) {
+		ret = -ENOBUFS;
+		goto end;
+	}
+
+	uint32_t claim_len = ring_buf_put_claim(tx_ringbuf, &data, msg_len);
+	if (claim_len == msg_len) {
+		mavlink_msg_to_send_buffer(data, msg);
+		ring_buf_put_finish(tx_ringbuf, msg_len);
+	} else {
+		/* the free space wraps around the end of the ring, copy it in two */
+		uint8_t buffer[MAVLINK_MAX_PACKET_LEN];
+
+		ring_buf_put_finish(tx_ringbuf, 0);
+		mavlink_msg_to_send_buffer(buffer, msg);
+		ring_buf_put(tx_ringbuf, buffer, msg_len);
+	}
+
+end:
+	k_spin_unlock(&tx_lock, key);
+	return ret;
+}
+
+/*
+ * Serializes a message straight into the tx ring of the link. Safe to call
+ * from any context.
+ *
+ * @return the number of bytes queued, or -ENOBUFS if the message was dropped
+ */
+int queue_message(mavlink_message_t *msg)
+{
+	int ret = serialize_message(timer_callback_data.tx_ringbuf, msg);
+
+	if (ret < 0) {
+		perf_record_drop(PERF_DROP_TX);
+		if (message_priority(msg->msgid) == MAVLINK_TX_PRIORITY_HIGH) {
+			LOG_ERR("Dropping message %u", msg->msgid);
+		}
+		return ret;
+	}
+
+	uart_irq_tx_enable(timer_callback_data.usb_dev);
+	return ret;
+}
+
+/*
+ * Queues a ready made frame of another protocol between the MAVLink
+ * frames, at low priority. Safe to call from any context.
+ *
+ * @return the number of bytes queued, or -ENOBUFS if the frame was dropped
+ */
+int mavlink_queue_raw(const uint8_t *data, uint32_t len)
 {
 	struct ring_buf *tx_ringbuf = timer_callback_data.tx_ringbuf;
-	struct device *usb_dev = timer_callback_data.usb_dev;
 
-	uint16_t msg_len = mavlink_msg_to_send_buffer(send_buffer, msg);
-	size_t rb_len = MIN(ring_buf_space_get(tx_ringbuf), msg_len);
+	/* records are produced before the link is up */
+	if (tx_ringbuf == NULL) {
+		return -ENOBUFS;
+	}
+
+	k_spinlock_key_t key = k_spin_lock(&tx_lock);
+	uint32_t space = ring_buf_space_get(tx_ringbuf);
+	bool fits = space >= len && space - len >= MAVLINK_TX_RESERVE;
+	if (fits) {
+		ring_buf_put(tx_ringbuf, data, len);
+	}
+	k_spin_unlock(&tx_lock, key);
 
-	int put_len = ring_buf_put(tx_ringbuf, send_buffer, rb_len);
-	if (put_len < msg_len) {
-		LOG_ERR("Dropping %u bytes", msg_len - put_len);
+	if (!fits) {
+		return -ENOBUFS;
 	}
 
-	uart_irq_tx_enable(usb_dev);
+	uart_irq_tx_enable(timer_callback_data.usb_dev);
+	return len;
 }
 
-void send_heartbeat(struct k_work *item)
+static int send_heartbeat(void)
 {
 	mavlink_message_t msg;
 
 	mavlink_msg_heartbeat_pack(
-			aps_sys_id, aps_comp_id,
+			mav_sys_id(), mav_comp_id(),
 			&msg,
 			MAV_TYPE_ANTENNA_TRACKER,
 			MAV_AUTOPILOT_INVALID,
 			MAV_MODE_FLAG_SAFETY_ARMED, 0, MAV_STATE_ACTIVE);
-	queue_message(&msg);
+	return queue_message(&msg);
 }
 
-void send_gimbal_manager_info(struct k_work *item) {
+static int send_gimbal_manager_info(void)
+{
+	/* yaw limits are relative to the base front, NAN when it turns freely */
+	float wrap = param_get_float(PARAM_ATT_AZM_WRAP);
+	float yaw_limit = (wrap > 0) ? wrap / RAD_TO_DEG : NAN;
+	uint32_t cap_flags = (wrap > 0) ? 0 : GIMBAL_MANAGER_CAP_FLAGS_SUPPORTS_INFINITE_YAW;
+
 	mavlink_message_t msg;
 	mavlink_msg_gimbal_manager_information_pack(
-			aps_sys_id, aps_comp_id,
+			mav_sys_id(), mav_comp_id(),
 			&msg, k_uptime_get(),
+			GIMBAL_MANAGER_CAP_FLAGS_HAS_NEUTRAL |
 			GIMBAL_MANAGER_CAP_FLAGS_HAS_PITCH_AXIS |
 			GIMBAL_MANAGER_CAP_FLAGS_HAS_YAW_AXIS |
 			GIMBAL_MANAGER_CAP_FLAGS_HAS_PITCH_LOCK |
+			GIMBAL_MANAGER_CAP_FLAGS_HAS_YAW_FOLLOW |
 			GIMBAL_MANAGER_CAP_FLAGS_HAS_YAW_LOCK |
-			GIMBAL_MANAGER_CAP_FLAGS_SUPPORTS_INFINITE_YAW,
-			aps_comp_id,
+			GIMBAL_MANAGER_CAP_FLAGS_CAN_POINT_LOCATION_GLOBAL |
+			cap_flags,
+			mav_comp_id(),
 			0, 0,
 			0, 1.57,
-			0.0/0.0, 0.0/0.0);
-	queue_message(&msg);
+			-yaw_limit, yaw_limit);
+	return queue_message(&msg);
 }
 
-void send_gimbal_manager_status(struct k_work *item)
+static int send_gimbal_manager_status(void)
 {
+	struct gimbal_status status;
+	gimbal_get_status(&status);
+
 	mavlink_message_t msg;
 	mavlink_msg_gimbal_manager_status_pack(
-			aps_sys_id, aps_comp_id,
+			mav_sys_id(), mav_comp_id(),
 			&msg, k_uptime_get(),
-			aps_comp_id,
-			GIMBAL_MANAGER_FLAGS_YAW_LOCK |
-			GIMBAL_MANAGER_FLAGS_PITCH_LOCK,
-			0, 0, 0, 0);
-	queue_message(&msg);
+			status.flags,
+			mav_comp_id(),
+			status.primary_sysid, status.primary_compid,
+			status.secondary_sysid, status.secondary_compid);
+	return queue_message(&msg);
 }
 
-void send_gimbal_device_attitude_status(struct k_work *item)
+static int send_gimbal_device_attitude_status(void)
 {
+	struct attitude_frame att_frame;
+	statebus_read(&attitude_topic, &att_frame);
+
+	struct gimbal_status status;
+	gimbal_get_status(&status);
+
+	/*
+	 * The gimbal's FRD frame in NED, the same mapping as SET_ATTITUDE:
+	 * the altitude (about body x) is the pitch, the tilt about body y the
+	 * roll and the azimuth, counter-clockwise in the estimator's z up
+	 * frame, a clockwise yaw.
+	 */
+	float gimbal_quat[4];
+	quat_from_euler_rad(att_frame.angle[1] / RAD_TO_DEG,
+			att_frame.angle[0] / RAD_TO_DEG,
+			-att_frame.angle[2] / RAD_TO_DEG, gimbal_quat);
+
 	mavlink_message_t msg;
 	mavlink_msg_gimbal_device_attitude_status_pack(
-			aps_sys_id, aps_comp_id,
+			mav_sys_id(), mav_comp_id(),
 			&msg,
 			0, 0,
 			k_uptime_get(),
-			GIMBAL_DEVICE_FLAGS_YAW_LOCK |
-			GIMBAL_DEVICE_FLAGS_PITCH_LOCK,
+			status.flags,
 			gimbal_quat,
-			gimbal_angular_vel_x,
-			gimbal_angular_vel_y,
-			gimbal_angular_vel_z, gimbal_failures);
+			att_frame.rate[1],
+			att_frame.rate[0],
+			-att_frame.rate[2], gimbal_failures);
+	return queue_message(&msg);
+}
+
+#if defined(CONFIG_APS_PERF_TELEMETRY) && defined(CONFIG_APS_SYSMON)
+/*
+ * One DEBUG_VECT per thread, named t_ and the thread name, with the CPU
+ * share in %, context switches per second and stack high-water in bytes as
+ * x/y/z, and the total load in hundredths of a percent as NAMED_VALUE_INT.
+ */
+static int send_sysmon(void)
+{
+	static struct sysmon_report report;
+	mavlink_message_t msg;
+	int len = 0;
+	char name[10];
+
+	sysmon_get_report(&report);
+	if (report.timestamp == 0) {
+		return 0;
+	}
+
+	float period_s = report.period_us / 1000000.0f;
+	for (int i = 0;i < report.count;i++) {
+		const struct sysmon_thread *thread = &report.threads[i];
+
+		/* a full 10 characters, the field needn't be terminated */
+		strncpy(name, "t_", sizeof(name));
+		strncpy(&name[2], thread->name, sizeof(name) - 2);
+		mavlink_msg_debug_vect_pack(
+				mav_sys_id(), mav_comp_id(),
+				&msg, name, report.timestamp,
+				thread->load / 100.0f, thread->switches / period_s,
+				thread->stack_used);
+		len += MAX(queue_message(&msg), 0);
+	}
+
+	mavlink_msg_named_value_int_pack(
+			mav_sys_id(), mav_comp_id(),
+			&msg, k_uptime_get_32(), "cpu_load", report.load);
+	len += MAX(queue_message(&msg), 0);
+
+	return len;
+}
+#endif
+
+#ifdef CONFIG_APS_PERF_TELEMETRY
+/*
+ * Streams the control loop timing: one DEBUG_VECT per stage, named after
+ * the stage, with min/avg/max in us as x/y/z, and the queue drop counters
+ * as NAMED_VALUE_INT.
+ */
+static int send_perf(void)
+{
+	mavlink_message_t msg;
+	int len = 0;
+	struct perf_stat stat;
+	char name[10];
+	uint32_t time_boot_ms = k_uptime_get_32();
+
+	for (int i = 0;i < PERF_STAGE_COUNT;i++) {
+		perf_get_stat(i, &stat);
+		if (stat.count == 0) {
+			continue;
+		}
+
+		strncpy(name, perf_stage_name(i), sizeof(name));
+		mavlink_msg_debug_vect_pack(
+				mav_sys_id(), mav_comp_id(),
+				&msg, name, timestamp_us(),
+				stat.min, (float) stat.sum / stat.count, stat.max);
+		len += MAX(queue_message(&msg), 0);
+	}
+
+	for (int i = 0;i < PERF_DROP_COUNT;i++) {
+		snprintk(name, sizeof(name), "drop_%s", perf_drop_name(i));
+		mavlink_msg_named_value_int_pack(
+				mav_sys_id(), mav_comp_id(),
+				&msg, time_boot_ms, name, perf_get_drops(i));
+		len += MAX(queue_message(&msg), 0);
+	}
+
+	struct mavlink_rx_stats stats;
+	mavlink_get_rx_stats(MAVLINK_CHAN_USB, &stats);
+	const struct {
+		const char *name;
+		atomic_t *value;
+	} rx_values[] = {
+		{"rx_bytes", &stats.bytes},
+		{"rx_msgs", &stats.messages},
+		{"rx_errors", &stats.parse_errors},
+		{"rx_lost", &stats.lost},
+		{"rx_overrun", &stats.overrun},
+	};
+	for (int i = 0;i < ARRAY_SIZE(rx_values);i++) {
+		strncpy(name, rx_values[i].name, sizeof(name));
+		mavlink_msg_named_value_int_pack(
+				mav_sys_id(), mav_comp_id(),
+				&msg, time_boot_ms, name, atomic_get(rx_values[i].value));
+		len += MAX(queue_message(&msg), 0);
+	}
+
+#ifdef CONFIG_APS_SYSMON
+	len += send_sysmon();
+#endif
+
+	return len;
+}
+#endif /* CONFIG_APS_PERF_TELEMETRY */
+
+static const struct mavlink_stream streams[] = {
+	{MAVLINK_MSG_ID_HEARTBEAT, send_heartbeat, 1000000, true},
+	{MAVLINK_MSG_ID_GIMBAL_DEVICE_ATTITUDE_STATUS,
+		send_gimbal_device_attitude_status, 100000, false},
+	{MAVLINK_MSG_ID_GIMBAL_MANAGER_STATUS, send_gimbal_manager_status, 200000, false},
+	{MAVLINK_MSG_ID_GIMBAL_MANAGER_INFORMATION, send_gimbal_manager_info, 0, false},
+#ifdef CONFIG_APS_PERF_TELEMETRY
+	{MAVLINK_MSG_ID_DEBUG_VECT, send_perf, 1000000, false},
+#endif
+};
+
+#define STREAM_COUNT ARRAY_SIZE(streams)
+
+static struct mavlink_stream_state stream_states[STREAM_COUNT];
+
+static int find_stream(uint32_t msgid)
+{
+	for (int i = 0;i < STREAM_COUNT;i++) {
+		if (streams[i].msgid == msgid) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/* tops up the telemetry budget for the time since the last refill */
+static void tx_budget_refill(int64_t now, int32_t rate)
+{
+	int64_t depth = (int64_t) MAX(rate * MAVLINK_TX_BURST_MS / MSEC_PER_SEC,
+			2 * MAVLINK_MAX_PACKET_LEN) * USEC_PER_SEC;
+
+	tx_credit = MIN(tx_credit + (now - tx_refill_us) * rate, depth);
+	tx_refill_us = now;
+}
+
+/* a rate of 0 means the link is unlimited */
+static bool tx_budget_available(int32_t rate)
+{
+	return rate <= 0 || tx_credit > 0;
+}
+
+/* time until the budget is positive again */
+static int64_t tx_budget_wait_us(int32_t rate)
+{
+	if (rate <= 0 || tx_credit > 0) {
+		return 0;
+	}
+
+	return -tx_credit / rate + 1;
+}
+
+/*
+ * Sends every stream that is due or was requested, then sleeps until the
+ * next deadline. A stream that is due while the budget is used up stays
+ * due and goes out as soon as the budget allows; slots it misses are
+ * skipped rather than sent in a burst later.
+ */
+void send_streams(struct k_work *item)
+{
+	int32_t rate = param_get_int(PARAM_MAV_TX_RATE);
+	int64_t now = timestamp_us();
+	int64_t next = INT64_MAX;
+	k_spinlock_key_t key;
+
+	tx_budget_refill(now, rate);
+
+	for (int i = 0;i < STREAM_COUNT;i++) {
+		struct mavlink_stream_state *state = &stream_states[i];
+
+		key = k_spin_lock(&stream_lock);
+		bool due = streams_running && state->interval_us > 0 &&
+			now >= state->next_us;
+		bool send = state->requested ||
+			(due && (streams[i].essential || tx_budget_available(rate)));
+		state->requested = false;
+		if (due && send) {
+			state->next_us += state->interval_us;
+			if (state->next_us <= now) {
+				state->next_us = now + state->interval_us;
+			}
+		}
+		k_spin_unlock(&stream_lock, key);
+
+		if (send) {
+			int len = streams[i].send();
+			if (rate > 0 && len > 0) {
+				tx_credit -= (int64_t) len * USEC_PER_SEC;
+			}
+		}
+	}
+
+	key = k_spin_lock(&stream_lock);
+	for (int i = 0;streams_running && i < STREAM_COUNT;i++) {
+		struct mavlink_stream_state *state = &stream_states[i];
+		if (state->interval_us == 0) {
+			continue;
+		}
+
+		/* anything still overdue is waiting on the budget */
+		int64_t deadline = MAX(state->next_us, now + tx_budget_wait_us(rate));
+		next = MIN(next, deadline);
+	}
+	if (next != INT64_MAX) {
+		k_timer_start(&tim_stream, K_USEC(MAX(next - now, 0)), K_NO_WAIT);
+	}
+	k_spin_unlock(&stream_lock, key);
+}
+
+static void send_param_value(enum param_id id)
+{
+	mavlink_message_t msg;
+	char name[PARAM_NAME_LEN];
+	float value;
+	uint8_t type;
+
+	/* MAVLink names are only null terminated when shorter than 16 */
+	strncpy(name, param_name(id), sizeof(name));
+
+	/* integers are sent cast to float, we don't advertise bytewise encoding */
+	switch (param_type(id)) {
+	case PARAM_TYPE_INT32:
+		value = param_get_int(id);
+		type = MAV_PARAM_TYPE_INT32;
+		break;
+	case PARAM_TYPE_UINT8:
+		value = param_get_int(id);
+		type = MAV_PARAM_TYPE_UINT8;
+		break;
+	case PARAM_TYPE_FLOAT:
+	default:
+		value = param_get_float(id);
+		type = MAV_PARAM_TYPE_REAL32;
+		break;
+	}
+
+	mavlink_msg_param_value_pack(
+			mav_sys_id(), mav_comp_id(),
+			&msg, name, value, type, PARAM_COUNT, id);
 	queue_message(&msg);
 }
 
-void send_ack(struct k_work *item)
+void send_param_list(struct k_work *item)
+{
+	/* a request from the RX thread may restart the list at any time */
+	for (int i = 0;i < PARAM_LIST_BURST;i++) {
+		int id = atomic_inc(&param_list_index);
+		if (id >= PARAM_COUNT) {
+			k_timer_stop(&tim_param_list);
+			return;
+		}
+
+		send_param_value(id);
+	}
+}
+
+#ifdef CONFIG_APS_BLACKBOX
+static void send_log_list(struct log_transfer *transfer)
+{
+	mavlink_message_t msg;
+
+	if (transfer->next == 0) {
+		log_count = MAX(blackbox_list(log_list, ARRAY_SIZE(log_list)), 0);
+		if (log_count == 0) {
+			/* no logs is a single entry with num_logs 0 */
+			mavlink_msg_log_entry_pack(
+					mav_sys_id(), mav_comp_id(),
+					&msg, 0, 0, 0, 0, 0);
+			if (queue_message(&msg) >= 0) {
+				transfer->state = LOG_TRANSFER_IDLE;
+			}
+			return;
+		}
+	}
+
+	uint16_t last_id = log_list[log_count - 1].id;
+	int sent = 0;
+	while (sent < LOG_TRANSFER_BURST && transfer->next < log_count) {
+		struct blackbox_log *log = &log_list[transfer->next];
+		if (log->id >= transfer->first && log->id <= transfer->last) {
+			/* the tracker has no clock, so no time_utc */
+			mavlink_msg_log_entry_pack(
+					mav_sys_id(), mav_comp_id(),
+					&msg, log->id, log_count, last_id, 0, log->size);
+			if (queue_message(&msg) < 0) {
+				return;
+			}
+			sent++;
+		}
+		transfer->next++;
+	}
+
+	if (transfer->next >= log_count) {
+		transfer->state = LOG_TRANSFER_IDLE;
+	}
+}
+
+static void send_log_data(struct log_transfer *transfer)
 {
-	struct command_ack_data *data = CONTAINER_OF(item, struct command_ack_data, work);
+	mavlink_message_t msg;
+	uint8_t data[MAVLINK_MSG_LOG_DATA_FIELD_DATA_LEN] = {0};
+
+	for (int i = 0;i < LOG_TRANSFER_BURST;i++) {
+		uint32_t len = MIN(sizeof(data), transfer->end - transfer->offset);
+		int ret = blackbox_read(transfer->id, transfer->offset, data, len);
+		if (ret < 0) {
+			LOG_WRN("Unable to read log %u: %d", transfer->id, ret);
+			transfer->state = LOG_TRANSFER_IDLE;
+			return;
+		}
 
+		/* a short chunk, empty past the end of the log, ends the transfer */
+		mavlink_msg_log_data_pack(
+				mav_sys_id(), mav_comp_id(),
+				&msg, transfer->id, transfer->offset, ret, data);
+		if (queue_message(&msg) < 0) {
+			return;
+		}
+
+		transfer->offset += ret;
+		if (ret < len || transfer->offset >= transfer->end) {
+			transfer->state = LOG_TRANSFER_IDLE;
+			return;
+		}
+	}
+}
+
+void send_log_transfer(struct k_work *item)
+{
+	struct log_transfer transfer;
+
+	k_spinlock_key_t key = k_spin_lock(&log_transfer_lock);
+	transfer = log_transfer;
+	k_spin_unlock(&log_transfer_lock, key);
+
+	switch (transfer.state) {
+	case LOG_TRANSFER_LIST:
+		send_log_list(&transfer);
+		break;
+	case LOG_TRANSFER_DATA:
+		send_log_data(&transfer);
+		break;
+	case LOG_TRANSFER_IDLE:
+		break;
+	}
+
+	/* unless a new request came in meanwhile */
+	key = k_spin_lock(&log_transfer_lock);
+	if (log_transfer.generation == transfer.generation) {
+		log_transfer = transfer;
+		if (transfer.state == LOG_TRANSFER_IDLE) {
+			k_timer_stop(&tim_log_transfer);
+		}
+	}
+	k_spin_unlock(&log_transfer_lock, key);
+}
+
+void erase_logs(struct k_work *item)
+{
+	int ret = blackbox_erase();
+	if (ret < 0) {
+		LOG_WRN("Unable to erase logs: %d", ret);
+	}
+}
+#endif /* CONFIG_APS_BLACKBOX */
+
+static void send_ack(mavlink_message_t *request, uint16_t command, int result)
+{
 	mavlink_message_t msg;
 	mavlink_msg_command_ack_pack(
-			aps_sys_id, aps_comp_id,
-			&msg, data->command, data->result, 0, 0, data->target_sys, data->target_comp);
+			mav_sys_id(), mav_comp_id(),
+			&msg, command, result, 0, 0,
+			request->sysid, request->compid);
+	queue_message(&msg);
+}
+
+static int process_request_message(mavlink_command_long_t *command)
+{
+	int i = find_stream(command->param1);
+	if (i < 0) {
+		return MAV_RESULT_DENIED;
+	}
+
+	k_spinlock_key_t key = k_spin_lock(&stream_lock);
+	stream_states[i].requested = true;
+	k_spin_unlock(&stream_lock, key);
+
+	k_work_submit(&stream_work);
+	return MAV_RESULT_ACCEPTED;
+}
+
+static int process_set_message_interval(mavlink_command_long_t *command)
+{
+	int i = find_stream(command->param1);
+	if (i < 0) {
+		return MAV_RESULT_DENIED;
+	}
+
+	/* -1 disables the stream, 0 restores its default */
+	uint32_t interval_us;
+	if (command->param2 == -1) {
+		interval_us = 0;
+	} else if (command->param2 == 0) {
+		interval_us = streams[i].default_interval_us;
+	} else if (command->param2 > 0) {
+		/* clamped as a float, anything out of range won't convert */
+		interval_us = constrain(command->param2,
+				MAVLINK_STREAM_MIN_INTERVAL_US, MAVLINK_STREAM_MAX_INTERVAL_US);
+	} else {
+		/* NaN or another negative */
+		return MAV_RESULT_DENIED;
+	}
+
+	k_spinlock_key_t key = k_spin_lock(&stream_lock);
+	stream_states[i].interval_us = interval_us;
+	stream_states[i].next_us = timestamp_us();
+	k_spin_unlock(&stream_lock, key);
+
+	/* the scheduler picks up the new deadline */
+	k_work_submit(&stream_work);
+	return MAV_RESULT_ACCEPTED;
+}
+
+static int process_get_message_interval(mavlink_command_long_t *command)
+{
+	int i = find_stream(command->param1);
+
+	/* 0 means we can't send the message at all, -1 that it's disabled */
+	int32_t interval_us = 0;
+	if (i >= 0) {
+		k_spinlock_key_t key = k_spin_lock(&stream_lock);
+		interval_us = stream_states[i].interval_us;
+		k_spin_unlock(&stream_lock, key);
+
+		if (interval_us == 0) {
+			interval_us = -1;
+		}
+	}
+
+	mavlink_message_t msg;
+	mavlink_msg_message_interval_pack(
+			mav_sys_id(), mav_comp_id(),
+			&msg, command->param1, interval_us);
 	queue_message(&msg);
 
-	k_free(data);
+	return MAV_RESULT_ACCEPTED;
 }
 
-static void process_request_message(mavlink_command_long_t *command)
+static int process_calibration(mavlink_command_long_t *command)
 {
-	if (command->param1 == MAVLINK_MSG_ID_GIMBAL_MANAGER_INFORMATION) {
-		k_work_submit(&gimbal_manager_info_work);
+	/* param2 selects magnetometer calibration, nothing else is supported */
+	if (command->param2 != 1) {
+		return MAV_RESULT_UNSUPPORTED;
+	}
+
+	if (magcal_running()) {
+		return MAV_RESULT_TEMPORARILY_REJECTED;
 	}
+
+	magcal_start();
+	return MAV_RESULT_ACCEPTED;
+}
+
+/* command results for gimbal manager calls, which only fail on permission */
+static int gimbal_result(int ret)
+{
+	return (ret == 0) ? MAV_RESULT_ACCEPTED : MAV_RESULT_DENIED;
+}
+
+static int process_gimbal_pitchyaw(mavlink_message_t *msg,
+		mavlink_command_long_t *command)
+{
+	/* degrees and degrees/s, yaw is clockwise and our azimuth isn't */
+	float angle[GIMBAL_AXIS_COUNT] = {command->param1, -command->param2};
+	float rate[GIMBAL_AXIS_COUNT] = {command->param3, -command->param4};
+	uint32_t flags = (uint32_t) command->param5 & GIMBAL_FLAGS_MASK;
+
+	return gimbal_result(gimbal_set_angles(msg->sysid, msg->compid,
+				flags, angle, rate));
+}
+
+static int process_roi_sysid(mavlink_message_t *msg,
+		mavlink_command_long_t *command)
+{
+	int ret = gimbal_set_mode(msg->sysid, msg->compid,
+			COMMAND_SETPOINT_MODE_TRACK);
+	if (ret == 0) {
+		track_set_target(command->param1);
+	}
+
+	return gimbal_result(ret);
+}
+
+/* lat and lon in degE7, alt in meters above mean sea level */
+static int process_roi_location(mavlink_message_t *msg,
+		int32_t lat, int32_t lon, float alt)
+{
+	int ret = gimbal_set_mode(msg->sysid, msg->compid,
+			COMMAND_SETPOINT_MODE_TRACK);
+	if (ret == 0) {
+		track_set_location(lat, lon, alt);
+	}
+
+	return gimbal_result(ret);
+}
+
+static int process_roi_none(mavlink_message_t *msg,
+		mavlink_command_long_t *command)
+{
+	int ret = gimbal_set_mode(msg->sysid, msg->compid,
+			COMMAND_SETPOINT_MODE_NEUTRAL);
+	if (ret == 0) {
+		track_set_target(0);
+	}
+
+	return gimbal_result(ret);
 }
 
-static int process_command(mavlink_command_long_t *command)
+static int process_command(mavlink_message_t *msg, mavlink_command_long_t *command)
 {
 	switch (command->command) {
 	case MAV_CMD_REQUEST_MESSAGE:
-		process_request_message(command);
-		return -1;
+		return process_request_message(command);
+	case MAV_CMD_SET_MESSAGE_INTERVAL:
+		return process_set_message_interval(command);
+	case MAV_CMD_GET_MESSAGE_INTERVAL:
+		return process_get_message_interval(command);
+	case MAV_CMD_PREFLIGHT_CALIBRATION:
+		return process_calibration(command);
 	case MAV_CMD_DO_GIMBAL_MANAGER_CONFIGURE:
-		sysid_primary_control = command->param1;
-		compid_primary_control = command->param2;
-		sysid_secondary_control = command->param3;
-		compid_secondary_control = command->param4;
+		if (gimbal_configure(msg->sysid, msg->compid,
+					command->param1, command->param2,
+					command->param3, command->param4) != 0) {
+			return MAV_RESULT_DENIED;
+		}
 
 		return MAV_RESULT_ACCEPTED;
+	case MAV_CMD_DO_GIMBAL_MANAGER_PITCHYAW:
+		return process_gimbal_pitchyaw(msg, command);
+	case MAV_CMD_DO_SET_ROI_SYSID:
+		return process_roi_sysid(msg, command);
+	case MAV_CMD_DO_SET_ROI_LOCATION:
+		/* COMMAND_LONG only has floats, good to about a meter */
+		return process_roi_location(msg, lroundf(command->param5 * 1e7f),
+				lroundf(command->param6 * 1e7f), command->param7);
+	case MAV_CMD_DO_SET_ROI_NONE:
+		return process_roi_none(msg, command);
+	default:
+		return MAV_RESULT_UNSUPPORTED;
+	}
+}
+
+/* ground stations send positions this way, with the exact coordinates */
+static int process_command_int(mavlink_message_t *msg,
+		mavlink_command_int_t *command)
+{
+	switch (command->command) {
+	case MAV_CMD_DO_SET_ROI_LOCATION:
+		return process_roi_location(msg, command->x, command->y, command->z);
 	default:
 		return MAV_RESULT_UNSUPPORTED;
 	}
 }
 
-static void submit_ack(mavlink_message_t *msg, mavlink_command_long_t *command, 
-		int result)
+static bool message_for_us(uint8_t target_system, uint8_t target_component)
+{
+	return target_system == mav_sys_id() &&
+		(target_component == mav_comp_id() || target_component == MAV_COMP_ID_ALL);
+}
+
+/* we are both the manager and the only device, 0 addresses all devices */
+static bool gimbal_device_for_us(uint8_t gimbal_device_id)
 {
-	struct command_ack_data *data = k_calloc(1, sizeof(struct command_ack_data));
-	data->command = command->command;
-	data->result = result;
-	data->target_sys = msg->sysid;
-	data->target_comp = msg->compid;
-	k_work_init(&(data->work), send_ack);
-	k_work_submit(&(data->work));
+	return gimbal_device_id == 0 || gimbal_device_id == mav_comp_id();
 }
 
+/*
+ * The quaternion is the gimbal's FRD frame in NED, as for SET_PITCHYAW
+ * pitch is the altitude and yaw the azimuth, clockwise. Either the
+ * quaternion or the rates may be NAN.
+ */
 static void process_set_attitude(mavlink_message_t *msg)
 {
-	mavlink_gimbal_manager_set_attitude_t mavlink_setpoint;
-	mavlink_msg_gimbal_manager_set_attitude_decode(msg, &mavlink_setpoint);
+	mavlink_gimbal_manager_set_attitude_t request;
+	mavlink_msg_gimbal_manager_set_attitude_decode(msg, &request);
+
+	if (!message_for_us(request.target_system, request.target_component) ||
+			!gimbal_device_for_us(request.gimbal_device_id)) {
+		return;
+	}
 
-	printf("set_attitude quat (%f, %f, %f, %f)\n",
-			mavlink_setpoint.q[0], mavlink_setpoint.q[1], 
-			mavlink_setpoint.q[2], mavlink_setpoint.q[3]);
-	float euler[3];
-	quat_to_euler(mavlink_setpoint.q, euler);
+	float angle[GIMBAL_AXIS_COUNT] = {NAN, NAN};
+	if (isfinite(request.q[0])) {
+		/* pitch, roll, yaw */
+		float euler[3];
+		quat_to_euler(request.q, euler);
 
-	printf("set_attitude euler (%f %f %f)\n", euler[0], euler[1], euler[2]);
+		angle[GIMBAL_AXIS_ALT] = euler[0];
+		angle[GIMBAL_AXIS_AZM] = -euler[2];
+	}
+
+	float rate[GIMBAL_AXIS_COUNT] = {
+		request.angular_velocity_y * RAD_TO_DEG,
+		-request.angular_velocity_z * RAD_TO_DEG,
+	};
+
+	gimbal_set_angles(msg->sysid, msg->compid,
+			request.flags & GIMBAL_FLAGS_MASK, angle, rate);
 }
 
+/* radians and radians/s, NAN where unused */
+static void process_set_pitchyaw(mavlink_message_t *msg)
+{
+	mavlink_gimbal_manager_set_pitchyaw_t request;
+	mavlink_msg_gimbal_manager_set_pitchyaw_decode(msg, &request);
+
+	if (!message_for_us(request.target_system, request.target_component) ||
+			!gimbal_device_for_us(request.gimbal_device_id)) {
+		return;
+	}
+
+	float angle[GIMBAL_AXIS_COUNT] = {
+		request.pitch * RAD_TO_DEG, -request.yaw * RAD_TO_DEG,
+	};
+	float rate[GIMBAL_AXIS_COUNT] = {
+		request.pitch_rate * RAD_TO_DEG, -request.yaw_rate * RAD_TO_DEG,
+	};
+
+	gimbal_set_angles(msg->sysid, msg->compid,
+			request.flags & GIMBAL_FLAGS_MASK, angle, rate);
+}
+
+static void process_global_position_int(mavlink_message_t *msg)
+{
+	mavlink_global_position_int_t position;
+	mavlink_msg_global_position_int_decode(msg, &position);
+
+	const float vel_ned[3] = {
+		position.vx / 100.0f, position.vy / 100.0f, position.vz / 100.0f,
+	};
+
+	track_add_position(msg->sysid, TRACK_SOURCE_GLOBAL_POSITION,
+			position.lat, position.lon, position.alt / 1000.0f, vel_ned,
+			timestamp_us());
+}
+
+static void process_gps_raw_int(mavlink_message_t *msg)
+{
+	mavlink_gps_raw_int_t gps;
+	mavlink_msg_gps_raw_int_decode(msg, &gps);
+
+	if (gps.fix_type < GPS_FIX_TYPE_3D_FIX) {
+		return;
+	}
+
+	/* only ground speed and course, the filter works out the climb rate */
+	float vel_ned[3] = {NAN, NAN, NAN};
+	if (gps.vel != UINT16_MAX && gps.cog != UINT16_MAX) {
+		float speed = gps.vel / 100.0f;
+		float course = gps.cog / 100.0f / RAD_TO_DEG;
+
+		vel_ned[0] = speed * cosf(course);
+		vel_ned[1] = speed * sinf(course);
+	}
+
+	track_add_position(msg->sysid, TRACK_SOURCE_GPS_RAW,
+			gps.lat, gps.lon, gps.alt / 1000.0f, vel_ned, timestamp_us());
+}
+
+static void process_param_request_list(mavlink_message_t *msg)
+{
+	mavlink_param_request_list_t request;
+	mavlink_msg_param_request_list_decode(msg, &request);
+
+	if (!message_for_us(request.target_system, request.target_component)) {
+		return;
+	}
+
+	/* restarts the list if one is already being sent */
+	atomic_set(&param_list_index, 0);
+	k_timer_start(&tim_param_list, K_NO_WAIT, K_MSEC(PARAM_LIST_INTERVAL_MS));
+}
+
+static void process_param_request_read(mavlink_message_t *msg)
+{
+	mavlink_param_request_read_t request;
+	mavlink_msg_param_request_read_decode(msg, &request);
+
+	if (!message_for_us(request.target_system, request.target_component)) {
+		return;
+	}
+
+	int id = request.param_index;
+	if (id < 0) {
+		id = param_find(request.param_id, sizeof(request.param_id));
+	}
+	if (id < 0 || id >= PARAM_COUNT) {
+		return;
+	}
+
+	send_param_value(id);
+}
+
+static void process_param_set(mavlink_message_t *msg)
+{
+	mavlink_param_set_t request;
+	mavlink_msg_param_set_decode(msg, &request);
+
+	if (!message_for_us(request.target_system, request.target_component)) {
+		return;
+	}
+
+	int id = param_find(request.param_id, sizeof(request.param_id));
+	if (id < 0) {
+		return;
+	}
+
+	union param_value value;
+	if (param_type(id) == PARAM_TYPE_FLOAT) {
+		value.f = request.param_value;
+	} else {
+		value.i = lroundf(request.param_value);
+	}
+
+	if (param_set(id, value) != 0) {
+		LOG_WRN("Rejected out of range %s", param_name(id));
+	}
+
+	/* answer with the value now in effect, whether or not it changed */
+	send_param_value(id);
+}
+
+#ifdef CONFIG_APS_BLACKBOX
+/* replaces whatever transfer is going on */
+static void start_log_transfer(const struct log_transfer *request)
+{
+	k_spinlock_key_t key = k_spin_lock(&log_transfer_lock);
+	uint32_t generation = log_transfer.generation + 1;
+	log_transfer = *request;
+	log_transfer.generation = generation;
+	k_spin_unlock(&log_transfer_lock, key);
+
+	k_timer_start(&tim_log_transfer, K_NO_WAIT, K_MSEC(LOG_TRANSFER_INTERVAL_MS));
+}
+
+static void process_log_request_list(mavlink_message_t *msg)
+{
+	mavlink_log_request_list_t request;
+	mavlink_msg_log_request_list_decode(msg, &request);
+
+	if (!message_for_us(request.target_system, request.target_component)) {
+		return;
+	}
+
+	struct log_transfer transfer = {
+		.state = LOG_TRANSFER_LIST,
+		.first = request.start,
+		.last = request.end,
+	};
+	start_log_transfer(&transfer);
+}
+
+static void process_log_request_data(mavlink_message_t *msg)
+{
+	mavlink_log_request_data_t request;
+	mavlink_msg_log_request_data_decode(msg, &request);
+
+	if (!message_for_us(request.target_system, request.target_component)) {
+		return;
+	}
+
+	/* count is usually 0xffffffff, for the whole log */
+	struct log_transfer transfer = {
+		.state = LOG_TRANSFER_DATA,
+		.id = request.id,
+		.offset = request.ofs,
+		.end = request.ofs + MIN(request.count, UINT32_MAX - request.ofs),
+	};
+	start_log_transfer(&transfer);
+}
+
+static void process_log_request_end(mavlink_message_t *msg)
+{
+	mavlink_log_request_end_t request;
+	mavlink_msg_log_request_end_decode(msg, &request);
+
+	if (!message_for_us(request.target_system, request.target_component)) {
+		return;
+	}
+
+	struct log_transfer transfer = {
+		.state = LOG_TRANSFER_IDLE,
+	};
+	start_log_transfer(&transfer);
+}
+
+static void process_log_erase(mavlink_message_t *msg)
+{
+	mavlink_log_erase_t request;
+	mavlink_msg_log_erase_decode(msg, &request);
+
+	if (!message_for_us(request.target_system, request.target_component)) {
+		return;
+	}
+
+	struct log_transfer transfer = {
+		.state = LOG_TRANSFER_IDLE,
+	};
+	start_log_transfer(&transfer);
+
+	k_work_submit(&log_erase_work);
+}
+#endif /* CONFIG_APS_BLACKBOX */
+
 static void process_message(mavlink_message_t *msg)
 {
 	mavlink_command_long_t command;
+	mavlink_command_int_t command_int;
+	int result;
 
 	switch (msg->msgid) {
 	case MAVLINK_MSG_ID_COMMAND_LONG:
 		mavlink_msg_command_long_decode(msg, &command);
-		int result = process_command(&command);
+		result = process_command(msg, &command);
 		if (result >= 0) {
-			submit_ack(msg, &command, result);
+			send_ack(msg, command.command, result);
+		}
+		break;
+	case MAVLINK_MSG_ID_COMMAND_INT:
+		mavlink_msg_command_int_decode(msg, &command_int);
+		result = process_command_int(msg, &command_int);
+		if (result >= 0) {
+			send_ack(msg, command_int.command, result);
 		}
 		break;
 	case MAVLINK_MSG_ID_GIMBAL_MANAGER_SET_ATTITUDE:
 		process_set_attitude(msg);
-
 		break;
+	case MAVLINK_MSG_ID_GIMBAL_MANAGER_SET_PITCHYAW:
+		process_set_pitchyaw(msg);
+		break;
+	case MAVLINK_MSG_ID_GLOBAL_POSITION_INT:
+		process_global_position_int(msg);
+		break;
+	case MAVLINK_MSG_ID_GPS_RAW_INT:
+		process_gps_raw_int(msg);
+		break;
+	case MAVLINK_MSG_ID_PARAM_REQUEST_LIST:
+		process_param_request_list(msg);
+		break;
+	case MAVLINK_MSG_ID_PARAM_REQUEST_READ:
+		process_param_request_read(msg);
+		break;
+	case MAVLINK_MSG_ID_PARAM_SET:
+		process_param_set(msg);
+		break;
+#ifdef CONFIG_APS_BLACKBOX
+	case MAVLINK_MSG_ID_LOG_REQUEST_LIST:
+		process_log_request_list(msg);
+		break;
+	case MAVLINK_MSG_ID_LOG_REQUEST_DATA:
+		process_log_request_data(msg);
+		break;
+	case MAVLINK_MSG_ID_LOG_REQUEST_END:
+		process_log_request_end(msg);
+		break;
+	case MAVLINK_MSG_ID_LOG_ERASE:
+		process_log_erase(msg);
+		break;
+#endif
+	}
+}
+
+/* counts messages lost between a sender and us from gaps in its sequence */
+static void count_lost(struct mavlink_channel *channel,
+		struct mavlink_rx_stats *stats, const mavlink_message_t *msg)
+{
+	if (channel->have_seq && msg->sysid == channel->last_sysid &&
+			msg->compid == channel->last_compid) {
+		atomic_add(&stats->lost, (uint8_t) (msg->seq - channel->last_seq - 1));
 	}
+
+	channel->last_sysid = msg->sysid;
+	channel->last_compid = msg->compid;
+	channel->last_seq = msg->seq;
+	channel->have_seq = true;
 }
 
-void parse_mavlink(struct k_work *item)
+static void parse_bytes(int chan, const uint8_t *data, uint32_t len)
 {
-	struct parse_mavlink_data *data =
-		CONTAINER_OF(item, struct parse_mavlink_data, work);
-	struct ring_buf *rx_ringbuf = data->rx_ringbuf;
+	struct mavlink_channel *channel = &channels[chan];
+	struct mavlink_rx_stats *stats = &rx_stats[chan];
 
-	uint8_t buffer[64];
-	int recv_len;
+	for (uint32_t i = 0;i < len;i++) {
+		uint8_t received = mavlink_parse_char(chan, data[i],
+				&channel->msg, &channel->status);
 
-	recv_len = ring_buf_get(rx_ringbuf, buffer, sizeof(buffer));
-	if (!recv_len) {
-		return;
+		/* the parser keeps a wrapping count of bad bytes and CRCs */
+		uint8_t parse_error = channel->status.parse_error;
+		atomic_add(&stats->parse_errors,
+				(uint8_t) (parse_error - channel->last_parse_error));
+		channel->last_parse_error = parse_error;
+
+		if (received) {
+			atomic_inc(&stats->messages);
+			count_lost(channel, stats, &channel->msg);
+			process_message(&channel->msg);
+		}
 	}
 
-	for (int i = 0;i < recv_len; i++) {
-		if (mavlink_parse_char(chan, buffer[i], &rmsg, &rstatus)) {
-			/* decode message payload here */
-			process_message(&rmsg);
+	atomic_add(&stats->bytes, len);
+}
+
+/* wakes the RX thread, called from the USB ISR */
+void mavlink_rx_notify(void)
+{
+	k_sem_give(&mavlink_rx_sem);
+}
+
+/* counts bytes the ISR had to throw away because the rx ring was full */
+void mavlink_rx_overrun(int chan, uint32_t len)
+{
+	atomic_add(&rx_stats[chan].overrun, len);
+}
+
+void mavlink_get_rx_stats(int chan, struct mavlink_rx_stats *stats)
+{
+	atomic_set(&stats->bytes, atomic_get(&rx_stats[chan].bytes));
+	atomic_set(&stats->messages, atomic_get(&rx_stats[chan].messages));
+	atomic_set(&stats->parse_errors, atomic_get(&rx_stats[chan].parse_errors));
+	atomic_set(&stats->lost, atomic_get(&rx_stats[chan].lost));
+	atomic_set(&stats->overrun, atomic_get(&rx_stats[chan].overrun));
+}
+
+/*
+ * Parses everything in the rx ring in place each time the ISR signals new
+ * data, so bursts are never left waiting for the next interrupt.
+ */
+void mavlink_rx_thread_entry(void *arg1, void *unused2, void *unused3)
+{
+	LOG_DBG("Initializing MAVLink RX thread");
+
+	struct ring_buf *rx_ringbuf = (struct ring_buf *) arg1;
+	uint8_t *data;
+	uint32_t len;
+
+	while (1) {
+		k_sem_take(&mavlink_rx_sem, K_FOREVER);
+
+		/* a claim stops at the end of the ring, so loop until it's empty */
+		while ((len = ring_buf_get_claim(rx_ringbuf, &data,
+						ring_buf_capacity_get(rx_ringbuf))) > 0) {
+			parse_bytes(MAVLINK_CHAN_USB, data, len);
+			ring_buf_get_finish(rx_ringbuf, len);
 		}
+		ring_buf_get_finish(rx_ringbuf, 0);
 	}
 }
 
-void tim_heartbeat_callback(struct k_timer *timer_id)
+void tim_param_list_callback(struct k_timer *timer_id)
 {
-	k_work_submit(&heartbeat_work);
+	k_work_submit(&param_list_work);
 }
 
-void tim_gimbal_status_callback(struct k_timer *timer_id)
+void tim_stream_callback(struct k_timer *timer_id)
 {
-	k_work_submit(&gimbal_status_work);
+	k_work_submit(&stream_work);
 }
 
-void tim_attitude_status_callback(struct k_timer *timer_id)
+#ifdef CONFIG_APS_BLACKBOX
+void tim_log_transfer_callback(struct k_timer *timer_id)
 {
-	k_work_submit(&attitude_status_work);
+	k_work_submit(&log_transfer_work);
 }
+#endif
 
 void init_mavlink(const struct device *usb_dev,
 		struct ring_buf *rx_ringbuf, struct ring_buf *tx_ringbuf)
@@ -259,26 +1372,166 @@ void init_mavlink(const struct device *usb_dev,
 	timer_callback_data.rx_ringbuf = rx_ringbuf;
 	timer_callback_data.tx_ringbuf = tx_ringbuf;
 
-	k_timer_init(&tim_heartbeat, tim_heartbeat_callback, NULL);
-	k_timer_init(&tim_gimbal_status, tim_gimbal_status_callback, NULL);
-	k_timer_init(&tim_attitude_status, tim_attitude_status_callback, NULL);
+	k_thread_create(&mavlink_rx_thread_data, mavlink_rx_stack_area,
+			K_THREAD_STACK_SIZEOF(mavlink_rx_stack_area),
+			mavlink_rx_thread_entry,
+			(void *) rx_ringbuf, NULL, NULL,
+			MAVLINK_RX_PRIORITY, 0, K_NO_WAIT);
+	k_thread_name_set(&mavlink_rx_thread_data, "mavlink_rx");
+
+	for (int i = 0;i < STREAM_COUNT;i++) {
+		stream_states[i].interval_us = streams[i].default_interval_us;
+	}
 
-	k_work_init(&heartbeat_work, send_heartbeat);
-	k_work_init(&gimbal_status_work, send_gimbal_manager_status);
-	k_work_init(&attitude_status_work, send_gimbal_device_attitude_status);
-	k_work_init(&gimbal_manager_info_work, send_gimbal_manager_info);
+	k_timer_init(&tim_stream, tim_stream_callback, NULL);
+	k_timer_init(&tim_param_list, tim_param_list_callback, NULL);
+
+	k_work_init(&stream_work, send_streams);
+	k_work_init(&param_list_work, send_param_list);
+
+#ifdef CONFIG_APS_BLACKBOX
+	k_timer_init(&tim_log_transfer, tim_log_transfer_callback, NULL);
+	k_work_init(&log_transfer_work, send_log_transfer);
+	k_work_init(&log_erase_work, erase_logs);
+#endif
 }
 
+/* starts the streams, keeping any intervals set since boot */
 void mavlink_timer_start()
 {
-	k_timer_start(&tim_heartbeat, K_MSEC(1000), K_MSEC(1000)); /* 1Hz */
-	k_timer_start(&tim_gimbal_status, K_MSEC(200), K_MSEC(200)); /* 5Hz */
-	k_timer_start(&tim_attitude_status, K_MSEC(100), K_MSEC(100)); /* 10Hz */
+	int64_t now = timestamp_us();
+
+	k_spinlock_key_t key = k_spin_lock(&stream_lock);
+	for (int i = 0;i < STREAM_COUNT;i++) {
+		stream_states[i].next_us = now + stream_states[i].interval_us;
+	}
+	streams_running = true;
+	k_spin_unlock(&stream_lock, key);
+
+	k_work_submit(&stream_work);
 }
 
 void mavlink_timer_stop()
 {
-	k_timer_stop(&tim_heartbeat);
-	k_timer_stop(&tim_gimbal_status);
-	k_timer_stop(&tim_attitude_status);
+	k_spinlock_key_t key = k_spin_lock(&stream_lock);
+	streams_running = false;
+	k_spin_unlock(&stream_lock, key);
+
+	k_timer_stop(&tim_stream);
+	k_timer_stop(&tim_param_list);
+#ifdef CONFIG_APS_BLACKBOX
+	k_timer_stop(&tim_log_transfer);
+#endif
+}
+
+#ifdef CONFIG_APS_BENCH
+/*
+ * Fills data with what a ground station and vehicle send in a second,
+ * repeated until it is full: a heartbeat, GLOBAL_POSITION_INT at 5Hz and
+ * attitude setpoints at 10Hz.
+ *
+ * @return the number of bytes written
+ */
+uint32_t mavlink_bench_stream(uint8_t *data, uint32_t size)
+{
+	/* pitched 30 degrees down */
+	static const float q[4] = {0.9659258f, 0, -0.258819f, 0};
+	mavlink_message_t msg;
+	uint32_t len = 0;
+
+	for (int i = 0;;i++) {
+		int slot = i % 16;
+
+		if (slot == 0) {
+			mavlink_msg_heartbeat_pack_chan(255, MAV_COMP_ID_MISSIONPLANNER,
+					MAVLINK_CHAN_BENCH, &msg, MAV_TYPE_GCS,
+					MAV_AUTOPILOT_INVALID, 0, 0, MAV_STATE_ACTIVE);
+		} else if (slot % 3 == 0) {
+			mavlink_msg_global_position_int_pack_chan(1, MAV_COMP_ID_AUTOPILOT1,
+					MAVLINK_CHAN_BENCH, &msg, i * 200, 384000000 + i,
+					-1220000000 - i, 120000, 80000, 1500, -300, 0, 9000);
+		} else {
+			mavlink_msg_gimbal_manager_set_attitude_pack_chan(255,
+					MAV_COMP_ID_MISSIONPLANNER, MAVLINK_CHAN_BENCH, &msg,
+					mav_sys_id(), mav_comp_id(), 0, 0, q, NAN, NAN, NAN);
+		}
+
+		uint16_t msg_len = mavlink_msg_get_send_buffer_length(&msg);
+		if (len + msg_len > size) {
+			return len;
+		}
+		len += mavlink_msg_to_send_buffer(&data[len], &msg);
+	}
 }
+
+/* the RX parser on a channel of its own, without acting on what it parses */
+bool mavlink_bench_parse_char(uint8_t c)
+{
+	static mavlink_message_t msg;
+	static mavlink_status_t status;
+
+	return mavlink_parse_char(MAVLINK_CHAN_BENCH, c, &msg, &status) != 0;
+}
+
+/* queue_message() of the attitude status, into a ring other than the link's */
+int mavlink_bench_queue(struct ring_buf *tx_ringbuf)
+{
+	static mavlink_message_t msg;
+
+	if (msg.len == 0) {
+		static const float q[4] = {1, 0, 0, 0};
+
+		mavlink_msg_gimbal_device_attitude_status_pack_chan(mav_sys_id(),
+				mav_comp_id(), MAVLINK_CHAN_BENCH, &msg, 0, 0, 0, 0,
+				q, 0, 0, 0, 0);
+	}
+
+	return serialize_message(tx_ringbuf, &msg);
+}
+#endif /* CONFIG_APS_BENCH */
+
+#ifdef CONFIG_SHELL
+static int cmd_mavlink_stats(const struct shell *shell, size_t argc, char **argv)
+{
+	struct mavlink_rx_stats stats;
+	uint32_t uptime_s = MAX(k_uptime_get_32() / MSEC_PER_SEC, 1);
+
+	for (int chan = 0;chan < MAVLINK_CHANNELS;chan++) {
+		mavlink_get_rx_stats(chan, &stats);
+		shell_print(shell, "chan %d: %u bytes (%u B/s avg), %u messages, "
+				"%u parse errors, %u lost, %u overrun",
+				chan, (uint32_t) atomic_get(&stats.bytes),
+				(uint32_t) atomic_get(&stats.bytes) / uptime_s,
+				(uint32_t) atomic_get(&stats.messages),
+				(uint32_t) atomic_get(&stats.parse_errors),
+				(uint32_t) atomic_get(&stats.lost),
+				(uint32_t) atomic_get(&stats.overrun));
+	}
+
+	return 0;
+}
+
+static int cmd_mavlink_streams(const struct shell *shell, size_t argc, char **argv)
+{
+	shell_print(shell, "budget: %d B/s", param_get_int(PARAM_MAV_TX_RATE));
+
+	for (int i = 0;i < STREAM_COUNT;i++) {
+		k_spinlock_key_t key = k_spin_lock(&stream_lock);
+		uint32_t interval_us = stream_states[i].interval_us;
+		k_spin_unlock(&stream_lock, key);
+
+		shell_print(shell, "%5u: %7u us (default %u)", streams[i].msgid,
+				interval_us, streams[i].default_interval_us);
+	}
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_mavlink,
+	SHELL_CMD(stats, NULL, "Show receive statistics", cmd_mavlink_stats),
+	SHELL_CMD(streams, NULL, "Show stream intervals", cmd_mavlink_streams),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(mavlink, &sub_mavlink, "MAVLink link", NULL);
+#endif /* CONFIG_SHELL */
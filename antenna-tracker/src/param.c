@@ -0,0 +1,436 @@
+/**
+ * param.c
+ *
+ * This file contains the parameter table: every value that can be tuned at
+ * runtime (over MAVLink or the shell) without a rebuild. Values are kept in
+ * RAM for the control loop and persisted through the settings subsystem.
+ *
+ * Consumers check param_generation() from their own loop and reload what
+ * they need when it changes, so nothing ever waits on a parameter write.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <zephyr.h>
+#include <sys/atomic.h>
+#include <settings/settings.h>
+#include <logging/log.h>
+#ifdef CONFIG_SHELL
+#include <shell/shell.h>
+#endif
+
+#include "param.h"
+
+LOG_MODULE_REGISTER(param, LOG_LEVEL_DBG);
+
+struct param_def {
+	const char *name;
+	enum param_type type;
+	union param_value def;
+	union param_value min, max;
+};
+
+#define PARAM_FLOAT(_name, _def, _min, _max) { \
+	.name = _name, \
+	.type = PARAM_TYPE_FLOAT, \
+	.def = {.f = _def}, \
+	.min = {.f = _min}, \
+	.max = {.f = _max}, \
+}
+
+#define PARAM_INT(_type, _name, _def, _min, _max) { \
+	.name = _name, \
+	.type = _type, \
+	.def = {.i = _def}, \
+	.min = {.i = _min}, \
+	.max = {.i = _max}, \
+}
+
+/* gains are per degree (or degree/s) of error, outputs normalized to [-1, 1] */
+#define PARAM_GAIN(_name, _def) PARAM_FLOAT(_name, _def, 0, 10)
+#define PARAM_ROT(_name, _def) PARAM_FLOAT(_name, _def, -1, 1)
+#define PARAM_SOFT_IRON(_name, _def) PARAM_FLOAT(_name, _def, -10, 10)
+
+static const struct param_def param_defs[PARAM_COUNT] = {
+	[PARAM_ATT_ALT_KP] = PARAM_GAIN("ATT_ALT_KP", 0.025f),
+	[PARAM_ATT_ALT_KI] = PARAM_GAIN("ATT_ALT_KI", 0.005f),
+	[PARAM_ATT_ALT_KD] = PARAM_GAIN("ATT_ALT_KD", 0.0005f),
+	[PARAM_ATT_ALT_KFF] = PARAM_GAIN("ATT_ALT_KFF", 0),
+	[PARAM_ATT_ALT_ILIM] = PARAM_FLOAT("ATT_ALT_ILIM", 0.3f, 0, 1),
+	[PARAM_ATT_ALT_DCUT] = PARAM_FLOAT("ATT_ALT_DCUT", 20, 0, 500),
+	[PARAM_ATT_AZM_KP] = PARAM_GAIN("ATT_AZM_KP", 0.025f),
+	[PARAM_ATT_AZM_KI] = PARAM_GAIN("ATT_AZM_KI", 0.005f),
+	[PARAM_ATT_AZM_KD] = PARAM_GAIN("ATT_AZM_KD", 0.0005f),
+	[PARAM_ATT_AZM_KFF] = PARAM_GAIN("ATT_AZM_KFF", 0),
+	[PARAM_ATT_AZM_ILIM] = PARAM_FLOAT("ATT_AZM_ILIM", 0.3f, 0, 1),
+	[PARAM_ATT_AZM_DCUT] = PARAM_FLOAT("ATT_AZM_DCUT", 20, 0, 500),
+
+	/* degrees/s, /s^2 and /s^3, a VMAX of 0 passes setpoints straight through */
+	[PARAM_ATT_ALT_VMAX] = PARAM_FLOAT("ATT_ALT_VMAX", 90, 0, 1000),
+	[PARAM_ATT_ALT_AMAX] = PARAM_FLOAT("ATT_ALT_AMAX", 360, 1, 10000),
+	[PARAM_ATT_ALT_JMAX] = PARAM_FLOAT("ATT_ALT_JMAX", 10000, 10, 1000000),
+	[PARAM_ATT_AZM_VMAX] = PARAM_FLOAT("ATT_AZM_VMAX", 90, 0, 1000),
+	[PARAM_ATT_AZM_AMAX] = PARAM_FLOAT("ATT_AZM_AMAX", 360, 1, 10000),
+	[PARAM_ATT_AZM_JMAX] = PARAM_FLOAT("ATT_AZM_JMAX", 10000, 10, 1000000),
+
+	/* degrees, 0 turns freely (slip ring) */
+	[PARAM_ATT_AZM_WRAP] = PARAM_FLOAT("ATT_AZM_WRAP", 0, 0, 3600),
+
+	/* the MPU6050 is mounted with its x axis pointing down */
+	[PARAM_EST_IROT_00] = PARAM_ROT("EST_IROT_00", 0),
+	[PARAM_EST_IROT_01] = PARAM_ROT("EST_IROT_01", 0),
+	[PARAM_EST_IROT_02] = PARAM_ROT("EST_IROT_02", 1),
+	[PARAM_EST_IROT_10] = PARAM_ROT("EST_IROT_10", 0),
+	[PARAM_EST_IROT_11] = PARAM_ROT("EST_IROT_11", 1),
+	[PARAM_EST_IROT_12] = PARAM_ROT("EST_IROT_12", 0),
+	[PARAM_EST_IROT_20] = PARAM_ROT("EST_IROT_20", -1),
+	[PARAM_EST_IROT_21] = PARAM_ROT("EST_IROT_21", 0),
+	[PARAM_EST_IROT_22] = PARAM_ROT("EST_IROT_22", 0),
+
+	[PARAM_EST_MROT_00] = PARAM_ROT("EST_MROT_00", 1),
+	[PARAM_EST_MROT_01] = PARAM_ROT("EST_MROT_01", 0),
+	[PARAM_EST_MROT_02] = PARAM_ROT("EST_MROT_02", 0),
+	[PARAM_EST_MROT_10] = PARAM_ROT("EST_MROT_10", 0),
+	[PARAM_EST_MROT_11] = PARAM_ROT("EST_MROT_11", 1),
+	[PARAM_EST_MROT_12] = PARAM_ROT("EST_MROT_12", 0),
+	[PARAM_EST_MROT_20] = PARAM_ROT("EST_MROT_20", 0),
+	[PARAM_EST_MROT_21] = PARAM_ROT("EST_MROT_21", 0),
+	[PARAM_EST_MROT_22] = PARAM_ROT("EST_MROT_22", 1),
+
+	/* bench calibration of the original unit, see calib/README.md */
+	[PARAM_MAG_OFS_X] = PARAM_FLOAT("MAG_OFS_X", -0.282569f, -8, 8),
+	[PARAM_MAG_OFS_Y] = PARAM_FLOAT("MAG_OFS_Y", -0.363303f, -8, 8),
+	[PARAM_MAG_OFS_Z] = PARAM_FLOAT("MAG_OFS_Z", -0.325688f, -8, 8),
+	[PARAM_MAG_SI_00] = PARAM_SOFT_IRON("MAG_SI_00", 1.125176f),
+	[PARAM_MAG_SI_01] = PARAM_SOFT_IRON("MAG_SI_01", 0),
+	[PARAM_MAG_SI_02] = PARAM_SOFT_IRON("MAG_SI_02", 0),
+	[PARAM_MAG_SI_10] = PARAM_SOFT_IRON("MAG_SI_10", 0),
+	[PARAM_MAG_SI_11] = PARAM_SOFT_IRON("MAG_SI_11", 0.976801f),
+	[PARAM_MAG_SI_12] = PARAM_SOFT_IRON("MAG_SI_12", 0),
+	[PARAM_MAG_SI_20] = PARAM_SOFT_IRON("MAG_SI_20", 0),
+	[PARAM_MAG_SI_21] = PARAM_SOFT_IRON("MAG_SI_21", 0),
+	[PARAM_MAG_SI_22] = PARAM_SOFT_IRON("MAG_SI_22", 0.919540f),
+
+	/* MAV_COMP_ID_GIMBAL */
+	[PARAM_MAV_SYS_ID] = PARAM_INT(PARAM_TYPE_UINT8, "MAV_SYS_ID", 220, 1, 255),
+	[PARAM_MAV_COMP_ID] = PARAM_INT(PARAM_TYPE_UINT8, "MAV_COMP_ID", 154, 1, 255),
+	/* unlimited suits USB, set it to about 80% of a radio's rate */
+	[PARAM_MAV_TX_RATE] = PARAM_INT(PARAM_TYPE_INT32, "MAV_TX_RATE", 0, 0, 1000000),
+	/* off, the frames are noise to anything only speaking MAVLink */
+	[PARAM_TLM_RECORDS] = PARAM_INT(PARAM_TYPE_INT32, "TLM_RECORDS", 0, 0, 0xff),
+
+	/* degrees clockwise from north */
+	[PARAM_GMB_YAW_BASE] = PARAM_FLOAT("GMB_YAW_BASE", 0, -180, 180),
+
+	/* degE7, meters above mean sea level and milliseconds */
+	[PARAM_TRK_HOME_LAT] = PARAM_INT(PARAM_TYPE_INT32, "TRK_HOME_LAT", 0, -900000000, 900000000),
+	[PARAM_TRK_HOME_LON] = PARAM_INT(PARAM_TYPE_INT32, "TRK_HOME_LON", 0, -1800000000, 1800000000),
+	[PARAM_TRK_HOME_ALT] = PARAM_FLOAT("TRK_HOME_ALT", 0, -500, 10000),
+	[PARAM_TRK_LATENCY] = PARAM_FLOAT("TRK_LATENCY", 100, 0, 2000),
+};
+
+/* open addressing table from name hash to index, at most half full */
+#define PARAM_HASH_SIZE 128
+#define PARAM_HASH_EMPTY 0xFF
+BUILD_ASSERT(PARAM_COUNT * 2 <= PARAM_HASH_SIZE, "param hash table too small");
+BUILD_ASSERT(PARAM_COUNT < PARAM_HASH_EMPTY, "param index does not fit");
+
+static uint8_t param_hash[PARAM_HASH_SIZE];
+
+static struct k_spinlock param_lock;
+static union param_value param_values[PARAM_COUNT];
+static atomic_t param_gen;
+
+/* values changed since the last flash write, saved by save_work */
+static ATOMIC_DEFINE(param_dirty, PARAM_COUNT);
+static struct k_work save_work;
+
+/* FNV-1a over at most len characters, stopping at a null */
+static uint32_t param_name_hash(const char *name, size_t len)
+{
+	uint32_t hash = 2166136261U;
+
+	for (size_t i = 0;i < len && name[i] != '\0';i++) {
+		hash ^= (uint8_t) name[i];
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+static bool param_name_eq(enum param_id id, const char *name, size_t len)
+{
+	const char *def_name = param_defs[id].name;
+	size_t def_len = strlen(def_name);
+
+	if (strncmp(def_name, name, len) != 0) {
+		return false;
+	}
+
+	/* name may be shorter than len and null terminated, or exactly def_len */
+	return def_len == len || (def_len < len && name[def_len] == '\0');
+}
+
+/*
+ * Looks up a parameter by name.
+ *
+ * @param len the most characters name can have, it does not need a null
+ * @return the parameter index, or -ENOENT
+ */
+int param_find(const char *name, size_t len)
+{
+	uint32_t slot = param_name_hash(name, len) % PARAM_HASH_SIZE;
+
+	while (param_hash[slot] != PARAM_HASH_EMPTY) {
+		if (param_name_eq(param_hash[slot], name, len)) {
+			return param_hash[slot];
+		}
+		slot = (slot + 1) % PARAM_HASH_SIZE;
+	}
+
+	return -ENOENT;
+}
+
+const char *param_name(enum param_id id)
+{
+	return param_defs[id].name;
+}
+
+enum param_type param_type(enum param_id id)
+{
+	return param_defs[id].type;
+}
+
+float param_get_float(enum param_id id)
+{
+	k_spinlock_key_t key = k_spin_lock(&param_lock);
+	float value = param_values[id].f;
+	k_spin_unlock(&param_lock, key);
+
+	return value;
+}
+
+int32_t param_get_int(enum param_id id)
+{
+	k_spinlock_key_t key = k_spin_lock(&param_lock);
+	int32_t value = param_values[id].i;
+	k_spin_unlock(&param_lock, key);
+
+	return value;
+}
+
+/* reads count consecutive float parameters in one go, e.g. a matrix */
+void param_get_float_array(enum param_id first, float *values, int count)
+{
+	k_spinlock_key_t key = k_spin_lock(&param_lock);
+	for (int i = 0;i < count;i++) {
+		values[i] = param_values[first + i].f;
+	}
+	k_spin_unlock(&param_lock, key);
+}
+
+/* bumped on every change, so consumers know to reload */
+uint32_t param_generation(void)
+{
+	return atomic_get(&param_gen);
+}
+
+static bool param_in_range(enum param_id id, union param_value value)
+{
+	const struct param_def *def = &param_defs[id];
+
+	if (def->type == PARAM_TYPE_FLOAT) {
+		return value.f >= def->min.f && value.f <= def->max.f;
+	}
+
+	return value.i >= def->min.i && value.i <= def->max.i;
+}
+
+/*
+ * Changes a parameter; it applies right away and is written to flash in
+ * the background.
+ *
+ * @return 0, or -EINVAL if the value is out of range
+ */
+int param_set(enum param_id id, union param_value value)
+{
+	if (id < 0 || id >= PARAM_COUNT) {
+		return -ENOENT;
+	}
+	if (!param_in_range(id, value)) {
+		return -EINVAL;
+	}
+
+	k_spinlock_key_t key = k_spin_lock(&param_lock);
+	param_values[id] = value;
+	k_spin_unlock(&param_lock, key);
+
+	atomic_inc(&param_gen);
+	atomic_set_bit(param_dirty, id);
+	k_work_submit(&save_work);
+
+	return 0;
+}
+
+int param_set_float(enum param_id id, float value)
+{
+	return param_set(id, (union param_value) {.f = value});
+}
+
+int param_set_int(enum param_id id, int32_t value)
+{
+	return param_set(id, (union param_value) {.i = value});
+}
+
+static int param_settings_set(const char *key, size_t len,
+		settings_read_cb read_cb, void *cb_arg)
+{
+	union param_value value;
+
+	int id = param_find(key, strlen(key));
+	if (id < 0) {
+		/* left over from an older firmware, ignore it */
+		return 0;
+	}
+
+	if (len != sizeof(value)) {
+		return -EINVAL;
+	}
+
+	int ret = read_cb(cb_arg, &value, sizeof(value));
+	if (ret < 0) {
+		return ret;
+	}
+
+	if (!param_in_range(id, value)) {
+		LOG_WRN("Stored %s out of range, using default", param_defs[id].name);
+		return 0;
+	}
+
+	k_spinlock_key_t lock_key = k_spin_lock(&param_lock);
+	param_values[id] = value;
+	k_spin_unlock(&param_lock, lock_key);
+
+	return 0;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(param, "param", NULL, param_settings_set,
+		NULL, NULL);
+
+/* flash writes stall the CPU, so keep them on the system workqueue */
+static void param_save_handler(struct k_work *item)
+{
+	char name[sizeof("param/") + PARAM_NAME_LEN];
+
+	for (int id = 0;id < PARAM_COUNT;id++) {
+		if (!atomic_test_and_clear_bit(param_dirty, id)) {
+			continue;
+		}
+
+		k_spinlock_key_t key = k_spin_lock(&param_lock);
+		union param_value value = param_values[id];
+		k_spin_unlock(&param_lock, key);
+
+		snprintk(name, sizeof(name), "param/%s", param_defs[id].name);
+		int ret = settings_save_one(name, &value, sizeof(value));
+		if (ret != 0) {
+			LOG_ERR("Failed to save %s: %d", param_defs[id].name, ret);
+		}
+	}
+}
+
+/*
+ * Builds the name lookup and loads the stored values over the defaults.
+ * The settings subsystem must already be initialized (see calib_init).
+ */
+int param_init(void)
+{
+	memset(param_hash, PARAM_HASH_EMPTY, sizeof(param_hash));
+
+	for (int id = 0;id < PARAM_COUNT;id++) {
+		const char *name = param_defs[id].name;
+		uint32_t slot = param_name_hash(name, PARAM_NAME_LEN) % PARAM_HASH_SIZE;
+
+		__ASSERT(strlen(name) <= PARAM_NAME_LEN, "%s too long", name);
+		while (param_hash[slot] != PARAM_HASH_EMPTY) {
+			slot = (slot + 1) % PARAM_HASH_SIZE;
+		}
+		param_hash[slot] = id;
+
+		param_values[id] = param_defs[id].def;
+	}
+
+	k_work_init(&save_work, param_save_handler);
+
+	int ret = settings_load_subtree("param");
+	atomic_inc(&param_gen);
+
+	return ret;
+}
+
+#ifdef CONFIG_SHELL
+static void param_print(const struct shell *shell, enum param_id id)
+{
+	if (param_defs[id].type == PARAM_TYPE_FLOAT) {
+		shell_print(shell, "%3d %-16s %f", id, param_defs[id].name,
+				(double) param_get_float(id));
+	} else {
+		shell_print(shell, "%3d %-16s %d", id, param_defs[id].name,
+				param_get_int(id));
+	}
+}
+
+static int cmd_param_show(const struct shell *shell, size_t argc, char **argv)
+{
+	if (argc > 1) {
+		int id = param_find(argv[1], PARAM_NAME_LEN);
+		if (id < 0) {
+			shell_error(shell, "Unknown parameter %s", argv[1]);
+			return id;
+		}
+		param_print(shell, id);
+		return 0;
+	}
+
+	for (int id = 0;id < PARAM_COUNT;id++) {
+		param_print(shell, id);
+	}
+
+	return 0;
+}
+
+static int cmd_param_set(const struct shell *shell, size_t argc, char **argv)
+{
+	union param_value value;
+
+	int id = param_find(argv[1], PARAM_NAME_LEN);
+	if (id < 0) {
+		shell_error(shell, "Unknown parameter %s", argv[1]);
+		return id;
+	}
+
+	if (param_defs[id].type == PARAM_TYPE_FLOAT) {
+		value.f = strtof(argv[2], NULL);
+	} else {
+		value.i = strtol(argv[2], NULL, 0);
+	}
+
+	int ret = param_set(id, value);
+	if (ret != 0) {
+		shell_error(shell, "%s out of range", argv[1]);
+		return ret;
+	}
+
+	param_print(shell, id);
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_param,
+	SHELL_CMD_ARG(show, NULL, "Show parameters: [name]", cmd_param_show, 1, 1),
+	SHELL_CMD_ARG(set, NULL, "Set a parameter: <name> <value>", cmd_param_set, 3, 0),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(param, &sub_param, "Tunable parameters", NULL);
+#endif /* CONFIG_SHELL */
@@ -0,0 +1,209 @@
+/**
+ * perf.c
+ *
+ * This file contains the control loop timing statistics: min/avg/max and a
+ * log2 histogram for each pipeline stage, and drop counters for the message
+ * queues between the stages. They can be read from the shell (perf show)
+ * and are streamed over MAVLink.
+ */
+
+#include <zephyr.h>
+#include <init.h>
+#include <sys/atomic.h>
+#include <logging/log.h>
+#ifdef CONFIG_SHELL
+#include <shell/shell.h>
+#endif
+
+#include "perf.h"
+
+LOG_MODULE_REGISTER(perf, LOG_LEVEL_DBG);
+
+static const char *const stage_names[PERF_STAGE_COUNT] = {
+	[PERF_STAGE_ESTIMATE] = "estimate",
+	[PERF_STAGE_CONTROL] = "control",
+	[PERF_STAGE_OUTPUT] = "output",
+	[PERF_STAGE_TOTAL] = "total",
+	[PERF_STAGE_PERIOD] = "period",
+};
+
+static const char *const drop_names[PERF_DROP_COUNT] = {
+	[PERF_DROP_IMU] = "imu",
+	[PERF_DROP_MAG] = "mag",
+	[PERF_DROP_PWMCTRL] = "pwm",
+	[PERF_DROP_TX] = "tx",
+	[PERF_DROP_BLACKBOX] = "log",
+	[PERF_DROP_TELEMETRY] = "tlm",
+};
+
+/* recorded from the control path, read from the shell and telemetry */
+static struct k_spinlock perf_lock;
+static struct perf_stat stats[PERF_STAGE_COUNT];
+static int64_t prev_output;
+
+static atomic_t drops[PERF_DROP_COUNT];
+
+static void stat_reset(struct perf_stat *stat)
+{
+	*stat = (struct perf_stat) {
+		.min = UINT32_MAX,
+	};
+}
+
+static int hist_bin(uint32_t duration)
+{
+	int bin = 0;
+
+	while (duration > 1 && bin < PERF_HIST_BINS - 1) {
+		duration >>= 1;
+		bin++;
+	}
+
+	return bin;
+}
+
+static void stat_record(struct perf_stat *stat, int64_t duration)
+{
+	/* timestamps come from the same clock, negative means a bad stamp */
+	uint32_t us = MIN(MAX(duration, 0), UINT32_MAX);
+
+	stat->count++;
+	stat->sum += us;
+	stat->min = MIN(stat->min, us);
+	stat->max = MAX(stat->max, us);
+	stat->hist[hist_bin(us)]++;
+}
+
+/*
+ * Records one trip through the control pipeline. All times are
+ * timestamp_us() values; output is the time the PWM outputs were written.
+ */
+void perf_record_cycle(int64_t sampled, int64_t estimated, int64_t controlled,
+		int64_t output)
+{
+	k_spinlock_key_t key = k_spin_lock(&perf_lock);
+
+	stat_record(&stats[PERF_STAGE_ESTIMATE], estimated - sampled);
+	stat_record(&stats[PERF_STAGE_CONTROL], controlled - estimated);
+	stat_record(&stats[PERF_STAGE_OUTPUT], output - controlled);
+	stat_record(&stats[PERF_STAGE_TOTAL], output - sampled);
+	if (prev_output != 0) {
+		stat_record(&stats[PERF_STAGE_PERIOD], output - prev_output);
+	}
+	prev_output = output;
+
+	k_spin_unlock(&perf_lock, key);
+}
+
+/* counts a message thrown away because a queue was full */
+void perf_record_drop(enum perf_drop drop)
+{
+	atomic_inc(&drops[drop]);
+}
+
+void perf_get_stat(enum perf_stage stage, struct perf_stat *stat)
+{
+	k_spinlock_key_t key = k_spin_lock(&perf_lock);
+	*stat = stats[stage];
+	k_spin_unlock(&perf_lock, key);
+}
+
+uint32_t perf_get_drops(enum perf_drop drop)
+{
+	return atomic_get(&drops[drop]);
+}
+
+const char *perf_stage_name(enum perf_stage stage)
+{
+	return stage_names[stage];
+}
+
+const char *perf_drop_name(enum perf_drop drop)
+{
+	return drop_names[drop];
+}
+
+void perf_reset(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&perf_lock);
+	for (int i = 0;i < PERF_STAGE_COUNT;i++) {
+		stat_reset(&stats[i]);
+	}
+	prev_output = 0;
+	k_spin_unlock(&perf_lock, key);
+
+	for (int i = 0;i < PERF_DROP_COUNT;i++) {
+		atomic_set(&drops[i], 0);
+	}
+}
+
+static int perf_init(const struct device *dev)
+{
+	ARG_UNUSED(dev);
+
+	perf_reset();
+	return 0;
+}
+
+SYS_INIT(perf_init, APPLICATION, CONFIG_APPLICATION_INIT_PRIORITY);
+
+#ifdef CONFIG_SHELL
+static int cmd_perf_show(const struct shell *shell, size_t argc, char **argv)
+{
+	struct perf_stat stat;
+
+	shell_print(shell, "%-9s %8s %8s %8s %8s", "stage", "count",
+			"min(us)", "avg(us)", "max(us)");
+	for (int i = 0;i < PERF_STAGE_COUNT;i++) {
+		perf_get_stat(i, &stat);
+		if (stat.count == 0) {
+			shell_print(shell, "%-9s %8u", stage_names[i], 0);
+			continue;
+		}
+
+		shell_print(shell, "%-9s %8u %8u %8u %8u", stage_names[i], stat.count,
+				stat.min, (uint32_t) (stat.sum / stat.count), stat.max);
+	}
+
+	char line[16 + PERF_STAGE_COUNT * 10];
+	int len = snprintk(line, sizeof(line), "\n%7s", "us");
+	for (int i = 0;i < PERF_STAGE_COUNT;i++) {
+		len += snprintk(&line[len], sizeof(line) - len, " %9s", stage_names[i]);
+	}
+	shell_print(shell, "%s", line);
+
+	for (int bin = 0;bin < PERF_HIST_BINS;bin++) {
+		len = snprintk(line, sizeof(line), "%6u%s", 1U << bin,
+				(bin == PERF_HIST_BINS - 1) ? "+" : " ");
+
+		for (int i = 0;i < PERF_STAGE_COUNT;i++) {
+			perf_get_stat(i, &stat);
+			len += snprintk(&line[len], sizeof(line) - len, " %9u",
+					stat.hist[bin]);
+		}
+		shell_print(shell, "%s", line);
+	}
+
+	shell_print(shell, "\ndropped");
+	for (int i = 0;i < PERF_DROP_COUNT;i++) {
+		shell_print(shell, "%-9s %8u", drop_names[i], perf_get_drops(i));
+	}
+
+	return 0;
+}
+
+static int cmd_perf_reset(const struct shell *shell, size_t argc, char **argv)
+{
+	perf_reset();
+	shell_print(shell, "Statistics cleared");
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_perf,
+	SHELL_CMD(show, NULL, "Show control loop timing and queue drops", cmd_perf_show),
+	SHELL_CMD(reset, NULL, "Clear control loop statistics", cmd_perf_reset),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(perf, &sub_perf, "Control loop performance", NULL);
+#endif /* CONFIG_SHELL */
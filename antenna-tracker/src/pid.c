@@ -0,0 +1,90 @@
+/**
+ * pid.c
+ *
+ * This file contains the PID controller used by the attitude controllers.
+ *
+ * The derivative acts on the measured rate rather than on the error, so
+ * setpoint steps do not kick the output, and the rate comes straight from
+ * the gyro (low-pass filtered) instead of differentiating the angle. The
+ * integrator stops while the output is saturated in the direction of the
+ * error, and is bounded on its own, so it cannot wind up.
+ */
+
+#include <math.h>
+#include <zephyr.h>
+
+#include "util.h"
+#include "pid.h"
+
+/* steps further apart than this skip integration and reseed the rate filter */
+static const float PID_DT_MAX = 0.1f; /* s */
+
+/* starts the controller over, e.g. after the loop was not running */
+void pid_reset(struct pid_state *pid, int64_t time)
+{
+	pid->integral = 0;
+	pid->rate_filtered = 0;
+	pid->prev_time = time;
+	pid->output = 0;
+}
+
+/*
+ * Runs one controller step.
+ *
+ * @param error target - measurement
+ * @param rate measured rate of change of the measurement
+ * @param target_rate rate of change of the target, for the feed-forward term
+ * @param time timestamp of the measurement in us
+ * @return output constrained to the output limit
+ */
+float pid_update(struct pid_state *pid, float error, float rate,
+		float target_rate, int64_t time)
+{
+	struct pid_gains gains;
+	pid_get_gains(pid, &gains);
+
+	float dt = (float) (time - pid->prev_time) / 1000000.0f;
+	pid->prev_time = time;
+
+	/* repeated or out of order timestamps would blow up the filter */
+	bool dt_valid = (dt > 0 && dt < PID_DT_MAX);
+
+	if (!dt_valid || gains.d_cutoff_hz <= 0) {
+		pid->rate_filtered = rate;
+	} else {
+		/* first order low-pass, alpha = dt / (RC + dt) */
+		float rc = 1.0f / (2.0f * 3.1415926f * gains.d_cutoff_hz);
+		pid->rate_filtered += (rate - pid->rate_filtered) * (dt / (rc + dt));
+	}
+
+	/* clamping anti-windup: hold the integral while pushing into saturation */
+	bool saturated = (fabsf(pid->output) >= gains.out_limit)
+		&& (error * pid->output) > 0;
+	if (dt_valid && !saturated) {
+		pid->integral += gains.ki * error * dt;
+	}
+	pid->integral = constrain(pid->integral, -gains.i_limit, gains.i_limit);
+
+	float output = (gains.kp * error)
+		+ pid->integral
+		- (gains.kd * pid->rate_filtered)
+		+ (gains.kff * target_rate);
+
+	pid->output = output;
+
+	return constrain(output, -gains.out_limit, gains.out_limit);
+}
+
+void pid_set_gains(struct pid_state *pid, const struct pid_gains *gains)
+{
+	k_spinlock_key_t key = k_spin_lock(&pid->lock);
+	pid->gains = *gains;
+	k_spin_unlock(&pid->lock, key);
+}
+
+void pid_get_gains(struct pid_state *pid, struct pid_gains *gains)
+{
+	k_spinlock_key_t key = k_spin_lock(&pid->lock);
+	*gains = pid->gains;
+	k_spin_unlock(&pid->lock, key);
+}
@@ -0,0 +1,145 @@
+/**
+ * pipeline.c
+ *
+ * This file contains the fused control pipeline. Instead of handing each
+ * sample through the IMU, estimator, attctrl and pwmctrl threads, a single
+ * timer driven thread runs sample -> estimate -> control -> PWM in one pass,
+ * so there are no queue hops or context switches between the sensor and
+ * the motors.
+ */
+
+#include <zephyr.h>
+#include <device.h>
+#include <logging/log.h>
+
+#include "imu.h"
+#include "mag.h"
+#include "estimator.h"
+#include "gimbal.h"
+#include "attctrl.h"
+#include "pwmctrl.h"
+#include "statebus.h"
+#include "pipeline.h"
+
+LOG_MODULE_REGISTER(pipeline, LOG_LEVEL_DBG);
+
+#define PIPELINE_STACK_SIZE 3000
+/* cooperative, so a cycle is never preempted by the rest of the application */
+#define PIPELINE_PRIORITY K_PRIO_COOP(2)
+
+#ifdef CONFIG_APS_IMU_FIFO
+#define PIPELINE_BATCH_MAX IMU_FIFO_BATCH_MAX
+#else
+#define PIPELINE_BATCH_MAX 1
+#endif
+
+extern void pipeline_thread_entry(void *, void *, void *);
+
+K_THREAD_STACK_DEFINE(pipeline_stack_area, PIPELINE_STACK_SIZE);
+struct k_thread pipeline_thread_data;
+
+K_SEM_DEFINE(pipeline_tick_sem, 0, 1);
+
+static void pipeline_tick(struct k_timer *timer)
+{
+	k_sem_give(&pipeline_tick_sem);
+}
+
+K_TIMER_DEFINE(pipeline_timer, pipeline_tick, NULL);
+
+void pipeline_init(const struct device *imu_dev, struct k_msgq *mag_msgq)
+{
+	LOG_INF("Initializing fused control pipeline");
+
+	if (pwmctrl_setup() != 0) {
+		return;
+	}
+
+	k_tid_t pipeline_tid = k_thread_create(&pipeline_thread_data, pipeline_stack_area,
+										  K_THREAD_STACK_SIZEOF(pipeline_stack_area),
+										  pipeline_thread_entry,
+										  (void *) imu_dev, (void *) mag_msgq, NULL,
+										  PIPELINE_PRIORITY, 0, K_NO_WAIT);
+	k_thread_name_set(pipeline_tid, "pipeline");
+}
+
+/* reads every IMU sample taken since the last cycle */
+static int pipeline_sample(const struct device *imu_dev, struct imu_sample *samples)
+{
+#ifdef CONFIG_APS_IMU_FIFO
+	return imu_fifo_read(samples, PIPELINE_BATCH_MAX);
+#else
+	int ret = sample_imu(imu_dev, &samples[0]);
+	return (ret == 0) ? 1 : ret;
+#endif
+}
+
+void pipeline_thread_entry(void *arg1, void *arg2, void *arg3)
+{
+	LOG_DBG("Starting fused control pipeline");
+
+	const struct device *imu_dev = (const struct device *) arg1;
+	struct k_msgq *mag_msgq = (struct k_msgq *) arg2;
+
+	static struct est_state est;
+	static struct imu_sample samples[PIPELINE_BATCH_MAX];
+	struct mag_sample mag_sample;
+	struct attitude_frame att_frame;
+	struct motor_setpoint motor_setpoint;
+	struct command_setpoint command_setpoint;
+	bool controlling = false;
+	int ret;
+
+#ifdef CONFIG_APS_IMU_FIFO
+	ret = imu_fifo_init();
+	if (ret != 0) {
+		LOG_ERR("Failed to configure IMU FIFO: %d", ret);
+		return;
+	}
+#endif
+
+	est_state_init(&est);
+
+	k_timer_start(&pipeline_timer, K_USEC(CONFIG_APS_PIPELINE_PERIOD_US),
+			K_USEC(CONFIG_APS_PIPELINE_PERIOD_US));
+
+	while (1) {
+		k_sem_take(&pipeline_tick_sem, K_FOREVER);
+
+		ret = pipeline_sample(imu_dev, samples);
+		if (ret < 0) {
+			LOG_ERR("Error sampling IMU: %d", ret);
+			continue;
+		}
+
+		/* the mag is much slower and keeps its own poll thread */
+		if (k_msgq_get(mag_msgq, &mag_sample, K_NO_WAIT) == 0) {
+			est_add_mag(&est, &mag_sample);
+		}
+
+		/* run the filter over the whole batch, control on the newest */
+		bool updated = false;
+		for (int i = 0;i < ret;i++) {
+			if (est_add_imu(&est, &samples[i], &att_frame) == 0) {
+				updated = true;
+			}
+		}
+		if (!updated) {
+			continue;
+		}
+
+		statebus_publish(&attitude_topic, &att_frame);
+
+		if (!controlling) {
+			attctrl_reset(&att_frame);
+			controlling = true;
+			continue;
+		}
+
+		statebus_read(&setpoint_topic, &command_setpoint);
+		attctrl_step(&att_frame, &command_setpoint,
+				&motor_setpoint);
+
+		pwmctrl_apply(&motor_setpoint);
+	}
+}
@@ -0,0 +1,262 @@
+/**
+ * plant.c
+ *
+ * This file contains a model of the tracker hardware for simulation. Each
+ * axis is a continuous rotation servo: the pulse width sets a target speed
+ * past a dead band, the speed follows it with a first order lag standing
+ * in for the load inertia, and the axis follows the servo through some
+ * backlash. The sensors see the resulting attitude, with noise and bias,
+ * in their own mounting frame and (for the mag) behind hard and soft iron,
+ * so the firmware's calibration path is exercised like on the real thing.
+ *
+ * The body is the estimator's: x is the altitude axis, z points up when
+ * level, and the attitude is the azimuth rotation about earth z followed
+ * by the altitude rotation about body x.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include "plant.h"
+
+static const float PLANT_PI = 3.14159265f;
+static const float GRAVITY = 9.80665f; /* m/s^2 */
+
+static const float PULSE_CENTER = 1500; /* us */
+static const float PULSE_RANGE = 500; /* us, center to full deflection */
+
+void plant_config_default(struct plant_config *config)
+{
+	/* body to sensor, the transposes of the default EST_IROT and EST_MROT */
+	static const float imu_rot[3][3] = {
+		{0, 0, -1},
+		{0, 1, 0},
+		{1, 0, 0},
+	};
+	static const float mag_rot[3][3] = {
+		{1, 0, 0},
+		{0, 1, 0},
+		{0, 0, 1},
+	};
+
+	memset(config, 0, sizeof(*config));
+
+	for (int i = 0;i < PLANT_AXIS_COUNT;i++) {
+		config->axis[i].speed_max = 360;
+		config->axis[i].deadband = 20;
+		config->axis[i].tau = 0.05f;
+		config->axis[i].backlash = 0.5f;
+	}
+	config->axis[PLANT_AXIS_ALT].limit = 90;
+
+	config->gyro_noise = 0.002f;
+	config->gyro_bias[0] = 0.01f;
+	config->gyro_bias[1] = -0.02f;
+	config->gyro_bias[2] = 0.005f;
+	config->accel_noise = 0.03f;
+	config->mag_noise = 0.002f;
+	config->temp = 25;
+
+	config->mag_field[0] = 0.2f;
+	config->mag_field[1] = 0;
+	config->mag_field[2] = -0.4f;
+
+	memcpy(config->imu_rot, imu_rot, sizeof(imu_rot));
+	memcpy(config->mag_rot, mag_rot, sizeof(mag_rot));
+
+	/* inverses of the default MAG_SI and MAG_OFS */
+	config->mag_scale[0] = 1 / 1.125176f;
+	config->mag_scale[1] = 1 / 0.976801f;
+	config->mag_scale[2] = 1 / 0.919540f;
+	config->mag_offset[0] = -0.282569f;
+	config->mag_offset[1] = -0.363303f;
+	config->mag_offset[2] = -0.325688f;
+
+	config->seed = 1;
+}
+
+void plant_init(struct plant_state *plant, const struct plant_config *config,
+		float alt, float azm)
+{
+	memset(plant, 0, sizeof(*plant));
+	plant->config = *config;
+	plant->rng = config->seed ? config->seed : 1;
+
+	plant->axis[PLANT_AXIS_ALT].motor = alt;
+	plant->axis[PLANT_AXIS_ALT].angle = alt;
+	plant->axis[PLANT_AXIS_AZM].motor = azm;
+	plant->axis[PLANT_AXIS_AZM].angle = azm;
+}
+
+/* xorshift32, deterministic for a given seed so runs can be repeated */
+static float uniform(struct plant_state *plant)
+{
+	uint32_t x = plant->rng;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	plant->rng = x;
+
+	/* (0, 1], so the log below stays finite */
+	return ((x >> 8) + 1) * (1.0f / (1 << 24));
+}
+
+/* Box-Muller, throwing away the second value */
+static float gaussian(struct plant_state *plant, float sigma)
+{
+	if (sigma <= 0) {
+		return 0;
+	}
+
+	float u1 = uniform(plant), u2 = uniform(plant);
+	return sigma * sqrtf(-2 * logf(u1)) * cosf(2 * PLANT_PI * u2);
+}
+
+/* speed the servo is driven towards by a pulse, degrees/s */
+static float servo_speed(const struct plant_axis_config *config, float pulse)
+{
+	float offset = pulse - PULSE_CENTER;
+
+	if (fabsf(offset) <= config->deadband) {
+		return 0;
+	}
+
+	offset -= copysignf(config->deadband, offset);
+	float speed = config->speed_max * offset / (PULSE_RANGE - config->deadband);
+	if (speed > config->speed_max) {
+		speed = config->speed_max;
+	} else if (speed < -config->speed_max) {
+		speed = -config->speed_max;
+	}
+
+	return speed;
+}
+
+static void step_axis(struct plant_axis *axis,
+		const struct plant_axis_config *config, float pulse, float dt)
+{
+	float speed = servo_speed(config, pulse);
+	float prev = axis->angle;
+
+	if (config->tau > 0) {
+		axis->motor_rate += (speed - axis->motor_rate)
+			* (1 - expf(-dt / config->tau));
+	} else {
+		axis->motor_rate = speed;
+	}
+	axis->motor += axis->motor_rate * dt;
+
+	/* the axis stays put until the servo takes up the play */
+	float play = config->backlash / 2;
+	if (axis->motor - axis->angle > play) {
+		axis->angle = axis->motor - play;
+	} else if (axis->motor - axis->angle < -play) {
+		axis->angle = axis->motor + play;
+	}
+
+	/* hard stops */
+	if (config->limit > 0) {
+		if (axis->angle > config->limit) {
+			axis->angle = config->limit;
+			axis->motor = config->limit + play;
+			axis->motor_rate = 0;
+		} else if (axis->angle < -config->limit) {
+			axis->angle = -config->limit;
+			axis->motor = -config->limit - play;
+			axis->motor_rate = 0;
+		}
+	}
+
+	axis->rate = dt > 0 ? (axis->angle - prev) / dt : 0;
+}
+
+/* pwm is the altitude then the azimuth pulse in us, as pwmctrl writes them */
+void plant_step(struct plant_state *plant, const int16_t *pwm, float dt)
+{
+	for (int i = 0;i < PLANT_AXIS_COUNT;i++) {
+		step_axis(&plant->axis[i], &plant->config.axis[i], pwm[i], dt);
+	}
+}
+
+/* body to earth, w x y z */
+void plant_attitude(const struct plant_state *plant, float *q)
+{
+	float alt = plant->axis[PLANT_AXIS_ALT].angle * PLANT_PI / 180;
+	float azm = plant->axis[PLANT_AXIS_AZM].angle * PLANT_PI / 180;
+	float ca = cosf(alt / 2), sa = sinf(alt / 2);
+	float cz = cosf(azm / 2), sz = sinf(azm / 2);
+
+	/* qz(azm) * qx(alt) */
+	q[0] = cz * ca;
+	q[1] = cz * sa;
+	q[2] = sz * sa;
+	q[3] = sz * ca;
+}
+
+/* earth to body, i.e. the inverse attitude applied to v */
+static void earth_to_body(const struct plant_state *plant, const float *v,
+		float *out)
+{
+	float alt = plant->axis[PLANT_AXIS_ALT].angle * PLANT_PI / 180;
+	float azm = plant->axis[PLANT_AXIS_AZM].angle * PLANT_PI / 180;
+	float ca = cosf(alt), sa = sinf(alt);
+	float cz = cosf(azm), sz = sinf(azm);
+
+	/* undo the azimuth about z, then the altitude about x */
+	float x = cz * v[0] + sz * v[1];
+	float y = -sz * v[0] + cz * v[1];
+	float z = v[2];
+
+	out[0] = x;
+	out[1] = ca * y + sa * z;
+	out[2] = -sa * y + ca * z;
+}
+
+static void rotate(const float m[3][3], const float *v, float *out)
+{
+	for (int i = 0;i < 3;i++) {
+		out[i] = m[i][0] * v[0] + m[i][1] * v[1] + m[i][2] * v[2];
+	}
+}
+
+void plant_sample_imu(struct plant_state *plant, float *accel, float *gyro,
+		float *temp)
+{
+	const struct plant_config *config = &plant->config;
+	static const float up[3] = {0, 0, GRAVITY};
+	float alt = plant->axis[PLANT_AXIS_ALT].angle * PLANT_PI / 180;
+	float alt_rate = plant->axis[PLANT_AXIS_ALT].rate * PLANT_PI / 180;
+	float azm_rate = plant->axis[PLANT_AXIS_AZM].rate * PLANT_PI / 180;
+	float accel_body[3], gyro_body[3];
+
+	/* at rest the accel reads the reaction to gravity */
+	earth_to_body(plant, up, accel_body);
+
+	gyro_body[0] = alt_rate;
+	gyro_body[1] = azm_rate * sinf(alt);
+	gyro_body[2] = azm_rate * cosf(alt);
+
+	rotate(config->imu_rot, accel_body, accel);
+	rotate(config->imu_rot, gyro_body, gyro);
+	for (int i = 0;i < 3;i++) {
+		accel[i] += gaussian(plant, config->accel_noise);
+		gyro[i] += config->gyro_bias[i] + gaussian(plant, config->gyro_noise);
+	}
+
+	*temp = config->temp;
+}
+
+void plant_sample_mag(struct plant_state *plant, float *magn)
+{
+	const struct plant_config *config = &plant->config;
+	float magn_body[3], magn_sensor[3];
+
+	earth_to_body(plant, config->mag_field, magn_body);
+	rotate(config->mag_rot, magn_body, magn_sensor);
+
+	for (int i = 0;i < 3;i++) {
+		magn[i] = config->mag_scale[i] * magn_sensor[i]
+			+ config->mag_offset[i] + gaussian(plant, config->mag_noise);
+	}
+}
@@ -0,0 +1,99 @@
+/**
+ * profile.c
+ *
+ * This file contains the motion profile that shapes attitude setpoints
+ * before they reach the controllers. A setpoint step would otherwise turn
+ * into a full-rate servo slam, with the current spike and ringing that go
+ * with it; the profile instead moves the reference along an S-curve within
+ * per-axis velocity, acceleration and jerk limits, and hands the
+ * controllers its velocity to feed forward.
+ *
+ * The profile is a cascade of square root controllers (position to
+ * velocity to acceleration), like the ones in common autopilots. Far from
+ * the target each stage asks for the most the next can deliver and still
+ * stop in time; close to it they become linear so the reference settles
+ * without chattering. Since it is re-evaluated from the current state
+ * every step, it retargets smoothly mid-move.
+ */
+
+#include <math.h>
+#include <zephyr.h>
+
+#include "util.h"
+#include "profile.h"
+
+/* steps further apart than this restart the profile where it is */
+static const float PROFILE_DT_MAX = 0.1f; /* s */
+
+void profile_reset(struct profile_state *profile, float pos, int64_t time)
+{
+	profile->pos = pos;
+	profile->vel = 0;
+	profile->acc = 0;
+	profile->prev_time = time;
+}
+
+/*
+ * Output that drives error to zero with a linear response near zero and
+ * a constant limit on its own rate of change further away.
+ */
+static float sqrt_controller(float error, float gain, float limit)
+{
+	float linear = limit / (gain * gain);
+
+	if (fabsf(error) <= linear) {
+		return error * gain;
+	}
+
+	float out = sqrtf(2 * limit * (fabsf(error) - linear / 2));
+	return copysignf(out, error);
+}
+
+/*
+ * Advances the reference to time, towards target moving at target_vel.
+ * The result is in profile->pos and profile->vel.
+ */
+void profile_update(struct profile_state *profile, float target,
+		float target_vel, int64_t time)
+{
+	const struct profile_limits *limits = &profile->limits;
+	float dt = (time - profile->prev_time) / 1000000.0f;
+	profile->prev_time = time;
+
+	/* without limits there is nothing to shape */
+	if (limits->vel_max <= 0 || limits->acc_max <= 0 || limits->jerk_max <= 0) {
+		profile->pos = target;
+		profile->vel = target_vel;
+		profile->acc = 0;
+		return;
+	}
+
+	if (dt <= 0 || dt > PROFILE_DT_MAX) {
+		profile->vel = 0;
+		profile->acc = 0;
+		return;
+	}
+
+	/*
+	 * The acceleration takes acc_max / jerk_max to ramp, space the loops
+	 * a few of those apart so each stage can follow the next. Braking uses
+	 * half the acceleration limit to leave room for the jerk ramps.
+	 */
+	float ramp_time = limits->acc_max / limits->jerk_max;
+	float vel_gain = 1 / (2 * ramp_time);
+	float pos_gain = vel_gain / 3;
+
+	float vel_cmd = target_vel + sqrt_controller(target - profile->pos,
+			pos_gain, limits->acc_max / 2);
+	vel_cmd = constrain(vel_cmd, -limits->vel_max, limits->vel_max);
+
+	float acc_cmd = sqrt_controller(vel_cmd - profile->vel,
+			vel_gain, limits->jerk_max);
+	acc_cmd = constrain(acc_cmd, -limits->acc_max, limits->acc_max);
+
+	float jerk_step = limits->jerk_max * dt;
+	profile->acc += constrain(acc_cmd - profile->acc, -jerk_step, jerk_step);
+
+	profile->pos += profile->vel * dt + 0.5f * profile->acc * dt * dt;
+	profile->vel += profile->acc * dt;
+}
@@ -2,8 +2,15 @@
 #include <device.h>
 #include <drivers/pwm.h>
 #include <logging/log.h>
+#ifdef CONFIG_SOC_FAMILY_STM32
+#include <soc.h>
+#include <stm32_ll_tim.h>
+#endif
 
 #include "board.h"
+#include "timestamp.h"
+#include "perf.h"
+#include "recorder.h"
 #include "pwmctrl.h"
 
 LOG_MODULE_REGISTER(pwmctrl, LOG_LEVEL_DBG);
@@ -16,21 +23,51 @@ extern void pwmctrl_thread_entry(void *, void *, void *);
 K_THREAD_STACK_DEFINE(pwmctrl_stack_area, PWMCTRL_STACK_SIZE);
 struct k_thread pwmctrl_thread_data;
 
-void pwmctrl_device_init(struct k_msgq *msgq)
+static const struct device *alt_dev;
+static const struct device *azm_dev;
+
+/*
+ * Each servo runs at the period of its pwms entry in the devicetree: 20ms
+ * for analog servos, down to ~3ms (333Hz) for digital ones. Channels of the
+ * same timer share its period.
+ */
+BUILD_ASSERT(!DT_SAME_NODE(ALT_TIMER, AZM_TIMER) || ALT_PERIOD == AZM_PERIOD,
+		"servos on the same timer need the same period");
+BUILD_ASSERT(ALT_PERIOD > 2000 && AZM_PERIOD > 2000,
+		"servo period too short for a 2000us pulse");
+
+#ifdef CONFIG_SOC_FAMILY_STM32
+static TIM_TypeDef *const timers[] = {
+	(TIM_TypeDef *) DT_REG_ADDR(ALT_TIMER),
+	(TIM_TypeDef *) DT_REG_ADDR(AZM_TIMER),
+};
+#endif
+
+/* looks up the PWM devices, must succeed before pwmctrl_apply is called */
+int pwmctrl_setup(void)
 {
-	LOG_INF("Initializing pwmctrl interface");
-
 	/* altitude motor */
-	const struct device *alt_dev = device_get_binding(ALT_LABEL);
+	alt_dev = device_get_binding(ALT_LABEL);
 	if (alt_dev == NULL) {
 		LOG_ERR("Unable to find device %s", ALT_LABEL);
-		return;
+		return -ENODEV;
 	}
 
 	/* azimuth motor */
-	const struct device *azm_dev = device_get_binding(AZM_LABEL);
+	azm_dev = device_get_binding(AZM_LABEL);
 	if (azm_dev == NULL) {
-		LOG_ERR("Unable to find evice %s", AZM_LABEL);
+		LOG_ERR("Unable to find device %s", AZM_LABEL);
+		return -ENODEV;
+	}
+
+	return 0;
+}
+
+void pwmctrl_device_init(struct k_msgq *msgq)
+{
+	LOG_INF("Initializing pwmctrl interface");
+
+	if (pwmctrl_setup() != 0) {
 		return;
 	}
 
@@ -39,6 +76,49 @@ void pwmctrl_device_init(struct k_msgq *msgq)
 										  pwmctrl_thread_entry,
 										  (void *) msgq, NULL, NULL,
 										  PWMCTRL_PRIORITY, 0, K_NO_WAIT);
+	k_thread_name_set(pwmctrl_tid, "pwmctrl");
+}
+
+/*
+ * The driver writes the compare and reload registers with preload enabled,
+ * so new values only take effect at the next update event, on a period
+ * boundary. Holding off update events (UDIS) while both channels are
+ * written makes them latch together, so the servos never see a period
+ * with one axis updated and the other not.
+ */
+static void pwmctrl_hold_update(bool hold)
+{
+#ifdef CONFIG_SOC_FAMILY_STM32
+	for (int i = 0;i < ARRAY_SIZE(timers);i++) {
+		if (hold) {
+			LL_TIM_DisableUpdateEvent(timers[i]);
+		} else {
+			LL_TIM_EnableUpdateEvent(timers[i]);
+		}
+	}
+#endif
+}
+
+void pwmctrl_apply(const struct motor_setpoint *setpoint)
+{
+	pwmctrl_hold_update(true);
+	pwm_pin_set_usec(alt_dev, ALT_CHANNEL,
+			ALT_PERIOD, setpoint->pwm[MOTOR_ALTITUDE], ALT_FLAGS);
+	pwm_pin_set_usec(azm_dev, AZM_CHANNEL,
+			AZM_PERIOD, setpoint->pwm[MOTOR_AZIMUTH], AZM_FLAGS);
+	pwmctrl_hold_update(false);
+
+	struct record_output record = {
+		.timestamp = timestamp_us(),
+		.time_sampled = setpoint->timestamp,
+		.time_estimated = setpoint->time_estimated,
+		.time_controlled = setpoint->time_controlled,
+		.pwm = {setpoint->pwm[MOTOR_ALTITUDE], setpoint->pwm[MOTOR_AZIMUTH]},
+	};
+	record_write(RECORD_OUTPUT, &record, sizeof(record));
+
+	perf_record_cycle(setpoint->timestamp, setpoint->time_estimated,
+			setpoint->time_controlled, record.timestamp);
 }
 
 void pwmctrl_thread_entry(void *arg1, void *unused2, void *unused3)
@@ -47,34 +127,10 @@ void pwmctrl_thread_entry(void *arg1, void *unused2, void *unused3)
 
 	struct k_msgq *msgq = (struct k_msgq *) arg1;
 
-	/* altitude motor */
-	const struct device *alt_dev = device_get_binding(ALT_LABEL);
-	if (alt_dev == NULL) {
-		LOG_ERR("Unable to find device %s", ALT_LABEL);
-		return;
-	}
-
-	/* azimuth motor */
-	const struct device *azm_dev = device_get_binding(AZM_LABEL);
-	if (azm_dev == NULL) {
-		LOG_ERR("Unable to find evice %s", AZM_LABEL);
-		return;
-	}
-
 	struct motor_setpoint setpoint;
 
 	while (1) {
 		k_msgq_get(msgq, &setpoint, K_FOREVER);
-
-		switch (setpoint.motor) {
-		case MOTOR_ALTITUDE:
-			pwm_pin_set_usec(alt_dev, ALT_CHANNEL,
-					ALT_PERIOD, setpoint.pwm, ALT_FLAGS);
-			break;
-		case MOTOR_AZIMUTH:
-			pwm_pin_set_usec(azm_dev, AZM_CHANNEL,
-					AZM_PERIOD, setpoint.pwm, AZM_FLAGS);
-			break;
-		}
+		pwmctrl_apply(&setpoint);
 	}
 }
@@ -32,3 +32,46 @@ void quat_to_euler(float *q, float *e)
 	e[1] = roll * 180 / M_PI;
 	e[2] = yaw * 180 / M_PI;
 }
+
+/* inverse of quat_to_euler, but in radians and with explicit axes */
+void quat_from_euler_rad(float roll, float pitch, float yaw, float *q)
+{
+	float cr = cosf(roll * 0.5f), sr = sinf(roll * 0.5f);
+	float cp = cosf(pitch * 0.5f), sp = sinf(pitch * 0.5f);
+	float cy = cosf(yaw * 0.5f), sy = sinf(yaw * 0.5f);
+
+	q[0] = cr * cp * cy + sr * sp * sy;
+	q[1] = sr * cp * cy - cr * sp * sy;
+	q[2] = cr * sp * cy + sr * cp * sy;
+	q[3] = cr * cp * sy - sr * sp * cy;
+}
+
+void quat_normalize(float *q)
+{
+	float norm = sqrtf(q[0] * q[0] + q[1] * q[1] + q[2] * q[2] + q[3] * q[3]);
+	if (norm <= 0) {
+		q[0] = 1;
+		q[1] = q[2] = q[3] = 0;
+		return;
+	}
+
+	for (int i = 0;i < 4;i++) {
+		q[i] /= norm;
+	}
+}
+
+/* rotates v by q, i.e. out = q * v * q^-1 */
+void quat_rotate(const float *q, const float *v, float *out)
+{
+	/* t = 2 * (q_vec x v) */
+	float t[3] = {
+		2 * (q[2] * v[2] - q[3] * v[1]),
+		2 * (q[3] * v[0] - q[1] * v[2]),
+		2 * (q[1] * v[1] - q[2] * v[0]),
+	};
+
+	/* out = v + w * t + q_vec x t */
+	out[0] = v[0] + q[0] * t[0] + (q[2] * t[2] - q[3] * t[1]);
+	out[1] = v[1] + q[0] * t[1] + (q[3] * t[0] - q[1] * t[2]);
+	out[2] = v[2] + q[0] * t[2] + (q[1] * t[1] - q[2] * t[0]);
+}
@@ -0,0 +1,214 @@
+/**
+ * sim.c
+ *
+ * This file contains the simulated world of the native_posix build: one
+ * plant (see plant.c), driven by the pulses written to the emulated PWM
+ * controller and sampled by the emulated IMU and mag. The plant is stepped
+ * up to the current time whenever a driver touches it, so it keeps pace
+ * with however fast the firmware samples and commands it.
+ */
+
+#include <zephyr.h>
+#include <init.h>
+#include <stdlib.h>
+#include <string.h>
+#include <logging/log.h>
+
+#ifdef CONFIG_SHELL
+#include <shell/shell.h>
+#endif
+
+#include "board.h"
+#include "plant.h"
+#include "timestamp.h"
+#include "sim.h"
+
+LOG_MODULE_REGISTER(sim, LOG_LEVEL_INF);
+
+/* longest plant step, the servo lag and backlash need it well under tau */
+#define SIM_STEP_US 500
+/* pulses kept for the "sim pulses" shell command */
+#define SIM_PULSE_HISTORY 32
+
+struct sim_pulse {
+	int64_t timestamp;
+	uint32_t channel;
+	uint32_t pulse_us;
+};
+
+K_MUTEX_DEFINE(sim_lock);
+static struct plant_state plant;
+static int64_t sim_time;
+static int16_t sim_pwm[PLANT_AXIS_COUNT];
+
+static struct sim_pulse pulses[SIM_PULSE_HISTORY];
+static uint32_t pulse_count;
+
+/* call with sim_lock held */
+static void sim_advance(void)
+{
+	int64_t now = timestamp_us();
+
+	while (sim_time < now) {
+		int64_t step = MIN(now - sim_time, SIM_STEP_US);
+
+		plant_step(&plant, sim_pwm, step / 1e6f);
+		sim_time += step;
+	}
+}
+
+void sim_set_pulse(uint32_t channel, uint32_t pulse_us)
+{
+	k_mutex_lock(&sim_lock, K_FOREVER);
+
+	/* the servos hold whatever they were doing until the new pulse */
+	sim_advance();
+
+	if (channel == ALT_CHANNEL) {
+		sim_pwm[PLANT_AXIS_ALT] = pulse_us;
+	} else if (channel == AZM_CHANNEL) {
+		sim_pwm[PLANT_AXIS_AZM] = pulse_us;
+	}
+
+	struct sim_pulse *pulse = &pulses[pulse_count % SIM_PULSE_HISTORY];
+	pulse->timestamp = sim_time;
+	pulse->channel = channel;
+	pulse->pulse_us = pulse_us;
+	pulse_count++;
+
+	k_mutex_unlock(&sim_lock);
+}
+
+void sim_sample_imu(float *accel, float *gyro, float *temp)
+{
+	k_mutex_lock(&sim_lock, K_FOREVER);
+	sim_advance();
+	plant_sample_imu(&plant, accel, gyro, temp);
+	k_mutex_unlock(&sim_lock);
+}
+
+void sim_sample_mag(float *magn)
+{
+	k_mutex_lock(&sim_lock, K_FOREVER);
+	sim_advance();
+	plant_sample_mag(&plant, magn);
+	k_mutex_unlock(&sim_lock);
+}
+
+static int sim_init(const struct device *dev)
+{
+	ARG_UNUSED(dev);
+
+	struct plant_config config;
+
+	plant_config_default(&config);
+	plant_init(&plant, &config, 0, 0);
+
+	/* stopped servos until pwmctrl writes its first pulses */
+	sim_pwm[PLANT_AXIS_ALT] = 1500;
+	sim_pwm[PLANT_AXIS_AZM] = 1500;
+	sim_time = timestamp_us();
+
+	LOG_INF("Simulating the tracker, sensors and servos are emulated");
+
+	return 0;
+}
+
+/* before the emulated drivers, which run at the device priority */
+SYS_INIT(sim_init, POST_KERNEL, 0);
+
+#ifdef CONFIG_SHELL
+static int cmd_sim_state(const struct shell *shell, size_t argc, char **argv)
+{
+	k_mutex_lock(&sim_lock, K_FOREVER);
+	sim_advance();
+	struct plant_state state = plant;
+	int16_t pwm[PLANT_AXIS_COUNT] = {sim_pwm[0], sim_pwm[1]};
+	k_mutex_unlock(&sim_lock);
+
+	static const char *const names[PLANT_AXIS_COUNT] = {"alt", "azm"};
+	for (int i = 0;i < PLANT_AXIS_COUNT;i++) {
+		const struct plant_axis *axis = &state.axis[i];
+
+		shell_print(shell, "%s: %.2f deg %.2f deg/s, servo %.2f deg %.2f deg/s, "
+				"pulse %d us", names[i], axis->angle, axis->rate,
+				axis->motor, axis->motor_rate, pwm[i]);
+	}
+	return 0;
+}
+
+static int cmd_sim_pulses(const struct shell *shell, size_t argc, char **argv)
+{
+	k_mutex_lock(&sim_lock, K_FOREVER);
+	uint32_t count = pulse_count;
+	struct sim_pulse history[SIM_PULSE_HISTORY];
+	memcpy(history, pulses, sizeof(history));
+	k_mutex_unlock(&sim_lock);
+
+	uint32_t first = count > SIM_PULSE_HISTORY ? count - SIM_PULSE_HISTORY : 0;
+	for (uint32_t i = first;i < count;i++) {
+		const struct sim_pulse *pulse = &history[i % SIM_PULSE_HISTORY];
+
+		shell_print(shell, "%10u.%06u ch%u %4u us",
+				(uint32_t) (pulse->timestamp / USEC_PER_SEC),
+				(uint32_t) (pulse->timestamp % USEC_PER_SEC),
+				pulse->channel, pulse->pulse_us);
+	}
+	shell_print(shell, "%u pulses written", count);
+	return 0;
+}
+
+static int cmd_sim_axis(const struct shell *shell, size_t argc, char **argv)
+{
+	enum plant_axis_id id;
+
+	if (strcmp(argv[1], "alt") == 0) {
+		id = PLANT_AXIS_ALT;
+	} else if (strcmp(argv[1], "azm") == 0) {
+		id = PLANT_AXIS_AZM;
+	} else {
+		shell_error(shell, "Unknown axis %s", argv[1]);
+		return -EINVAL;
+	}
+
+	k_mutex_lock(&sim_lock, K_FOREVER);
+	sim_advance();
+	struct plant_axis_config *config = &plant.config.axis[id];
+	config->speed_max = strtof(argv[2], NULL);
+	config->deadband = strtof(argv[3], NULL);
+	config->tau = strtof(argv[4], NULL);
+	config->backlash = strtof(argv[5], NULL);
+	k_mutex_unlock(&sim_lock);
+
+	return 0;
+}
+
+static int cmd_sim_move(const struct shell *shell, size_t argc, char **argv)
+{
+	k_mutex_lock(&sim_lock, K_FOREVER);
+	sim_advance();
+	for (int i = 0;i < PLANT_AXIS_COUNT;i++) {
+		struct plant_axis *axis = &plant.axis[i];
+		float angle = strtof(argv[1 + i], NULL);
+
+		/* knocked there by hand, with the play taken up */
+		axis->motor += angle - axis->angle;
+		axis->angle = angle;
+	}
+	k_mutex_unlock(&sim_lock);
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_sim,
+	SHELL_CMD(state, NULL, "Show the true attitude and servo states", cmd_sim_state),
+	SHELL_CMD(pulses, NULL, "Show the last pulses written", cmd_sim_pulses),
+	SHELL_CMD_ARG(axis, NULL, "Set an axis model: <alt|azm> <speed_max deg/s> "
+			"<deadband us> <tau s> <backlash deg>", cmd_sim_axis, 6, 0),
+	SHELL_CMD_ARG(move, NULL, "Displace the tracker: <alt deg> <azm deg>",
+			cmd_sim_move, 3, 0),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(sim, &sub_sim, "Simulated tracker", NULL);
+#endif /* CONFIG_SHELL */
@@ -0,0 +1,73 @@
+/**
+ * sim_imu.c
+ *
+ * This file contains an emulated MPU6050 for the native_posix build. It
+ * offers the same sensor channels as the real driver, sampled from the
+ * simulated tracker in sim.c.
+ */
+
+#define DT_DRV_COMPAT aps_sim_imu
+
+#include <zephyr.h>
+#include <device.h>
+#include <drivers/sensor.h>
+
+#include "util.h"
+#include "sim.h"
+
+struct sim_imu_data {
+	float accel[3]; /* m/s^2 */
+	float gyro[3]; /* rad/s */
+	float temp; /* degrees C */
+};
+
+static int sim_imu_sample_fetch(const struct device *dev,
+		enum sensor_channel chan)
+{
+	struct sim_imu_data *data = dev->data;
+
+	sim_sample_imu(data->accel, data->gyro, &data->temp);
+
+	return 0;
+}
+
+static int sim_imu_channel_get(const struct device *dev,
+		enum sensor_channel chan, struct sensor_value *val)
+{
+	struct sim_imu_data *data = dev->data;
+
+	switch (chan) {
+	case SENSOR_CHAN_ACCEL_XYZ:
+		for (int i = 0;i < 3;i++) {
+			sensor_value_from_float(&val[i], data->accel[i]);
+		}
+		break;
+	case SENSOR_CHAN_GYRO_XYZ:
+		for (int i = 0;i < 3;i++) {
+			sensor_value_from_float(&val[i], data->gyro[i]);
+		}
+		break;
+	case SENSOR_CHAN_AMBIENT_TEMP:
+		sensor_value_from_float(val, data->temp);
+		break;
+	default:
+		return -ENOTSUP;
+	}
+
+	return 0;
+}
+
+static const struct sensor_driver_api sim_imu_api = {
+	.sample_fetch = sim_imu_sample_fetch,
+	.channel_get = sim_imu_channel_get,
+};
+
+static int sim_imu_init(const struct device *dev)
+{
+	return 0;
+}
+
+static struct sim_imu_data sim_imu_data;
+
+DEVICE_DT_INST_DEFINE(0, sim_imu_init, NULL, &sim_imu_data, NULL,
+		POST_KERNEL, CONFIG_SENSOR_INIT_PRIORITY, &sim_imu_api);
@@ -0,0 +1,60 @@
+/**
+ * sim_mag.c
+ *
+ * This file contains an emulated HMC5883L for the native_posix build,
+ * sampled from the simulated tracker in sim.c.
+ */
+
+#define DT_DRV_COMPAT aps_sim_mag
+
+#include <zephyr.h>
+#include <device.h>
+#include <drivers/sensor.h>
+
+#include "util.h"
+#include "sim.h"
+
+struct sim_mag_data {
+	float magn[3]; /* gauss */
+};
+
+static int sim_mag_sample_fetch(const struct device *dev,
+		enum sensor_channel chan)
+{
+	struct sim_mag_data *data = dev->data;
+
+	sim_sample_mag(data->magn);
+
+	return 0;
+}
+
+static int sim_mag_channel_get(const struct device *dev,
+		enum sensor_channel chan, struct sensor_value *val)
+{
+	struct sim_mag_data *data = dev->data;
+
+	if (chan != SENSOR_CHAN_MAGN_XYZ) {
+		return -ENOTSUP;
+	}
+
+	for (int i = 0;i < 3;i++) {
+		sensor_value_from_float(&val[i], data->magn[i]);
+	}
+
+	return 0;
+}
+
+static const struct sensor_driver_api sim_mag_api = {
+	.sample_fetch = sim_mag_sample_fetch,
+	.channel_get = sim_mag_channel_get,
+};
+
+static int sim_mag_init(const struct device *dev)
+{
+	return 0;
+}
+
+static struct sim_mag_data sim_mag_data;
+
+DEVICE_DT_INST_DEFINE(0, sim_mag_init, NULL, &sim_mag_data, NULL,
+		POST_KERNEL, CONFIG_SENSOR_INIT_PRIORITY, &sim_mag_api);
@@ -0,0 +1,48 @@
+/**
+ * sim_pwm.c
+ *
+ * This file contains an emulated PWM controller for the native_posix
+ * build. It counts in microseconds, and hands every pulse written to the
+ * simulated servos in sim.c.
+ */
+
+#define DT_DRV_COMPAT aps_sim_pwm
+
+#include <zephyr.h>
+#include <device.h>
+#include <drivers/pwm.h>
+
+#include "sim.h"
+
+static int sim_pwm_pin_set(const struct device *dev, uint32_t pwm,
+		uint32_t period_cycles, uint32_t pulse_cycles, pwm_flags_t flags)
+{
+	if (pulse_cycles > period_cycles) {
+		return -EINVAL;
+	}
+
+	sim_set_pulse(pwm, pulse_cycles);
+
+	return 0;
+}
+
+static int sim_pwm_get_cycles_per_sec(const struct device *dev, uint32_t pwm,
+		uint64_t *cycles)
+{
+	*cycles = USEC_PER_SEC;
+
+	return 0;
+}
+
+static const struct pwm_driver_api sim_pwm_api = {
+	.pin_set = sim_pwm_pin_set,
+	.get_cycles_per_sec = sim_pwm_get_cycles_per_sec,
+};
+
+static int sim_pwm_init(const struct device *dev)
+{
+	return 0;
+}
+
+DEVICE_DT_INST_DEFINE(0, sim_pwm_init, NULL, NULL, NULL,
+		POST_KERNEL, CONFIG_KERNEL_INIT_PRIORITY_DEVICE, &sim_pwm_api);
@@ -0,0 +1,70 @@
+/**
+ * statebus.c
+ *
+ * This file contains a lock-free latest-value state bus. Each topic is double
+ * buffered: the publisher writes the buffer readers aren't looking at and then
+ * bumps the sequence number to flip them. A reader copies the current buffer
+ * and retries if a publish completed in the meantime. Since the sequence only
+ * changes once a write is complete, a reader that preempts the publisher
+ * mid-write still reads the previous value and never has to wait for it.
+ */
+
+#include <string.h>
+
+#include <zephyr.h>
+#include <sys/atomic.h>
+
+#include "statebus.h"
+
+/*
+ * Registers a semaphore to be given on every publish. Use a semaphore with
+ * a limit of 1 to wake up once for any number of missed publishes.
+ */
+int statebus_subscribe(struct statebus_topic *topic, struct k_sem *sem)
+{
+	atomic_val_t idx = atomic_inc(&topic->num_subscribers);
+	if (idx >= STATEBUS_MAX_SUBSCRIBERS) {
+		atomic_dec(&topic->num_subscribers);
+		return -ENOMEM;
+	}
+
+	topic->subscribers[idx] = sem;
+	return 0;
+}
+
+/* publishes a new value; must only be called from one thread per topic */
+void statebus_publish(struct statebus_topic *topic, const void *data)
+{
+	atomic_val_t seq = atomic_get(&topic->seq);
+
+	memcpy(topic->data[(seq + 1) & 1], data, topic->size);
+	/* atomic ops are full barriers, the copy is complete before the flip */
+	atomic_set(&topic->seq, seq + 1);
+
+	int num_subscribers = MIN(atomic_get(&topic->num_subscribers),
+			STATEBUS_MAX_SUBSCRIBERS);
+	for (int i = 0;i < num_subscribers;i++) {
+		if (topic->subscribers[i]) {
+			k_sem_give(topic->subscribers[i]);
+		}
+	}
+}
+
+/*
+ * Copies the latest value into data.
+ *
+ * @return the sequence number of the value read, 0 if nothing has been
+ *         published yet (data is then zeroed)
+ */
+uint32_t statebus_read(struct statebus_topic *topic, void *data)
+{
+	atomic_val_t seq, seq_check;
+
+	do {
+		seq = atomic_get(&topic->seq);
+		memcpy(data, topic->data[seq & 1], topic->size);
+		seq_check = atomic_get(&topic->seq);
+	} while (seq != seq_check);
+
+	return seq;
+}
@@ -0,0 +1,232 @@
+/**
+ * sysmon.c
+ *
+ * This file contains the thread monitor: once a period every thread's CPU
+ * share, context switches and stack high-water mark are sampled from the
+ * system workqueue, for sizing the stacks and finding what eats into the
+ * 1kHz loop. The report can be read from the shell (sysmon show) and is
+ * streamed over MAVLink with the control loop timing.
+ *
+ * CPU time comes from the kernel's runtime statistics, which count the
+ * cycles each thread was switched in (interrupts included in whatever
+ * they interrupted). Context switches are counted from the user tracing
+ * hook. Stack usage is how much of the stack is no longer the fill
+ * pattern, so scanning it costs a little but never misses a peak. On
+ * native_posix threads run on host stacks and the stack figures mean little.
+ */
+
+#include <zephyr.h>
+#include <init.h>
+#include <string.h>
+#include <sys/time_units.h>
+#ifdef CONFIG_SHELL
+#include <shell/shell.h>
+#endif
+
+#include "timestamp.h"
+#include "sysmon.h"
+
+/* the counters of a thread between samples */
+struct sysmon_slot {
+	const struct k_thread *thread;
+	uint64_t cycles_prev;
+	/* counted by the switch hook, from the first sample on */
+	uint32_t switches, switches_prev;
+	bool seen;
+};
+
+/* the slots are shared with the switch hook, the report with readers */
+static struct k_spinlock sysmon_lock;
+static struct sysmon_slot slots[SYSMON_THREADS_MAX];
+static struct sysmon_report report;
+
+/* only the sample work touches these */
+static struct sysmon_report next;
+static int64_t time_prev;
+
+#ifdef CONFIG_APS_SYSMON_SWITCHES
+/* called by the kernel on every context switch, with interrupts locked */
+void sys_trace_thread_switched_in_user(struct k_thread *thread)
+{
+	for (int i = 0;i < SYSMON_THREADS_MAX;i++) {
+		if (slots[i].thread == thread) {
+			slots[i].switches++;
+			return;
+		}
+	}
+}
+#endif
+
+/* the slot of a thread, a free one for a new thread, or NULL if all taken */
+static struct sysmon_slot *find_slot(const struct k_thread *thread, bool *new)
+{
+	struct sysmon_slot *free_slot = NULL;
+
+	for (int i = 0;i < SYSMON_THREADS_MAX;i++) {
+		if (slots[i].thread == thread) {
+			*new = false;
+			return &slots[i];
+		}
+		if (slots[i].thread == NULL && free_slot == NULL) {
+			free_slot = &slots[i];
+		}
+	}
+
+	*new = true;
+	return free_slot;
+}
+
+static void sample_thread(const struct k_thread *thread, void *user_data)
+{
+	uint32_t period_us = *(uint32_t *) user_data;
+	k_tid_t tid = (k_tid_t) thread;
+	k_thread_runtime_stats_t stats;
+	size_t unused = 0;
+	bool have_stack;
+	bool new;
+
+	if (next.count >= SYSMON_THREADS_MAX ||
+			k_thread_runtime_stats_get(tid, &stats) != 0) {
+		return;
+	}
+	have_stack = k_thread_stack_space_get(thread, &unused) == 0;
+
+	k_spinlock_key_t key = k_spin_lock(&sysmon_lock);
+
+	struct sysmon_slot *slot = find_slot(thread, &new);
+	if (slot == NULL) {
+		k_spin_unlock(&sysmon_lock, key);
+		return;
+	}
+
+	if (new) {
+		/* counted from now on, nothing to report for this period */
+		*slot = (struct sysmon_slot) {
+			.thread = thread,
+			.cycles_prev = stats.execution_cycles,
+		};
+	}
+
+	uint64_t cycles = stats.execution_cycles - slot->cycles_prev;
+	uint32_t switches = slot->switches - slot->switches_prev;
+	slot->cycles_prev = stats.execution_cycles;
+	slot->switches_prev = slot->switches;
+	slot->seen = true;
+
+	k_spin_unlock(&sysmon_lock, key);
+
+	struct sysmon_thread *entry = &next.threads[next.count++];
+	const char *name = k_thread_name_get(tid);
+
+	strncpy(entry->name, name != NULL ? name : "?", sizeof(entry->name) - 1);
+	entry->name[sizeof(entry->name) - 1] = '\0';
+	entry->priority = k_thread_priority_get(tid);
+	entry->load = period_us > 0 ?
+		MIN(k_cyc_to_us_floor64(cycles) * 10000 / period_us, 10000) : 0;
+	entry->switches = switches;
+	entry->stack_size = have_stack ? thread->stack_info.size : 0;
+	entry->stack_used = have_stack ? thread->stack_info.size - unused : 0;
+
+	if (entry->priority == K_IDLE_PRIO) {
+		next.load = 10000 - entry->load;
+	}
+}
+
+static void sysmon_sample(struct k_work *item)
+{
+	int64_t now = timestamp_us();
+	uint32_t period_us = time_prev != 0 ? now - time_prev : 0;
+
+	time_prev = now;
+	next.timestamp = now;
+	next.period_us = period_us;
+	next.load = 0;
+	next.count = 0;
+
+	/* stack scans take a while, don't hold the thread list lock for them */
+	k_thread_foreach_unlocked(sample_thread, &period_us);
+
+	k_spinlock_key_t key = k_spin_lock(&sysmon_lock);
+
+	/* threads that weren't found have exited, free their slots */
+	for (int i = 0;i < SYSMON_THREADS_MAX;i++) {
+		if (!slots[i].seen) {
+			slots[i].thread = NULL;
+		}
+		slots[i].seen = false;
+	}
+
+	/* the first period only starts the counters */
+	if (period_us > 0) {
+		report = next;
+	}
+
+	k_spin_unlock(&sysmon_lock, key);
+}
+
+K_WORK_DEFINE(sysmon_work, sysmon_sample);
+
+static void sysmon_timer_callback(struct k_timer *timer)
+{
+	k_work_submit(&sysmon_work);
+}
+
+K_TIMER_DEFINE(sysmon_timer, sysmon_timer_callback, NULL);
+
+void sysmon_get_report(struct sysmon_report *out)
+{
+	k_spinlock_key_t key = k_spin_lock(&sysmon_lock);
+	*out = report;
+	k_spin_unlock(&sysmon_lock, key);
+}
+
+static int sysmon_init(const struct device *dev)
+{
+	ARG_UNUSED(dev);
+
+	k_timer_start(&sysmon_timer, K_NO_WAIT, K_MSEC(CONFIG_APS_SYSMON_PERIOD_MS));
+	return 0;
+}
+
+SYS_INIT(sysmon_init, APPLICATION, CONFIG_APPLICATION_INIT_PRIORITY);
+
+#ifdef CONFIG_SHELL
+static int cmd_sysmon_show(const struct shell *shell, size_t argc, char **argv)
+{
+	static struct sysmon_report snapshot;
+
+	sysmon_get_report(&snapshot);
+	if (snapshot.timestamp == 0) {
+		shell_print(shell, "No samples yet");
+		return 0;
+	}
+
+	uint32_t period_ms = MAX(snapshot.period_us / 1000, 1);
+
+	shell_print(shell, "%-16s %4s %7s %8s %6s %6s %4s", "thread", "prio",
+			"cpu(%)", "switch/s", "stack", "used", "(%)");
+	for (int i = 0;i < snapshot.count;i++) {
+		const struct sysmon_thread *thread = &snapshot.threads[i];
+
+		shell_print(shell, "%-16s %4d %4u.%02u %8u %6u %6u %4u",
+				thread->name, thread->priority,
+				thread->load / 100, thread->load % 100,
+				thread->switches * 1000 / period_ms,
+				thread->stack_size, thread->stack_used,
+				thread->stack_size > 0 ?
+					thread->stack_used * 100 / thread->stack_size : 0);
+	}
+	shell_print(shell, "\nload %u.%02u%% over %u ms", snapshot.load / 100,
+			snapshot.load % 100, period_ms);
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_sysmon,
+	SHELL_CMD(show, NULL, "Show thread CPU load, context switches and stack use",
+			cmd_sysmon_show),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(sysmon, &sub_sysmon, "Thread monitor", NULL);
+#endif /* CONFIG_SHELL */
@@ -0,0 +1,56 @@
+/**
+ * telemetry.c
+ *
+ * This file contains the binary telemetry stream. It sends the records the
+ * blackbox logs (see records.h) at full rate, each in a small frame with a
+ * sequence number and a CRC, between the MAVLink frames on the USB link.
+ * The TLM_RECORDS parameter picks the records, none by default.
+ * tools/tlmrecv picks the frames out of the byte stream and writes them to
+ * CSV files.
+ */
+
+#include <string.h>
+
+#include <zephyr.h>
+#include <logging/log.h>
+
+#include "param.h"
+#include "perf.h"
+#include "mavlink.h"
+#include "records.h"
+#include "telemetry.h"
+
+LOG_MODULE_REGISTER(telemetry, LOG_LEVEL_DBG);
+
+static atomic_t telemetry_seq;
+
+/* frames a record and queues it for the link, dropping it if there's no room */
+void telemetry_write(enum record_id id, const void *record, size_t len)
+{
+	if (!(param_get_int(PARAM_TLM_RECORDS) & BIT(id))) {
+		return;
+	}
+
+	__ASSERT(len <= TELEMETRY_PAYLOAD_MAX, "record %d too long", id);
+
+	uint8_t frame[TELEMETRY_FRAME_MAX];
+	struct telemetry_header header = {
+		.sync = {TELEMETRY_SYNC0, TELEMETRY_SYNC1},
+		.type = id,
+		.len = len,
+		.seq = atomic_inc(&telemetry_seq),
+	};
+
+	memcpy(frame, &header, sizeof(header));
+	memcpy(&frame[sizeof(header)], record, len);
+
+	size_t crc_start = offsetof(struct telemetry_header, type);
+	size_t crc_end = sizeof(header) + len;
+	uint16_t crc = telemetry_crc16(0xffff, &frame[crc_start], crc_end - crc_start);
+	frame[crc_end] = crc & 0xff;
+	frame[crc_end + 1] = crc >> 8;
+
+	if (mavlink_queue_raw(frame, crc_end + sizeof(crc)) < 0) {
+		perf_record_drop(PERF_DROP_TELEMETRY);
+	}
+}
@@ -0,0 +1,60 @@
+/**
+ * timestamp.c
+ *
+ * This file contains a microsecond timestamp service for stamping sensor
+ * samples. k_uptime_get() only has millisecond resolution, so extend the
+ * 32 bit hardware cycle counter to 64 bits instead.
+ */
+
+#include <zephyr.h>
+#include <init.h>
+#include <sys/time_units.h>
+
+#include "timestamp.h"
+
+/* the cycle counter wraps every ~51s at 84MHz, check well before that */
+#define TIMESTAMP_WRAP_CHECK_MS 1000
+
+static struct k_spinlock timestamp_lock;
+static uint32_t last_cycles;
+static uint64_t cycles_high;
+
+static void timestamp_wrap_check(struct k_timer *timer)
+{
+	(void) timestamp_us();
+}
+
+K_TIMER_DEFINE(timestamp_wrap_timer, timestamp_wrap_check, NULL);
+
+/*
+ * Returns the time since boot in microseconds. Safe to call from any
+ * context, including interrupt handlers.
+ */
+int64_t timestamp_us(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&timestamp_lock);
+
+	uint32_t cycles = k_cycle_get_32();
+	if (cycles < last_cycles) {
+		cycles_high += (uint64_t) 1 << 32;
+	}
+	last_cycles = cycles;
+
+	uint64_t cycles_now = cycles_high | cycles;
+
+	k_spin_unlock(&timestamp_lock, key);
+
+	return k_cyc_to_us_floor64(cycles_now);
+}
+
+static int timestamp_init(const struct device *dev)
+{
+	ARG_UNUSED(dev);
+
+	k_timer_start(&timestamp_wrap_timer, K_MSEC(TIMESTAMP_WRAP_CHECK_MS),
+			K_MSEC(TIMESTAMP_WRAP_CHECK_MS));
+
+	return 0;
+}
+
+SYS_INIT(timestamp_init, APPLICATION, CONFIG_APPLICATION_INIT_PRIORITY);
@@ -0,0 +1,208 @@
+/**
+ * track.c
+ *
+ * This file contains the vehicle tracking engine. Position reports from the
+ * target vehicle (GLOBAL_POSITION_INT, or GPS_RAW_INT if that's all it
+ * sends) are converted to east-north-up meters around the tracker's home
+ * position and run through a constant velocity (alpha-beta) filter. The
+ * controllers then extrapolate the filtered state to each attitude frame,
+ * so the 5-10Hz reports turn into a smooth pointing target, with the link
+ * latency (TRK_LATENCY) compensated.
+ *
+ * Home is surveyed into the TRK_HOME_* parameters. The flat earth
+ * approximation around it is good to well under a degree of pointing out
+ * to tens of kilometers.
+ */
+
+#include <math.h>
+
+#include <zephyr.h>
+#include <logging/log.h>
+
+#include "util.h"
+#include "param.h"
+#include "timestamp.h"
+#include "gimbal.h"
+#include "track.h"
+
+LOG_MODULE_REGISTER(track, LOG_LEVEL_DBG);
+
+static const float EARTH_RADIUS = 6371000.0f;
+static const float DEG_TO_RAD = 3.1415926f / 180.0f;
+static const float RAD_TO_DEG = 180.0f / 3.1415926f;
+
+/*
+ * Filter gains: how much of the position residual is taken, and how much
+ * of it goes into the velocity. The vehicle's own velocity, when reported,
+ * is blended in with TRACK_GAMMA since it is far less noisy than
+ * differentiated positions.
+ */
+static const float TRACK_ALPHA = 0.5f;
+static const float TRACK_BETA = 0.1f;
+static const float TRACK_GAMMA = 0.5f;
+
+/* restart the filter after a gap this long */
+#define TRACK_RESET_US 3000000
+/* prefer GLOBAL_POSITION_INT, GPS_RAW_INT is only used without it for this long */
+#define TRACK_SOURCE_TIMEOUT_US 2000000
+/* beyond this the target is held where it was last extrapolated to */
+static const float TRACK_EXTRAPOLATE_MAX_S = 2.0f;
+/* closer than this horizontally the azimuth is meaningless */
+static const float TRACK_MIN_RANGE = 1.0f;
+
+STATEBUS_TOPIC_DEFINE(track_topic, struct track_state);
+
+/* filter state, only the RX thread touches these */
+static struct track_state state;
+static uint8_t target_sysid;
+static int64_t global_position_time = INT64_MIN / 2;
+
+/* meters east-north-up of home, with alt in meters above mean sea level */
+static void global_to_enu(int32_t lat, int32_t lon, float alt, float *enu)
+{
+	int32_t home_lat = param_get_int(PARAM_TRK_HOME_LAT);
+	int32_t home_lon = param_get_int(PARAM_TRK_HOME_LON);
+
+	/* differences first, in degE7 they are exact even in single precision */
+	int64_t dlat = (int64_t) lat - home_lat;
+	int64_t dlon = (int64_t) lon - home_lon;
+	if (dlon > 1800000000) {
+		dlon -= 3600000000;
+	} else if (dlon < -1800000000) {
+		dlon += 3600000000;
+	}
+
+	float cos_lat = cosf(home_lat * 1e-7f * DEG_TO_RAD);
+	enu[0] = dlon * 1e-7f * DEG_TO_RAD * EARTH_RADIUS * cos_lat;
+	enu[1] = dlat * 1e-7f * DEG_TO_RAD * EARTH_RADIUS;
+	enu[2] = alt - param_get_float(PARAM_TRK_HOME_ALT);
+}
+
+static void filter_update(const float *pos, const float *vel, int64_t time)
+{
+	float dt = (time - state.timestamp) / 1000000.0f;
+
+	if (!state.valid || time - state.timestamp > TRACK_RESET_US) {
+		for (int i = 0;i < 3;i++) {
+			state.pos[i] = pos[i];
+			state.vel[i] = isfinite(vel[i]) ? vel[i] : 0;
+		}
+	} else {
+		/* repeated or reordered reports shouldn't blow up the velocity */
+		dt = MAX(dt, 0.001f);
+
+		for (int i = 0;i < 3;i++) {
+			float predicted = state.pos[i] + state.vel[i] * dt;
+			float residual = pos[i] - predicted;
+
+			state.pos[i] = predicted + TRACK_ALPHA * residual;
+			state.vel[i] += TRACK_BETA / dt * residual;
+			if (isfinite(vel[i])) {
+				state.vel[i] += TRACK_GAMMA * (vel[i] - state.vel[i]);
+			}
+		}
+	}
+
+	state.valid = true;
+	state.timestamp = time;
+	statebus_publish(&track_topic, &state);
+}
+
+/* follows the vehicle with this system id, 0 stops following */
+void track_set_target(uint8_t sysid)
+{
+	if (sysid != target_sysid) {
+		state.valid = false;
+		statebus_publish(&track_topic, &state);
+	}
+
+	target_sysid = sysid;
+	LOG_INF("Tracking system %u", sysid);
+}
+
+/* points at a fixed location, alt in meters above mean sea level */
+void track_set_location(int32_t lat, int32_t lon, float alt)
+{
+	const float vel[3] = {0, 0, 0};
+	float pos[3];
+
+	target_sysid = 0;
+	global_to_enu(lat, lon, alt, pos);
+
+	state.valid = false;
+	filter_update(pos, vel, timestamp_us());
+}
+
+/*
+ * Feeds a position report of sysid, received at time_received. alt is in
+ * meters above mean sea level, vel_ned in m/s with NAN for unknown axes.
+ */
+void track_add_position(uint8_t sysid, enum track_source source,
+		int32_t lat, int32_t lon, float alt, const float *vel_ned,
+		int64_t time_received)
+{
+	if (sysid == 0 || sysid != target_sysid) {
+		return;
+	}
+
+	if (source == TRACK_SOURCE_GLOBAL_POSITION) {
+		global_position_time = time_received;
+	} else if (time_received - global_position_time < TRACK_SOURCE_TIMEOUT_US) {
+		return;
+	}
+
+	float pos[3];
+	global_to_enu(lat, lon, alt, pos);
+	const float vel[3] = {vel_ned[1], vel_ned[0], -vel_ned[2]};
+
+	int64_t latency_us = param_get_float(PARAM_TRK_LATENCY) * 1000;
+	filter_update(pos, vel, time_received - latency_us);
+}
+
+/*
+ * Pointing solution at the given time: altitude (elevation) and azimuth,
+ * in the frame of command_setpoint, and how fast they are changing.
+ *
+ * @return 0, or -EAGAIN if there is nothing to track
+ */
+int track_target(int64_t time, float *angle, float *rate)
+{
+	struct track_state track;
+	statebus_read(&track_topic, &track);
+
+	if (!track.valid) {
+		return -EAGAIN;
+	}
+
+	float dt = (time - track.timestamp) / 1000000.0f;
+	bool moving = dt < TRACK_EXTRAPOLATE_MAX_S;
+	dt = constrain(dt, 0, TRACK_EXTRAPOLATE_MAX_S);
+
+	float pos[3], vel[3];
+	for (int i = 0;i < 3;i++) {
+		pos[i] = track.pos[i] + track.vel[i] * dt;
+		vel[i] = moving ? track.vel[i] : 0;
+	}
+
+	float e = pos[0], n = pos[1], u = pos[2];
+	float range2 = e * e + n * n;
+	float range = sqrtf(range2);
+
+	/* azimuth is clockwise from north, the setpoint frame counter-clockwise */
+	angle[GIMBAL_AXIS_ALT] = atan2f(u, range) * RAD_TO_DEG;
+	angle[GIMBAL_AXIS_AZM] = -atan2f(e, n) * RAD_TO_DEG;
+
+	if (range < TRACK_MIN_RANGE) {
+		rate[GIMBAL_AXIS_ALT] = 0;
+		rate[GIMBAL_AXIS_AZM] = 0;
+		return 0;
+	}
+
+	/* time derivatives of atan2(u, range) and atan2(e, n) */
+	float range_rate = (e * vel[0] + n * vel[1]) / range;
+	rate[GIMBAL_AXIS_ALT] = (range * vel[2] - u * range_rate) /
+		(range2 + u * u) * RAD_TO_DEG;
+	rate[GIMBAL_AXIS_AZM] = -(n * vel[0] - e * vel[1]) / range2 * RAD_TO_DEG;
+
+	return 0;
+}
@@ -35,8 +35,6 @@ struct usb_callback_data {
 
 struct usb_callback_data usb_callback_data;
 
-struct parse_mavlink_data parse_mavlink_data;
-
 const struct device *usb_init(char *device_label, 
 		struct ring_buf *rx_ringbuf, struct ring_buf *tx_ringbuf)
 {
@@ -59,15 +57,12 @@ const struct device *usb_init(char *device_label,
 
 	LOG_DBG("Initialized USB");
 
-	k_work_init(&(parse_mavlink_data.work), parse_mavlink);
-	parse_mavlink_data.rx_ringbuf = rx_ringbuf;
-	parse_mavlink_data.tx_ringbuf = tx_ringbuf;
-
 	k_tid_t usb_tid = k_thread_create(&usb_thread_data, usb_stack_area,
 									  K_THREAD_STACK_SIZEOF(usb_stack_area),
 									  usb_thread_entry,
 									  (void *) dev, (void *) rx_ringbuf, (void *) tx_ringbuf,
 									  USB_PRIORITY, 0, K_NO_WAIT);
+	k_thread_name_set(usb_tid, "usb");
 
 	return dev;
 }
@@ -83,33 +78,35 @@ void usb_interrupt_handler(const struct device *dev, void *user_data)
 		if (uart_irq_rx_ready(dev)) {
 			int recv_len, rb_len;
 			uint8_t buffer[64];
-			size_t len = MIN(ring_buf_space_get(rx_ringbuf),
-					sizeof(buffer));
 
-			recv_len = uart_fifo_read(dev, buffer, len);
+			/* always empty the FIFO, whatever doesn't fit is counted */
+			recv_len = uart_fifo_read(dev, buffer, sizeof(buffer));
 
 			rb_len = ring_buf_put(rx_ringbuf, buffer, recv_len);
 			if (rb_len < recv_len) {
-				LOG_ERR("Dropping %u bytes", recv_len - rb_len);
+				mavlink_rx_overrun(MAVLINK_CHAN_USB, recv_len - rb_len);
 			}
 
-			k_work_submit(&(parse_mavlink_data.work));
+			mavlink_rx_notify();
 		}
 
 		if (uart_irq_tx_ready(dev)) {
-			uint8_t buffer[64];
+			uint8_t *data;
 			int rb_len, send_len;
 
-			rb_len = ring_buf_get(tx_ringbuf, buffer, sizeof(buffer));
+			/*
+			 * Send straight out of the ring and only consume what
+			 * the FIFO took, the rest goes out on the next interrupt.
+			 */
+			rb_len = ring_buf_get_claim(tx_ringbuf, &data, 64);
 			if (!rb_len) {
+				ring_buf_get_finish(tx_ringbuf, 0);
 				uart_irq_tx_disable(dev);
 				continue;
 			}
 
-			send_len = uart_fifo_fill(dev, buffer, rb_len);
-			if (send_len < rb_len) {
-				LOG_ERR("Dropping %d bytes", rb_len - send_len);
-			}
+			send_len = uart_fifo_fill(dev, data, rb_len);
+			ring_buf_get_finish(tx_ringbuf, MAX(send_len, 0));
 		}
 	}
 }
@@ -1,3 +1,5 @@
+#include <math.h>
+
 #include "util.h"
 
 float constrain(float value, float low, float high)
@@ -7,3 +9,27 @@ float constrain(float value, float low, float high)
 
 	return value;
 }
+
+/* single precision version of sensor_value_to_double, the FPU has no doubles */
+float sensor_value_to_float(const struct sensor_value *val)
+{
+	return (float) val->val1 + (float) val->val2 / 1000000.0f;
+}
+
+/* and back, for the emulated sensors */
+void sensor_value_from_float(struct sensor_value *val, float value)
+{
+	val->val1 = (int32_t) value;
+	val->val2 = (int32_t) ((value - val->val1) * 1000000.0f);
+}
+
+/* wraps an angle in degrees to [-180, 180) */
+float wrap_180(float angle)
+{
+	angle = fmodf(angle + 180.0f, 360.0f);
+	if (angle < 0) {
+		angle += 360.0f;
+	}
+
+	return angle - 180.0f;
+}
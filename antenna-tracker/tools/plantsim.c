@@ -0,0 +1,575 @@
+/**
+ * plantsim.c
+ *
+ * Closed loop simulation of the tracker for controller tuning: the
+ * firmware's estimator, gimbal, tracking and attitude controllers (built
+ * as for replay, see shim/) drive the plant model in src/plant.c, which
+ * feeds synthetic IMU and mag samples back. Standard scenarios measure
+ * the step response and tracking error on the true attitude of the
+ * model, so gain changes can be compared without the real rig.
+ *
+ * Usage: plantsim [options] [scenario...]
+ *
+ * Scenarios (all by default):
+ *   step   30 degree altitude and 90 degree azimuth steps
+ *   ramp   altitude and azimuth rate setpoints, as a ground station sends
+ *   orbit  tracking a vehicle circling the tracker, from 5Hz position
+ *          reports arriving TRK_LATENCY late
+ *
+ * Options:
+ *   -p <NAME>=<value>   set a parameter, repeatable
+ *   -m <alt|azm>=<speed_max>,<deadband>,<tau>,<backlash>
+ *                       servo model (degrees/s, us, s, degrees)
+ *   -n <scale>          sensor noise and bias scale, 0 for ideal sensors
+ *   -r <hz>             IMU sample rate, default 1000
+ *   -P <us>             servo pulse period, default 20000
+ *   -S <seed>           noise seed
+ *   -o <trace.csv>      write the target, true and estimated angles
+ *   -v                  print the firmware's log messages
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "plant.h"
+#include "param.h"
+#include "calib.h"
+#include "estimator.h"
+#include "attctrl.h"
+#include "gimbal.h"
+#include "track.h"
+#include "shim.h"
+
+static const double PI = 3.14159265358979;
+
+/* the tracker sits still this long first, for the estimator to settle */
+static const double MOTION_START = 3.0; /* s */
+/* the mag is polled at 10Hz */
+static const double MAG_PERIOD = 0.1; /* s */
+/* a step has settled once within this fraction of it, or SETTLE_MIN */
+static const double SETTLE_FRACTION = 0.02;
+static const double SETTLE_MIN = 0.5; /* degrees */
+
+/* the orbit: a vehicle circling north of the tracker, reported at 5Hz */
+static const double ORBIT_CENTER_N = 300; /* m */
+static const double ORBIT_RADIUS = 150; /* m */
+static const double ORBIT_HEIGHT = 80; /* m */
+static const double ORBIT_SPEED = 20; /* m/s */
+static const double ORBIT_REPORT_PERIOD = 0.2; /* s */
+#define ORBIT_SYSID 1
+
+/* position reports use the flat earth around TRK_HOME, here 0, 0 */
+static const double EARTH_RADIUS = 6371000.0;
+
+struct scenario {
+	const char *name;
+	double duration; /* s, from MOTION_START */
+	/* tracking errors are only counted after this, s from MOTION_START */
+	double settle;
+	/* the true target, degrees and degrees/s, t from MOTION_START */
+	void (*target)(double t, double *angle, double *rate);
+	/* the target is commanded as angle steps, so measure the response */
+	bool step;
+	/* the target is a vehicle, reported through track.c */
+	bool track;
+};
+
+static void step_target(double t, double *angle, double *rate)
+{
+	angle[GIMBAL_AXIS_ALT] = t < 0 ? 0 : 30;
+	angle[GIMBAL_AXIS_AZM] = t < 0 ? 0 : 90;
+	rate[GIMBAL_AXIS_ALT] = 0;
+	rate[GIMBAL_AXIS_AZM] = 0;
+}
+
+/* up at 5 degrees/s to 40 degrees and hold, round at 20 degrees/s */
+static void ramp_target(double t, double *angle, double *rate)
+{
+	double alt_end = 8;
+
+	t = fmax(t, 0);
+	angle[GIMBAL_AXIS_ALT] = 5 * fmin(t, alt_end);
+	rate[GIMBAL_AXIS_ALT] = t > 0 && t < alt_end ? 5 : 0;
+	angle[GIMBAL_AXIS_AZM] = 20 * t;
+	rate[GIMBAL_AXIS_AZM] = t > 0 ? 20 : 0;
+}
+
+/* east-north-up position and velocity of the orbiting vehicle */
+static void orbit_position(double t, double *pos, double *vel)
+{
+	double omega = ORBIT_SPEED / ORBIT_RADIUS;
+	double phase = omega * fmax(t, 0);
+
+	pos[0] = ORBIT_RADIUS * sin(phase);
+	pos[1] = ORBIT_CENTER_N - ORBIT_RADIUS * cos(phase);
+	pos[2] = ORBIT_HEIGHT;
+	vel[0] = t < 0 ? 0 : ORBIT_SPEED * cos(phase);
+	vel[1] = t < 0 ? 0 : ORBIT_SPEED * sin(phase);
+	vel[2] = 0;
+}
+
+/* the exact pointing solution, in the frame of track_target() */
+static void orbit_target(double t, double *angle, double *rate)
+{
+	double pos[3], vel[3];
+
+	orbit_position(t, pos, vel);
+
+	double e = pos[0], n = pos[1], u = pos[2];
+	double range2 = e * e + n * n;
+	double range = sqrt(range2);
+	double range_rate = (e * vel[0] + n * vel[1]) / range;
+
+	angle[GIMBAL_AXIS_ALT] = atan2(u, range) * 180 / PI;
+	angle[GIMBAL_AXIS_AZM] = -atan2(e, n) * 180 / PI;
+	rate[GIMBAL_AXIS_ALT] = (range * vel[2] - u * range_rate) /
+		(range2 + u * u) * 180 / PI;
+	rate[GIMBAL_AXIS_AZM] = -(n * vel[0] - e * vel[1]) / range2 * 180 / PI;
+}
+
+static const struct scenario scenarios[] = {
+	{"step", 10, 5, step_target, .step = true},
+	{"ramp", 20, 3, ramp_target},
+	{"orbit", 60, 5, orbit_target, .track = true},
+};
+
+struct sim_options {
+	struct plant_config plant;
+	double imu_rate; /* Hz */
+	double servo_period; /* s */
+	FILE *trace;
+};
+
+struct axis_stats {
+	unsigned long count;
+	double sum_sq, max, final;
+	/* step response */
+	double rise, overshoot, settle;
+};
+
+struct sim_result {
+	struct axis_stats axis[GIMBAL_AXIS_COUNT];
+	struct axis_stats pointing, estimate;
+	unsigned long frames;
+};
+
+static double wrap_180_deg(double angle)
+{
+	angle = fmod(angle + 180, 360);
+	if (angle < 0) {
+		angle += 360;
+	}
+
+	return angle - 180;
+}
+
+/* angle between two pointing directions, each altitude and azimuth */
+static double pointing_error(const double *a, const double *b)
+{
+	double alt_a = a[GIMBAL_AXIS_ALT] * PI / 180, alt_b = b[GIMBAL_AXIS_ALT] * PI / 180;
+	double dazm = (a[GIMBAL_AXIS_AZM] - b[GIMBAL_AXIS_AZM]) * PI / 180;
+	double c = sin(alt_a) * sin(alt_b) + cos(alt_a) * cos(alt_b) * cos(dazm);
+
+	return acos(fmax(fmin(c, 1), -1)) * 180 / PI;
+}
+
+static void stats_add(struct axis_stats *stats, double error)
+{
+	stats->count++;
+	stats->sum_sq += error * error;
+	stats->max = fmax(stats->max, fabs(error));
+	stats->final = error;
+}
+
+/* the step response of one axis from its trace of true angles */
+static void step_response(struct axis_stats *stats, const float *angle,
+		size_t count, double dt, double step)
+{
+	double band = fmax(fabs(step) * SETTLE_FRACTION, SETTLE_MIN);
+	double peak = 0;
+
+	stats->rise = NAN;
+	stats->settle = 0;
+	for (size_t i = 0;i < count;i++) {
+		double progress = angle[i] / step;
+
+		if (isnan(stats->rise) && progress >= 0.9) {
+			stats->rise = i * dt;
+		}
+		peak = fmax(peak, progress);
+		if (fabs(angle[i] - step) > band) {
+			stats->settle = (i + 1) * dt;
+		}
+	}
+
+	stats->overshoot = fmax(peak - 1, 0) * 100;
+}
+
+/* the reports a ground station or vehicle would send, as the RX thread handles them */
+static void send_track_report(double t, int64_t now)
+{
+	double pos[3], vel[3];
+
+	orbit_position(t, pos, vel);
+
+	int32_t lat = lround(pos[1] / EARTH_RADIUS * 180 / PI * 1e7);
+	int32_t lon = lround(pos[0] / EARTH_RADIUS * 180 / PI * 1e7);
+	float vel_ned[3] = {vel[1], vel[0], -vel[2]};
+
+	track_add_position(ORBIT_SYSID, TRACK_SOURCE_GLOBAL_POSITION, lat, lon,
+			pos[2], vel_ned, now);
+}
+
+static void run_scenario(const struct scenario *scenario,
+		const struct sim_options *options, struct sim_result *result)
+{
+	static struct est_state est;
+	struct plant_state plant;
+	struct attitude_frame frame;
+	struct motor_setpoint motor = {.pwm = {PWM_CENTER, PWM_CENTER}};
+	struct command_setpoint command = {.mode = COMMAND_SETPOINT_MODE_NEUTRAL};
+	int16_t pwm[PLANT_AXIS_COUNT] = {PWM_CENTER, PWM_CENTER};
+	bool have_frame = false;
+
+	memset(result, 0, sizeof(*result));
+	plant_init(&plant, &options->plant, 0, 0);
+	est_state_init(&est);
+
+	double dt = 1 / options->imu_rate;
+	long steps = lround((MOTION_START + scenario->duration) / dt);
+	long start_step = lround(MOTION_START / dt);
+	double next_mag = 0, next_pulse = 0, next_report = 0, next_command = 0;
+	double latency = param_get_float(PARAM_TRK_LATENCY) / 1000;
+
+	/* true angles after the start, for the step response */
+	float *trace[GIMBAL_AXIS_COUNT] = {NULL};
+	if (scenario->step) {
+		for (int i = 0;i < GIMBAL_AXIS_COUNT;i++) {
+			trace[i] = calloc(steps - start_step, sizeof(float));
+		}
+	}
+
+	if (scenario->track) {
+		track_set_target(ORBIT_SYSID);
+	}
+
+	for (long i = 0;i < steps;i++) {
+		double time = i * dt;
+		double t = time - MOTION_START;
+		int64_t now = llround(time * USEC_PER_SEC);
+
+		shim_set_time(now);
+
+		/* servos only see a new pulse width once per pulse period */
+		if (time >= next_pulse) {
+			pwm[PLANT_AXIS_ALT] = motor.pwm[MOTOR_ALTITUDE];
+			pwm[PLANT_AXIS_AZM] = motor.pwm[MOTOR_AZIMUTH];
+			next_pulse += options->servo_period;
+		}
+		plant_step(&plant, pwm, dt);
+
+		double target[GIMBAL_AXIS_COUNT], target_rate[GIMBAL_AXIS_COUNT];
+		scenario->target(t, target, target_rate);
+
+		if (scenario->track) {
+			/* reports of where the vehicle was, TRK_LATENCY ago */
+			if (t >= 0 && time >= next_report) {
+				send_track_report(t - latency, now);
+				next_report = time + ORBIT_REPORT_PERIOD;
+			}
+			if (t >= 0 && command.mode != COMMAND_SETPOINT_MODE_TRACK) {
+				command = (struct command_setpoint) {
+					.mode = COMMAND_SETPOINT_MODE_TRACK,
+					.timestamp = now,
+				};
+			}
+		} else if (t >= 0 && time >= next_command) {
+			/* setpoints arrive at 10Hz, the controllers extrapolate rates */
+			command = (struct command_setpoint) {
+				.mode = COMMAND_SETPOINT_MODE_ANGLE,
+				.timestamp = now,
+				.angle = {target[0], target[1]},
+				.rate = {target_rate[0], target_rate[1]},
+			};
+			next_command = time + 0.1;
+		}
+
+		if (time >= next_mag) {
+			struct mag_sample mag_sample = {.timestamp = now};
+
+			plant_sample_mag(&plant, mag_sample.magn);
+			est_add_mag(&est, &mag_sample);
+			next_mag += MAG_PERIOD;
+		}
+
+		struct imu_sample imu_sample = {.timestamp = now};
+		plant_sample_imu(&plant, imu_sample.accel, imu_sample.gyro,
+				&imu_sample.temp);
+		if (est_add_imu(&est, &imu_sample, &frame) == 0) {
+			if (!have_frame) {
+				attctrl_reset(&frame);
+				have_frame = true;
+			}
+			attctrl_step(&frame, &command, &motor);
+			result->frames++;
+		}
+
+		double actual[GIMBAL_AXIS_COUNT] = {
+			plant.axis[PLANT_AXIS_ALT].angle,
+			plant.axis[PLANT_AXIS_AZM].angle,
+		};
+
+		if (options->trace != NULL && i % 10 == 0) {
+			fprintf(options->trace, "%s,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%d,%d\n",
+					scenario->name, time, target[0], target[1],
+					actual[0], actual[1], frame.angle[0], frame.azimuth,
+					pwm[PLANT_AXIS_ALT], pwm[PLANT_AXIS_AZM]);
+		}
+
+		if (t < 0) {
+			continue;
+		}
+
+		if (have_frame) {
+			float q[4];
+
+			plant_attitude(&plant, q);
+			double dot = 0;
+			for (int j = 0;j < 4;j++) {
+				dot += (double) q[j] * frame.q[j];
+			}
+			stats_add(&result->estimate, 2 * acos(fmin(fabs(dot), 1)) * 180 / PI);
+		}
+
+		if (scenario->step) {
+			for (int j = 0;j < GIMBAL_AXIS_COUNT;j++) {
+				trace[j][i - start_step] = actual[j];
+			}
+		}
+
+		if (t >= scenario->settle) {
+			stats_add(&result->axis[GIMBAL_AXIS_ALT], actual[0] - target[0]);
+			stats_add(&result->axis[GIMBAL_AXIS_AZM],
+					wrap_180_deg(actual[1] - target[1]));
+			stats_add(&result->pointing, pointing_error(actual, target));
+		}
+	}
+
+	if (scenario->step) {
+		double final[GIMBAL_AXIS_COUNT], rate[GIMBAL_AXIS_COUNT];
+
+		scenario->target(scenario->duration, final, rate);
+		for (int j = 0;j < GIMBAL_AXIS_COUNT;j++) {
+			step_response(&result->axis[j], trace[j], steps - start_step, dt,
+					final[j]);
+			free(trace[j]);
+		}
+	}
+
+	if (scenario->track) {
+		track_set_target(0);
+	}
+}
+
+static double rms(const struct axis_stats *stats)
+{
+	return stats->count > 0 ? sqrt(stats->sum_sq / stats->count) : NAN;
+}
+
+static void print_result(const struct scenario *scenario,
+		const struct sim_result *result)
+{
+	static const char *const names[GIMBAL_AXIS_COUNT] = {"altitude", "azimuth"};
+
+	printf("%s: %.0f s, %lu frames, tracking error after %.0f s (degrees):\n",
+			scenario->name, scenario->duration, result->frames, scenario->settle);
+	if (scenario->step) {
+		printf("  %-9s %8s %8s %8s %9s %8s %9s\n", "", "rms", "max", "final",
+				"rise s", "over %", "settle s");
+	} else {
+		printf("  %-9s %8s %8s %8s\n", "", "rms", "max", "final");
+	}
+
+	for (int i = 0;i < GIMBAL_AXIS_COUNT;i++) {
+		const struct axis_stats *axis = &result->axis[i];
+
+		printf("  %-9s %8.3f %8.3f %8.3f", names[i], rms(axis), axis->max,
+				axis->final);
+		if (scenario->step) {
+			printf(" %9.3f %8.1f %9.3f", axis->rise, axis->overshoot,
+					axis->settle);
+		}
+		printf("\n");
+	}
+	printf("  %-9s %8.3f %8.3f %8.3f\n", "pointing", rms(&result->pointing),
+			result->pointing.max, result->pointing.final);
+	printf("  %-9s %8.3f %8.3f %8.3f\n", "estimate", rms(&result->estimate),
+			result->estimate.max, result->estimate.final);
+}
+
+static int set_param(const char *arg)
+{
+	const char *eq = strchr(arg, '=');
+	if (eq == NULL) {
+		fprintf(stderr, "Expected NAME=value, not %s\n", arg);
+		return -EINVAL;
+	}
+
+	int id = param_find(arg, eq - arg);
+	if (id < 0) {
+		fprintf(stderr, "No parameter %.*s\n", (int) (eq - arg), arg);
+		return id;
+	}
+
+	int ret;
+	if (param_type(id) == PARAM_TYPE_FLOAT) {
+		ret = param_set_float(id, strtof(eq + 1, NULL));
+	} else {
+		ret = param_set_int(id, strtol(eq + 1, NULL, 0));
+	}
+	if (ret != 0) {
+		fprintf(stderr, "%s out of range\n", arg);
+	}
+
+	return ret;
+}
+
+static int set_axis(struct plant_config *config, const char *arg)
+{
+	struct plant_axis_config *axis;
+
+	if (strncmp(arg, "alt=", 4) == 0) {
+		axis = &config->axis[PLANT_AXIS_ALT];
+	} else if (strncmp(arg, "azm=", 4) == 0) {
+		axis = &config->axis[PLANT_AXIS_AZM];
+	} else {
+		fprintf(stderr, "Expected alt= or azm=, not %s\n", arg);
+		return -EINVAL;
+	}
+
+	if (sscanf(arg + 4, "%f,%f,%f,%f", &axis->speed_max, &axis->deadband,
+				&axis->tau, &axis->backlash) != 4) {
+		fprintf(stderr, "Expected speed_max,deadband,tau,backlash, not %s\n",
+				arg + 4);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static void scale_noise(struct plant_config *config, float scale)
+{
+	config->gyro_noise *= scale;
+	config->accel_noise *= scale;
+	config->mag_noise *= scale;
+	for (int i = 0;i < 3;i++) {
+		config->gyro_bias[i] *= scale;
+	}
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-p NAME=value]... [-m alt|azm=speed,deadband,"
+			"tau,backlash]... [-n scale] [-r hz] [-P us] [-S seed] "
+			"[-o trace.csv] [-v] [step|ramp|orbit]...\n", name);
+}
+
+int main(int argc, char **argv)
+{
+	struct sim_options options = {
+		.imu_rate = 1000,
+		.servo_period = 0.02,
+	};
+	const char *trace_path = NULL;
+	int opt;
+
+	plant_config_default(&options.plant);
+	calib_init();
+	param_init();
+
+	while ((opt = getopt(argc, argv, "p:m:n:r:P:S:o:v")) != -1) {
+		switch (opt) {
+		case 'p':
+			if (set_param(optarg) != 0) {
+				return 2;
+			}
+			break;
+		case 'm':
+			if (set_axis(&options.plant, optarg) != 0) {
+				return 2;
+			}
+			break;
+		case 'n':
+			scale_noise(&options.plant, atof(optarg));
+			break;
+		case 'r':
+			options.imu_rate = atof(optarg);
+			break;
+		case 'P':
+			options.servo_period = atof(optarg) / USEC_PER_SEC;
+			break;
+		case 'S':
+			options.plant.seed = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			trace_path = optarg;
+			break;
+		case 'v':
+			shim_log_verbose++;
+			break;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+
+	if (options.imu_rate < 10 || options.servo_period <= 0) {
+		fprintf(stderr, "Rates out of range\n");
+		return 2;
+	}
+
+	/* a calibrated tracker, the AHRS only has to track what is left */
+	struct gyro_calib calib = {.temp = options.plant.temp};
+	memcpy(calib.bias, options.plant.gyro_bias, sizeof(calib.bias));
+	calib_save_gyro(&calib);
+
+	if (trace_path != NULL) {
+		options.trace = fopen(trace_path, "w");
+		if (options.trace == NULL) {
+			fprintf(stderr, "Unable to create %s: %s\n", trace_path,
+					strerror(errno));
+			return 1;
+		}
+		fprintf(options.trace, "scenario,time,target[0],target[1],actual[0],"
+				"actual[1],estimate[0],estimate[1],pwm[0],pwm[1]\n");
+	}
+
+	for (size_t i = 0;i < ARRAY_SIZE(scenarios);i++) {
+		const struct scenario *scenario = &scenarios[i];
+		bool selected = optind == argc;
+
+		for (int j = optind;j < argc;j++) {
+			selected |= strcmp(argv[j], scenario->name) == 0;
+		}
+		if (!selected) {
+			continue;
+		}
+
+		struct sim_result result;
+		run_scenario(scenario, &options, &result);
+		print_result(scenario, &result);
+	}
+
+	if (options.trace != NULL) {
+		fclose(options.trace);
+	}
+
+	return 0;
+}
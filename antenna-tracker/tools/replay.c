@@ -0,0 +1,834 @@
+/**
+ * replay.c
+ *
+ * Host replay of recorded sensor data through the firmware's estimator and
+ * attitude controllers, built from the same sources as the firmware (see
+ * shim/). Samples are fed as fast as the host runs them, in the order the
+ * tracker processed them, so a run is repeatable and an estimator change
+ * can be compared against the original over hours of data in seconds.
+ *
+ * Usage: replay [options] <log.ulg or tlmrecv capture directory>
+ *
+ * Input is a blackbox log, or the CSVs tlmrecv writes (imu.csv, mag.csv
+ * and optionally attitude.csv and setpoint.csv). The replayed attitude is
+ * compared against ground truth from -t, a CSV with timestamp and q[0]
+ * to q[3] columns, or else against the attitude frames in the input, i.e.
+ * what the tracker estimated at the time. Logged setpoints are replayed
+ * into the controllers as angle setpoints.
+ *
+ * Options:
+ *   -t <truth.csv>      ground truth attitude
+ *   -p <NAME>=<value>   set a parameter before the run, repeatable
+ *   -g <x>,<y>,<z>[,<temp>]
+ *                       stored gyro calibration (rad/s, sensor frame),
+ *                       otherwise the first samples are averaged as on
+ *                       a first boot
+ *   -s <seconds>        leave the start out of the error statistics
+ *   -o <out.csv>        write the replayed attitude and outputs
+ *   -v                  firmware log messages, twice for debug
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "records.h"
+#include "param.h"
+#include "calib.h"
+#include "estimator.h"
+#include "attctrl.h"
+#include "quaternion.h"
+#include "shim.h"
+
+static const double RAD_TO_DEG = 180.0 / 3.14159265358979;
+
+/* ULog messages are at most 64k, with their header */
+#define ULOG_MSG_MAX (UINT16_MAX + sizeof(struct ulog_message_header))
+#define ULOG_MSG_IDS 256
+
+#define CSV_LINE_MAX 1024
+#define CSV_COLUMNS_MAX 32
+
+/* one record from any of the inputs */
+struct replay_record {
+	enum record_id id;
+	int64_t timestamp;
+	union {
+		struct record_imu imu;
+		struct record_mag mag;
+		struct record_attitude attitude;
+		struct record_setpoint setpoint;
+	};
+};
+
+/* a CSV column, by its pyulog style name, and where it goes in the record */
+struct column {
+	const char *name;
+	size_t offset;
+	char type; /* 'f' float, 'u' uint64_t, 'b' uint8_t */
+};
+
+#define COLUMN(_record, _name, _field, _type) \
+	{_name, offsetof(struct replay_record, _record) + \
+		offsetof(struct record_##_record, _field), _type}
+
+static const struct column imu_columns[] = {
+	COLUMN(imu, "timestamp", timestamp, 'u'),
+	COLUMN(imu, "accel[0]", accel[0], 'f'),
+	COLUMN(imu, "accel[1]", accel[1], 'f'),
+	COLUMN(imu, "accel[2]", accel[2], 'f'),
+	COLUMN(imu, "gyro[0]", gyro[0], 'f'),
+	COLUMN(imu, "gyro[1]", gyro[1], 'f'),
+	COLUMN(imu, "gyro[2]", gyro[2], 'f'),
+	COLUMN(imu, "temp", temp, 'f'),
+	{NULL},
+};
+
+static const struct column mag_columns[] = {
+	COLUMN(mag, "timestamp", timestamp, 'u'),
+	COLUMN(mag, "magn[0]", magn[0], 'f'),
+	COLUMN(mag, "magn[1]", magn[1], 'f'),
+	COLUMN(mag, "magn[2]", magn[2], 'f'),
+	{NULL},
+};
+
+/* also the ground truth, of which only the quaternion is needed */
+static const struct column attitude_columns[] = {
+	COLUMN(attitude, "timestamp", timestamp, 'u'),
+	COLUMN(attitude, "q[0]", q[0], 'f'),
+	COLUMN(attitude, "q[1]", q[1], 'f'),
+	COLUMN(attitude, "q[2]", q[2], 'f'),
+	COLUMN(attitude, "q[3]", q[3], 'f'),
+	{NULL},
+};
+
+static const struct column setpoint_columns[] = {
+	COLUMN(setpoint, "timestamp", timestamp, 'u'),
+	COLUMN(setpoint, "target[0]", target[0], 'f'),
+	COLUMN(setpoint, "target[1]", target[1], 'f'),
+	COLUMN(setpoint, "target_rate[0]", target_rate[0], 'f'),
+	COLUMN(setpoint, "target_rate[1]", target_rate[1], 'f'),
+	COLUMN(setpoint, "mode", mode, 'b'),
+	{NULL},
+};
+
+struct csv_input {
+	FILE *file;
+	enum record_id id;
+	const struct column *columns;
+	int index[CSV_COLUMNS_MAX]; /* CSV column of each entry in columns */
+	struct replay_record next;
+	bool have_next;
+};
+
+/* the CSV files of a tlmrecv capture, merged by timestamp */
+static const struct {
+	const char *file;
+	enum record_id id;
+	const struct column *columns;
+} capture_files[] = {
+	{"imu.csv", RECORD_IMU, imu_columns},
+	{"mag.csv", RECORD_MAG, mag_columns},
+	{"attitude.csv", RECORD_ATTITUDE, attitude_columns},
+	{"setpoint.csv", RECORD_SETPOINT, setpoint_columns},
+};
+
+#define CAPTURE_FILES ARRAY_SIZE(capture_files)
+
+struct ulog_input {
+	FILE *file;
+	/* record of each subscribed msg_id, -1 for the ones not replayed */
+	int records[ULOG_MSG_IDS];
+	bool format_ok[RECORD_COUNT];
+	unsigned long dropouts;
+};
+
+struct input {
+	bool is_ulog;
+	struct ulog_input ulog;
+	struct csv_input csv[CAPTURE_FILES];
+	int csv_count;
+};
+
+static const char *const record_formats[RECORD_COUNT] = {
+	[RECORD_IMU] = RECORD_IMU_FORMAT,
+	[RECORD_MAG] = RECORD_MAG_FORMAT,
+	[RECORD_ATTITUDE] = RECORD_ATTITUDE_FORMAT,
+	[RECORD_SETPOINT] = RECORD_SETPOINT_FORMAT,
+	[RECORD_OUTPUT] = RECORD_OUTPUT_FORMAT,
+};
+
+static const size_t record_sizes[RECORD_COUNT] = {
+	[RECORD_IMU] = sizeof(struct record_imu),
+	[RECORD_MAG] = sizeof(struct record_mag),
+	[RECORD_ATTITUDE] = sizeof(struct record_attitude),
+	[RECORD_SETPOINT] = sizeof(struct record_setpoint),
+	[RECORD_OUTPUT] = sizeof(struct record_output),
+};
+
+/* per step host cost, kept whole so the percentiles are exact */
+struct cost {
+	uint64_t *ns;
+	uint64_t *cycles;
+	size_t count, size;
+};
+
+struct error_stat {
+	unsigned long count;
+	double sum_sq, max;
+};
+
+struct replay_stats {
+	unsigned long imu, mag, frames, setpoints, references;
+	int64_t first, last;
+	struct cost estimate, control;
+	struct error_stat total, alt, azm;
+};
+
+static int csv_split(char *line, char **fields, int max)
+{
+	int count = 0;
+
+	line[strcspn(line, "\r\n")] = '\0';
+	while (count < max) {
+		fields[count++] = line;
+		line = strchr(line, ',');
+		if (line == NULL) {
+			break;
+		}
+		*line++ = '\0';
+	}
+
+	return count;
+}
+
+static int csv_open(struct csv_input *csv, const char *path, enum record_id id,
+		const struct column *columns)
+{
+	char line[CSV_LINE_MAX];
+	char *fields[CSV_COLUMNS_MAX];
+
+	memset(csv, 0, sizeof(*csv));
+	csv->id = id;
+	csv->columns = columns;
+	csv->file = fopen(path, "r");
+	if (csv->file == NULL) {
+		return -errno;
+	}
+
+	if (fgets(line, sizeof(line), csv->file) == NULL) {
+		fprintf(stderr, "%s is empty\n", path);
+		return -EINVAL;
+	}
+
+	int count = csv_split(line, fields, CSV_COLUMNS_MAX);
+	for (int i = 0;columns[i].name != NULL;i++) {
+		csv->index[i] = -1;
+		for (int j = 0;j < count;j++) {
+			if (strcmp(fields[j], columns[i].name) == 0) {
+				csv->index[i] = j;
+			}
+		}
+
+		if (csv->index[i] < 0) {
+			fprintf(stderr, "%s has no %s column\n", path, columns[i].name);
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+/* reads ahead one row, have_next is false at the end */
+static void csv_advance(struct csv_input *csv)
+{
+	char line[CSV_LINE_MAX];
+	char *fields[CSV_COLUMNS_MAX];
+
+	csv->have_next = false;
+	if (fgets(line, sizeof(line), csv->file) == NULL) {
+		return;
+	}
+
+	int count = csv_split(line, fields, CSV_COLUMNS_MAX);
+	struct replay_record *record = &csv->next;
+	memset(record, 0, sizeof(*record));
+	record->id = csv->id;
+
+	for (int i = 0;csv->columns[i].name != NULL;i++) {
+		const struct column *column = &csv->columns[i];
+		uint8_t *dest = (uint8_t *) record + column->offset;
+
+		if (csv->index[i] >= count) {
+			return;
+		}
+
+		const char *field = fields[csv->index[i]];
+		if (column->type == 'u') {
+			uint64_t value = strtoull(field, NULL, 10);
+			memcpy(dest, &value, sizeof(value));
+		} else if (column->type == 'b') {
+			*dest = strtoul(field, NULL, 10);
+		} else {
+			float value = strtof(field, NULL);
+			memcpy(dest, &value, sizeof(value));
+		}
+	}
+
+	/* every record starts with its timestamp */
+	uint64_t timestamp;
+	memcpy(&timestamp, &record->imu.timestamp, sizeof(timestamp));
+	record->timestamp = timestamp;
+	csv->have_next = true;
+}
+
+static int open_capture(struct input *input, const char *dir)
+{
+	char path[512];
+
+	for (size_t i = 0;i < CAPTURE_FILES;i++) {
+		struct csv_input *csv = &input->csv[input->csv_count];
+
+		snprintf(path, sizeof(path), "%s/%s", dir, capture_files[i].file);
+		int ret = csv_open(csv, path, capture_files[i].id, capture_files[i].columns);
+		if (ret == -ENOENT && capture_files[i].id != RECORD_IMU) {
+			continue;
+		}
+		if (ret != 0) {
+			if (ret != -EINVAL) {
+				fprintf(stderr, "Unable to open %s: %s\n", path, strerror(-ret));
+			}
+			return ret;
+		}
+
+		csv_advance(csv);
+		input->csv_count++;
+	}
+
+	return 0;
+}
+
+static int ulog_read(struct ulog_input *ulog, struct ulog_message_header *header,
+		uint8_t *data)
+{
+	if (fread(header, sizeof(*header), 1, ulog->file) != 1) {
+		return -ENODATA;
+	}
+	if (header->msg_size > 0 &&
+			fread(data, header->msg_size, 1, ulog->file) != 1) {
+		fprintf(stderr, "Log truncated\n");
+		return -ENODATA;
+	}
+
+	return 0;
+}
+
+static int open_ulog(struct input *input, const char *path)
+{
+	static const uint8_t magic[] = ULOG_MAGIC;
+	struct ulog_input *ulog = &input->ulog;
+	struct ulog_file_header header;
+
+	input->is_ulog = true;
+	for (int i = 0;i < ULOG_MSG_IDS;i++) {
+		ulog->records[i] = -1;
+	}
+
+	ulog->file = fopen(path, "rb");
+	if (ulog->file == NULL) {
+		fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+		return -errno;
+	}
+
+	if (fread(&header, sizeof(header), 1, ulog->file) != 1 ||
+			memcmp(header.magic, magic, sizeof(magic)) != 0) {
+		fprintf(stderr, "%s is not a ULog file\n", path);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/* the record a format or subscription names, by the name before the ':' */
+static int record_by_name(const char *name, size_t len)
+{
+	for (int i = 0;i < RECORD_COUNT;i++) {
+		const char *format = record_formats[i];
+		size_t name_len = strchr(format, ':') - format;
+
+		if (name_len == len && strncmp(format, name, len) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+static bool next_ulog(struct ulog_input *ulog, struct replay_record *record)
+{
+	static uint8_t data[ULOG_MSG_MAX];
+	struct ulog_message_header header;
+
+	while (ulog_read(ulog, &header, data) == 0) {
+		size_t len = header.msg_size;
+
+		switch (header.msg_type) {
+		case ULOG_MSG_FORMAT: {
+			const char *colon = memchr(data, ':', len);
+			if (colon == NULL) {
+				break;
+			}
+
+			/* records from another firmware version can't be copied in */
+			int id = record_by_name((const char *) data, colon - (char *) data);
+			if (id >= 0) {
+				ulog->format_ok[id] = len == strlen(record_formats[id]) &&
+					memcmp(data, record_formats[id], len) == 0;
+				if (!ulog->format_ok[id]) {
+					fprintf(stderr, "Layout of %s differs, ignoring it\n",
+							record_formats[id]);
+				}
+			}
+			break;
+		}
+		case ULOG_MSG_ADD_LOGGED: {
+			uint16_t msg_id;
+
+			if (len < 3) {
+				break;
+			}
+			memcpy(&msg_id, &data[1], sizeof(msg_id));
+			int id = record_by_name((const char *) &data[3], len - 3);
+			if (id >= 0 && ulog->format_ok[id] && msg_id < ULOG_MSG_IDS) {
+				ulog->records[msg_id] = id;
+			}
+			break;
+		}
+		case ULOG_MSG_DROPOUT:
+			ulog->dropouts++;
+			break;
+		case ULOG_MSG_DATA: {
+			uint16_t msg_id;
+
+			if (len < sizeof(msg_id)) {
+				break;
+			}
+			memcpy(&msg_id, data, sizeof(msg_id));
+			if (msg_id >= ULOG_MSG_IDS || ulog->records[msg_id] < 0) {
+				break;
+			}
+
+			int id = ulog->records[msg_id];
+			if (id == RECORD_OUTPUT || len - sizeof(msg_id) != record_sizes[id]) {
+				break;
+			}
+
+			uint64_t timestamp;
+			record->id = id;
+			memcpy(&record->imu, &data[sizeof(msg_id)], record_sizes[id]);
+			memcpy(&timestamp, &data[sizeof(msg_id)], sizeof(timestamp));
+			record->timestamp = timestamp;
+			return true;
+		}
+		default:
+			break;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * The next record of the input. Logs are read in order, which is the
+ * order the estimator took the samples in; captures are merged by
+ * timestamp.
+ */
+static bool next_record(struct input *input, struct replay_record *record)
+{
+	if (input->is_ulog) {
+		return next_ulog(&input->ulog, record);
+	}
+
+	struct csv_input *first = NULL;
+	for (int i = 0;i < input->csv_count;i++) {
+		struct csv_input *csv = &input->csv[i];
+
+		if (csv->have_next &&
+				(first == NULL || csv->next.timestamp < first->next.timestamp)) {
+			first = csv;
+		}
+	}
+
+	if (first == NULL) {
+		return false;
+	}
+
+	*record = first->next;
+	csv_advance(first);
+	return true;
+}
+
+static void cost_add(struct cost *cost, uint64_t ns, uint64_t cycles)
+{
+	if (cost->count == cost->size) {
+		cost->size = cost->size ? cost->size * 2 : 4096;
+		cost->ns = realloc(cost->ns, cost->size * sizeof(*cost->ns));
+		cost->cycles = realloc(cost->cycles, cost->size * sizeof(*cost->cycles));
+		if (cost->ns == NULL || cost->cycles == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+	}
+
+	cost->ns[cost->count] = ns;
+	cost->cycles[cost->count] = cycles;
+	cost->count++;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+static void print_values(const char *unit, uint64_t *values, size_t count)
+{
+	uint64_t sum = 0;
+
+	qsort(values, count, sizeof(*values), compare_u64);
+	for (size_t i = 0;i < count;i++) {
+		sum += values[i];
+	}
+
+	printf("    %-6s avg %8.1f  p50 %6llu  p99 %6llu  max %8llu\n", unit,
+			(double) sum / count,
+			(unsigned long long) values[count / 2],
+			(unsigned long long) values[count * 99 / 100],
+			(unsigned long long) values[count - 1]);
+}
+
+static void print_cost(const char *name, struct cost *cost)
+{
+	if (cost->count == 0) {
+		return;
+	}
+
+	printf("%s step cost, %zu steps:\n", name, cost->count);
+	print_values("ns", cost->ns, cost->count);
+	print_values("cycles", cost->cycles, cost->count);
+}
+
+static void error_add(struct error_stat *stat, double error)
+{
+	stat->count++;
+	stat->sum_sq += error * error;
+	stat->max = fmax(stat->max, fabs(error));
+}
+
+static void print_error(const char *name, const struct error_stat *stat)
+{
+	printf("    %-9s rms %8.3f  max %8.3f deg\n", name,
+			sqrt(stat->sum_sq / stat->count), stat->max);
+}
+
+static double wrap_180_deg(double angle)
+{
+	angle = fmod(angle + 180, 360);
+	if (angle < 0) {
+		angle += 360;
+	}
+
+	return angle - 180;
+}
+
+/* difference between an estimate and a reference, total and per axis */
+static void compare(struct replay_stats *stats, const struct attitude_frame *frame,
+		const struct record_attitude *ref)
+{
+	float q_ref[4], euler_ref[3];
+
+	memcpy(q_ref, ref->q, sizeof(q_ref));
+
+	double dot = 0;
+	for (int i = 0;i < 4;i++) {
+		dot += (double) frame->q[i] * q_ref[i];
+	}
+	double total = 2 * acos(fmin(fabs(dot), 1)) * RAD_TO_DEG;
+
+	quat_to_euler(q_ref, euler_ref);
+
+	error_add(&stats->total, total);
+	error_add(&stats->alt, frame->angle[0] - euler_ref[1]);
+	error_add(&stats->azm, wrap_180_deg(frame->angle[2] - euler_ref[2]));
+}
+
+static int set_param(const char *arg)
+{
+	const char *eq = strchr(arg, '=');
+	if (eq == NULL) {
+		fprintf(stderr, "Expected NAME=value, not %s\n", arg);
+		return -EINVAL;
+	}
+
+	int id = param_find(arg, eq - arg);
+	if (id < 0) {
+		fprintf(stderr, "No parameter %.*s\n", (int) (eq - arg), arg);
+		return id;
+	}
+
+	int ret;
+	if (param_type(id) == PARAM_TYPE_FLOAT) {
+		ret = param_set_float(id, strtof(eq + 1, NULL));
+	} else {
+		ret = param_set_int(id, strtol(eq + 1, NULL, 0));
+	}
+	if (ret != 0) {
+		fprintf(stderr, "%s out of range\n", arg);
+	}
+
+	return ret;
+}
+
+static int set_gyro_calib(const char *arg)
+{
+	struct gyro_calib calib = {.temp = 25};
+
+	if (sscanf(arg, "%f,%f,%f,%f", &calib.bias[0], &calib.bias[1],
+				&calib.bias[2], &calib.temp) < 3) {
+		fprintf(stderr, "Expected x,y,z[,temp], not %s\n", arg);
+		return -EINVAL;
+	}
+
+	calib_save_gyro(&calib);
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-t truth.csv] [-p NAME=value]... "
+			"[-g x,y,z[,temp]] [-s seconds] [-o out.csv] [-v] "
+			"<log.ulg or capture directory>\n", name);
+}
+
+int main(int argc, char **argv)
+{
+	const char *truth_path = NULL, *out_path = NULL;
+	double skip = 0;
+	int opt;
+
+	calib_init();
+	param_init();
+
+	while ((opt = getopt(argc, argv, "t:p:g:s:o:v")) != -1) {
+		switch (opt) {
+		case 't':
+			truth_path = optarg;
+			break;
+		case 'p':
+			if (set_param(optarg) != 0) {
+				return 2;
+			}
+			break;
+		case 'g':
+			if (set_gyro_calib(optarg) != 0) {
+				return 2;
+			}
+			break;
+		case 's':
+			skip = atof(optarg);
+			break;
+		case 'o':
+			out_path = optarg;
+			break;
+		case 'v':
+			shim_log_verbose++;
+			break;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	static struct input input;
+	struct stat st;
+	const char *path = argv[optind];
+	int ret = stat(path, &st) == 0 && S_ISDIR(st.st_mode) ?
+		open_capture(&input, path) : open_ulog(&input, path);
+	if (ret != 0) {
+		return 1;
+	}
+
+	struct csv_input truth = {0};
+	if (truth_path != NULL) {
+		ret = csv_open(&truth, truth_path, RECORD_ATTITUDE, attitude_columns);
+		if (ret != 0) {
+			if (ret != -EINVAL) {
+				fprintf(stderr, "Unable to open %s: %s\n", truth_path,
+						strerror(-ret));
+			}
+			return 1;
+		}
+		csv_advance(&truth);
+	}
+
+	FILE *out = NULL;
+	if (out_path != NULL) {
+		out = fopen(out_path, "w");
+		if (out == NULL) {
+			fprintf(stderr, "Unable to create %s: %s\n", out_path, strerror(errno));
+			return 1;
+		}
+		fprintf(out, "timestamp,q[0],q[1],q[2],q[3],angle[0],angle[1],angle[2],"
+				"azimuth,pwm[0],pwm[1]\n");
+	}
+
+	static struct est_state est;
+	struct attitude_frame frame;
+	struct command_setpoint command = {.mode = COMMAND_SETPOINT_MODE_NEUTRAL};
+	struct motor_setpoint motor;
+	struct replay_record record;
+	struct replay_stats stats = {.first = -1};
+	bool have_frame = false;
+
+	est_state_init(&est);
+
+	uint64_t wall_start = shim_clock_ns();
+	bool more = next_record(&input, &record);
+	while (more) {
+		/* ground truth in between, compared against the latest estimate */
+		if (truth.have_next && truth.next.timestamp < record.timestamp) {
+			if (have_frame &&
+					truth.next.timestamp - stats.first >= skip * USEC_PER_SEC) {
+				compare(&stats, &frame, &truth.next.attitude);
+				stats.references++;
+			}
+			csv_advance(&truth);
+			continue;
+		}
+
+		shim_set_time(record.timestamp);
+
+		switch (record.id) {
+		case RECORD_IMU: {
+			struct imu_sample sample = {
+				.timestamp = record.timestamp,
+				.temp = record.imu.temp,
+			};
+			memcpy(sample.accel, record.imu.accel, sizeof(sample.accel));
+			memcpy(sample.gyro, record.imu.gyro, sizeof(sample.gyro));
+
+			if (stats.first < 0) {
+				stats.first = record.timestamp;
+			}
+			stats.last = record.timestamp;
+			stats.imu++;
+
+			uint64_t ns = shim_clock_ns(), cycles = shim_cycles();
+			ret = est_add_imu(&est, &sample, &frame);
+			cost_add(&stats.estimate, shim_clock_ns() - ns, shim_cycles() - cycles);
+			if (ret != 0) {
+				break;
+			}
+
+			if (!have_frame) {
+				attctrl_reset(&frame);
+				have_frame = true;
+			}
+			stats.frames++;
+
+			ns = shim_clock_ns();
+			cycles = shim_cycles();
+			attctrl_step(&frame, &command, &motor);
+			cost_add(&stats.control, shim_clock_ns() - ns, shim_cycles() - cycles);
+
+			if (out != NULL) {
+				fprintf(out, "%lld,%.7g,%.7g,%.7g,%.7g,%.4f,%.4f,%.4f,%.4f,%d,%d\n",
+						(long long) frame.timestamp, frame.q[0], frame.q[1],
+						frame.q[2], frame.q[3], frame.angle[0], frame.angle[1],
+						frame.angle[2], frame.azimuth, motor.pwm[MOTOR_ALTITUDE],
+						motor.pwm[MOTOR_AZIMUTH]);
+			}
+			break;
+		}
+		case RECORD_MAG: {
+			struct mag_sample sample = {.timestamp = record.timestamp};
+			memcpy(sample.magn, record.mag.magn, sizeof(sample.magn));
+
+			est_add_mag(&est, &sample);
+			stats.mag++;
+			break;
+		}
+		case RECORD_ATTITUDE:
+			/* what the tracker estimated, the reference without -t */
+			if (truth_path == NULL && have_frame &&
+					record.timestamp - stats.first >= skip * USEC_PER_SEC) {
+				compare(&stats, &frame, &record.attitude);
+				stats.references++;
+			}
+			break;
+		case RECORD_SETPOINT:
+			/* as shaped by the tracker, tracking included */
+			command = (struct command_setpoint) {
+				.mode = record.setpoint.mode == COMMAND_SETPOINT_MODE_NEUTRAL ?
+					COMMAND_SETPOINT_MODE_NEUTRAL : COMMAND_SETPOINT_MODE_ANGLE,
+				.timestamp = record.timestamp,
+				.angle = {record.setpoint.target[0], record.setpoint.target[1]},
+				.rate = {record.setpoint.target_rate[0],
+					record.setpoint.target_rate[1]},
+			};
+			stats.setpoints++;
+			break;
+		default:
+			break;
+		}
+
+		more = next_record(&input, &record);
+	}
+	uint64_t wall = shim_clock_ns() - wall_start;
+
+	if (out != NULL) {
+		fclose(out);
+	}
+
+	if (stats.imu == 0) {
+		fprintf(stderr, "No IMU samples in %s\n", path);
+		return 1;
+	}
+
+	double duration = (stats.last - stats.first) / 1e6;
+	printf("%lu IMU, %lu mag samples, %lu setpoints over %.1f s",
+			stats.imu, stats.mag, stats.setpoints, duration);
+	if (input.is_ulog) {
+		printf(", %lu dropouts", input.ulog.dropouts);
+	}
+	printf("\n%lu attitude frames in %.3f s: %.0f samples/s, %.0fx real time\n",
+			stats.frames, wall / 1e9, stats.imu / (wall / 1e9),
+			duration / (wall / 1e9));
+	print_cost("Estimator", &stats.estimate);
+	print_cost("Controller", &stats.control);
+
+	if (stats.references > 0) {
+		printf("Error against %s, %lu samples:\n",
+				truth_path != NULL ? "ground truth" : "the logged attitude",
+				stats.references);
+		print_error("attitude", &stats.total);
+		print_error("altitude", &stats.alt);
+		print_error("heading", &stats.azm);
+	} else {
+		printf("No reference attitude to compare against\n");
+	}
+
+	return 0;
+}
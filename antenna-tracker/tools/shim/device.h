@@ -0,0 +1,10 @@
+#ifndef SHIM_DEVICE_H
+#define SHIM_DEVICE_H
+
+#include <zephyr.h>
+
+struct device {
+	const char *name;
+};
+
+#endif /* SHIM_DEVICE_H */
@@ -0,0 +1,11 @@
+#ifndef SHIM_DRIVERS_SENSOR_H
+#define SHIM_DRIVERS_SENSOR_H
+
+#include <device.h>
+
+struct sensor_value {
+	int32_t val1;
+	int32_t val2;
+};
+
+#endif /* SHIM_DRIVERS_SENSOR_H */
@@ -0,0 +1,28 @@
+#ifndef SHIM_LOGGING_LOG_H
+#define SHIM_LOGGING_LOG_H
+
+#include <stdio.h>
+
+/* errors and warnings always go to stderr, the rest with -v */
+extern int shim_log_verbose;
+
+#define LOG_MODULE_REGISTER(name, level) \
+	static const char *const shim_log_module = #name
+
+#define SHIM_LOG(level, fmt, ...) \
+	fprintf(stderr, "<%s> %s: " fmt "\n", level, shim_log_module, ##__VA_ARGS__)
+
+#define LOG_ERR(...) SHIM_LOG("err", __VA_ARGS__)
+#define LOG_WRN(...) SHIM_LOG("wrn", __VA_ARGS__)
+#define LOG_INF(...) do { \
+		if (shim_log_verbose) { \
+			SHIM_LOG("inf", __VA_ARGS__); \
+		} \
+	} while (0)
+#define LOG_DBG(...) do { \
+		if (shim_log_verbose > 1) { \
+			SHIM_LOG("dbg", __VA_ARGS__); \
+		} \
+	} while (0)
+
+#endif /* SHIM_LOGGING_LOG_H */
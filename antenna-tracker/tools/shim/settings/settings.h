@@ -0,0 +1,19 @@
+#ifndef SHIM_SETTINGS_SETTINGS_H
+#define SHIM_SETTINGS_SETTINGS_H
+
+#include <sys/types.h>
+
+#include <zephyr.h>
+
+/* nothing is stored on the host, every run starts from the defaults */
+typedef ssize_t (*settings_read_cb)(void *cb_arg, void *data, size_t len);
+
+#define SETTINGS_STATIC_HANDLER_DEFINE(name, subtree, get, set, commit, export) \
+	static __attribute__((unused)) const void *const shim_settings_##name = set
+
+int settings_subsys_init(void);
+int settings_load_subtree(const char *subtree);
+int settings_save_one(const char *name, const void *value, size_t len);
+int settings_name_steq(const char *name, const char *key, const char **next);
+
+#endif /* SHIM_SETTINGS_SETTINGS_H */
@@ -0,0 +1,155 @@
+/**
+ * shim.c
+ *
+ * This file contains the host implementations behind the shim headers,
+ * for running firmware modules in the host tools. See zephyr.h.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <zephyr.h>
+#include <settings/settings.h>
+
+#include "perf.h"
+#include "timestamp.h"
+#include "shim.h"
+
+int shim_log_verbose;
+
+static int64_t shim_time;
+
+void shim_set_time(int64_t time)
+{
+	shim_time = time;
+}
+
+int64_t timestamp_us(void)
+{
+	return shim_time;
+}
+
+uint64_t shim_clock_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t shim_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	return shim_clock_ns();
+#endif
+}
+
+uint32_t k_cycle_get_32(void)
+{
+	return (uint32_t) shim_cycles();
+}
+
+uint32_t sys_clock_hw_cycles_per_sec(void)
+{
+	return 0;
+}
+
+int k_sem_take(struct k_sem *sem, k_timeout_t timeout)
+{
+	if (sem->count == 0) {
+		return -EBUSY;
+	}
+
+	sem->count--;
+	return 0;
+}
+
+void k_sem_give(struct k_sem *sem)
+{
+	if (sem->count < sem->limit) {
+		sem->count++;
+	}
+}
+
+void k_work_init(struct k_work *work, k_work_handler_t handler)
+{
+	work->handler = handler;
+}
+
+int k_work_submit(struct k_work *work)
+{
+	work->handler(work);
+	return 1;
+}
+
+int k_msgq_put(struct k_msgq *msgq, const void *data, k_timeout_t timeout)
+{
+	return -ENOMSG;
+}
+
+int k_msgq_get(struct k_msgq *msgq, void *data, k_timeout_t timeout)
+{
+	return -ENOMSG;
+}
+
+void k_msgq_purge(struct k_msgq *msgq)
+{
+}
+
+/* the host tools drive the modules themselves, nothing may start a thread */
+k_tid_t k_thread_create(struct k_thread *thread, char *stack, size_t size,
+		k_thread_entry_t entry, void *p1, void *p2, void *p3, int prio,
+		uint32_t options, k_timeout_t delay)
+{
+	fprintf(stderr, "k_thread_create() is not available on the host\n");
+	abort();
+}
+
+int k_thread_name_set(k_tid_t thread, const char *name)
+{
+	return 0;
+}
+
+void perf_record_drop(enum perf_drop drop)
+{
+}
+
+int settings_subsys_init(void)
+{
+	return 0;
+}
+
+int settings_load_subtree(const char *subtree)
+{
+	return 0;
+}
+
+int settings_save_one(const char *name, const void *value, size_t len)
+{
+	return 0;
+}
+
+int settings_name_steq(const char *name, const char *key, const char **next)
+{
+	size_t len = strlen(key);
+
+	if (strncmp(name, key, len) != 0) {
+		return 0;
+	}
+
+	if (name[len] == '/') {
+		*next = &name[len + 1];
+		return 1;
+	}
+	if (name[len] == '\0' || name[len] == '=') {
+		*next = NULL;
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,22 @@
+#ifndef SHIM_H
+#define SHIM_H
+
+#include <stdint.h>
+
+/*
+ * The host side of the shim. There is no clock running under the
+ * firmware code: timestamp_us() returns whatever the tool last set,
+ * normally the timestamp of the sample being processed, so runs are
+ * repeatable.
+ */
+void shim_set_time(int64_t time);
+
+/* host monotonic clock for measuring the code under test, ns */
+uint64_t shim_clock_ns(void);
+
+/* the time stamp counter where there is one, otherwise shim_clock_ns() */
+uint64_t shim_cycles(void);
+
+extern int shim_log_verbose;
+
+#endif /* SHIM_H */
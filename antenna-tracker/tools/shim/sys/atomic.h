@@ -0,0 +1,69 @@
+#ifndef SHIM_SYS_ATOMIC_H
+#define SHIM_SYS_ATOMIC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef long atomic_t;
+typedef atomic_t atomic_val_t;
+
+#define ATOMIC_BITS (sizeof(atomic_val_t) * 8)
+#define ATOMIC_DEFINE(name, bits) \
+	atomic_t name[((bits) + ATOMIC_BITS - 1) / ATOMIC_BITS]
+
+/* single threaded, so plain reads and writes will do */
+static inline atomic_val_t atomic_get(const atomic_t *target)
+{
+	return *target;
+}
+
+static inline atomic_val_t atomic_set(atomic_t *target, atomic_val_t value)
+{
+	atomic_val_t old = *target;
+	*target = value;
+	return old;
+}
+
+static inline atomic_val_t atomic_inc(atomic_t *target)
+{
+	return (*target)++;
+}
+
+static inline atomic_val_t atomic_dec(atomic_t *target)
+{
+	return (*target)--;
+}
+
+static inline bool atomic_cas(atomic_t *target, atomic_val_t old_value,
+		atomic_val_t new_value)
+{
+	if (*target != old_value) {
+		return false;
+	}
+
+	*target = new_value;
+	return true;
+}
+
+static inline atomic_val_t atomic_add(atomic_t *target, atomic_val_t value)
+{
+	atomic_val_t old = *target;
+	*target += value;
+	return old;
+}
+
+static inline void atomic_set_bit(atomic_t *target, int bit)
+{
+	target[bit / ATOMIC_BITS] |= 1UL << (bit % ATOMIC_BITS);
+}
+
+static inline bool atomic_test_and_clear_bit(atomic_t *target, int bit)
+{
+	atomic_val_t mask = 1UL << (bit % ATOMIC_BITS);
+	bool set = target[bit / ATOMIC_BITS] & mask;
+
+	target[bit / ATOMIC_BITS] &= ~mask;
+	return set;
+}
+
+#endif /* SHIM_SYS_ATOMIC_H */
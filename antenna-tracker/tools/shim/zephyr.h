@@ -0,0 +1,106 @@
+#ifndef SHIM_ZEPHYR_H
+#define SHIM_ZEPHYR_H
+
+/*
+ * Just enough of the Zephyr kernel API for the estimator and controller
+ * sources to build and run on a host, single threaded. There are no
+ * threads: the host tools call the step functions directly, so queues
+ * stay empty, semaphores never block and work runs when submitted.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <sys/atomic.h>
+
+#define ARRAY_SIZE(array) (sizeof(array) / sizeof((array)[0]))
+#define CONTAINER_OF(ptr, type, field) \
+	((type *) (((char *) (ptr)) - offsetof(type, field)))
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+#define CLAMP(val, low, high) (((val) <= (low)) ? (low) : MIN(val, high))
+#define BIT(n) (1UL << (n))
+#define ARG_UNUSED(x) (void) (x)
+#define BUILD_ASSERT(cond, ...) _Static_assert(cond, "" __VA_ARGS__)
+#define __ASSERT(cond, ...) assert(cond)
+
+#define USEC_PER_SEC 1000000
+#define MSEC_PER_SEC 1000
+
+#define snprintk snprintf
+#define printk printf
+
+typedef struct {
+	int64_t ticks;
+} k_timeout_t;
+
+#define K_NO_WAIT ((k_timeout_t) {0})
+#define K_FOREVER ((k_timeout_t) {-1})
+#define K_MSEC(ms) ((k_timeout_t) {ms})
+
+struct k_spinlock {
+	int unused;
+};
+
+typedef int k_spinlock_key_t;
+
+static inline k_spinlock_key_t k_spin_lock(struct k_spinlock *lock)
+{
+	return 0;
+}
+
+static inline void k_spin_unlock(struct k_spinlock *lock, k_spinlock_key_t key)
+{
+}
+
+struct k_sem {
+	unsigned int count, limit;
+};
+
+#define K_SEM_DEFINE(name, initial, max) \
+	struct k_sem name = {.count = initial, .limit = max}
+
+int k_sem_take(struct k_sem *sem, k_timeout_t timeout);
+void k_sem_give(struct k_sem *sem);
+
+struct k_work;
+typedef void (*k_work_handler_t)(struct k_work *work);
+
+struct k_work {
+	k_work_handler_t handler;
+};
+
+void k_work_init(struct k_work *work, k_work_handler_t handler);
+int k_work_submit(struct k_work *work);
+
+struct k_msgq {
+	int unused;
+};
+
+int k_msgq_put(struct k_msgq *msgq, const void *data, k_timeout_t timeout);
+int k_msgq_get(struct k_msgq *msgq, void *data, k_timeout_t timeout);
+void k_msgq_purge(struct k_msgq *msgq);
+
+struct k_thread {
+	int unused;
+};
+
+typedef struct k_thread *k_tid_t;
+typedef void (*k_thread_entry_t)(void *, void *, void *);
+
+#define K_THREAD_STACK_DEFINE(name, size) static char name[size]
+#define K_THREAD_STACK_SIZEOF(name) sizeof(name)
+
+k_tid_t k_thread_create(struct k_thread *thread, char *stack, size_t size,
+		k_thread_entry_t entry, void *p1, void *p2, void *p3, int prio,
+		uint32_t options, k_timeout_t delay);
+int k_thread_name_set(k_tid_t thread, const char *name);
+
+uint32_t k_cycle_get_32(void);
+uint32_t sys_clock_hw_cycles_per_sec(void);
+
+#endif /* SHIM_ZEPHYR_H */
@@ -0,0 +1,347 @@
+/**
+ * tlmrecv.c
+ *
+ * Host receiver for the tracker's binary telemetry stream. Reads the USB
+ * serial port (or a raw capture of it), picks the telemetry frames out
+ * from between the MAVLink messages, checks their CRC and writes each
+ * record type to its own CSV file, with the columns named as pyulog names
+ * them. Frames lost on the way are counted from the sequence numbers.
+ *
+ * Usage: tlmrecv <port or capture file> [output directory]
+ *
+ * The stream is enabled on the tracker with the TLM_RECORDS parameter.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "records.h"
+
+#define FIELDS_MAX 32
+
+struct field {
+	char name[48];
+	char type[16];
+	int size;
+};
+
+struct record_type {
+	const char *format;
+	char name[32];
+	struct field fields[FIELDS_MAX];
+	int field_count;
+	int size;
+	FILE *csv;
+};
+
+static struct record_type types[RECORD_COUNT] = {
+	[RECORD_IMU] = {RECORD_IMU_FORMAT},
+	[RECORD_MAG] = {RECORD_MAG_FORMAT},
+	[RECORD_ATTITUDE] = {RECORD_ATTITUDE_FORMAT},
+	[RECORD_SETPOINT] = {RECORD_SETPOINT_FORMAT},
+	[RECORD_OUTPUT] = {RECORD_OUTPUT_FORMAT},
+};
+
+struct stats {
+	unsigned long frames, bad_crc, lost, skipped;
+};
+
+static volatile sig_atomic_t stop;
+
+static void handle_signal(int sig)
+{
+	stop = 1;
+}
+
+static int type_size(const char *type)
+{
+	static const struct {
+		const char *name;
+		int size;
+	} sizes[] = {
+		{"uint64_t", 8}, {"int64_t", 8}, {"float", 4}, {"uint32_t", 4},
+		{"int32_t", 4}, {"uint16_t", 2}, {"int16_t", 2}, {"uint8_t", 1},
+		{"int8_t", 1},
+	};
+
+	for (size_t i = 0;i < sizeof(sizes) / sizeof(sizes[0]);i++) {
+		if (strcmp(type, sizes[i].name) == 0) {
+			return sizes[i].size;
+		}
+	}
+
+	return -1;
+}
+
+/* splits "name:type field;type[n] field;" into scalar columns */
+static int parse_format(struct record_type *record)
+{
+	const char *p = strchr(record->format, ':');
+	if (p == NULL) {
+		return -EINVAL;
+	}
+	snprintf(record->name, sizeof(record->name), "%.*s",
+			(int) (p - record->format), record->format);
+
+	p++;
+	while (*p != '\0') {
+		char type[16], name[32];
+		int count = 1;
+		int len;
+
+		if (sscanf(p, "%15[^ ;] %31[^;];%n", type, name, &len) != 2) {
+			return -EINVAL;
+		}
+		p += len;
+
+		char *bracket = strchr(type, '[');
+		if (bracket != NULL) {
+			count = atoi(bracket + 1);
+			*bracket = '\0';
+		}
+
+		int size = type_size(type);
+		if (size < 0) {
+			return -EINVAL;
+		}
+
+		for (int i = 0;i < count;i++) {
+			if (record->field_count >= FIELDS_MAX) {
+				return -ENOMEM;
+			}
+
+			struct field *field = &record->fields[record->field_count++];
+			if (bracket != NULL) {
+				snprintf(field->name, sizeof(field->name), "%s[%d]", name, i);
+			} else {
+				snprintf(field->name, sizeof(field->name), "%s", name);
+			}
+			snprintf(field->type, sizeof(field->type), "%s", type);
+			field->size = size;
+			record->size += size;
+		}
+	}
+
+	return 0;
+}
+
+static void print_value(FILE *csv, const struct field *field, const uint8_t *data)
+{
+	/* little endian like the tracker, so the bytes copy straight in */
+	if (strcmp(field->type, "float") == 0) {
+		float value;
+		memcpy(&value, data, sizeof(value));
+		fprintf(csv, "%.9g", value);
+	} else if (strcmp(field->type, "uint64_t") == 0) {
+		uint64_t value;
+		memcpy(&value, data, sizeof(value));
+		fprintf(csv, "%llu", (unsigned long long) value);
+	} else if (strcmp(field->type, "int64_t") == 0) {
+		int64_t value;
+		memcpy(&value, data, sizeof(value));
+		fprintf(csv, "%lld", (long long) value);
+	} else if (strcmp(field->type, "uint32_t") == 0) {
+		uint32_t value;
+		memcpy(&value, data, sizeof(value));
+		fprintf(csv, "%lu", (unsigned long) value);
+	} else if (strcmp(field->type, "int32_t") == 0) {
+		int32_t value;
+		memcpy(&value, data, sizeof(value));
+		fprintf(csv, "%ld", (long) value);
+	} else if (strcmp(field->type, "uint16_t") == 0) {
+		uint16_t value;
+		memcpy(&value, data, sizeof(value));
+		fprintf(csv, "%u", value);
+	} else if (strcmp(field->type, "int16_t") == 0) {
+		int16_t value;
+		memcpy(&value, data, sizeof(value));
+		fprintf(csv, "%d", value);
+	} else if (strcmp(field->type, "uint8_t") == 0) {
+		fprintf(csv, "%u", data[0]);
+	} else {
+		fprintf(csv, "%d", (int8_t) data[0]);
+	}
+}
+
+static int write_record(struct record_type *record, const char *dir,
+		const uint8_t *data)
+{
+	if (record->csv == NULL) {
+		char path[512];
+		snprintf(path, sizeof(path), "%s/%s.csv", dir, record->name);
+		record->csv = fopen(path, "w");
+		if (record->csv == NULL) {
+			fprintf(stderr, "Unable to create %s: %s\n", path, strerror(errno));
+			return -errno;
+		}
+
+		for (int i = 0;i < record->field_count;i++) {
+			fprintf(record->csv, "%s%s", i > 0 ? "," : "", record->fields[i].name);
+		}
+		fputc('\n', record->csv);
+	}
+
+	for (int i = 0;i < record->field_count;i++) {
+		if (i > 0) {
+			fputc(',', record->csv);
+		}
+		print_value(record->csv, &record->fields[i], data);
+		data += record->fields[i].size;
+	}
+	fputc('\n', record->csv);
+
+	return 0;
+}
+
+/*
+ * Checks the frame at the start of buf.
+ *
+ * @return the frame length if it's whole and valid, 0 if more bytes are
+ * needed, or -1 if it isn't a frame
+ */
+static int check_frame(const uint8_t *buf, size_t len)
+{
+	struct telemetry_header header;
+
+	if (len < 2) {
+		return buf[0] == TELEMETRY_SYNC0 ? 0 : -1;
+	}
+	if (buf[0] != TELEMETRY_SYNC0 || buf[1] != TELEMETRY_SYNC1) {
+		return -1;
+	}
+	if (len < sizeof(header)) {
+		return 0;
+	}
+
+	memcpy(&header, buf, sizeof(header));
+	if (header.type >= RECORD_COUNT || header.len != types[header.type].size) {
+		return -1;
+	}
+
+	size_t frame_len = sizeof(header) + header.len + sizeof(uint16_t);
+	if (len < frame_len) {
+		return 0;
+	}
+
+	size_t crc_start = offsetof(struct telemetry_header, type);
+	size_t crc_end = sizeof(header) + header.len;
+	uint16_t crc = telemetry_crc16(0xffff, &buf[crc_start], crc_end - crc_start);
+	if (buf[crc_end] != (crc & 0xff) || buf[crc_end + 1] != crc >> 8) {
+		return -2;
+	}
+
+	return frame_len;
+}
+
+/* raw mode, so the port passes every byte through untouched */
+static void setup_port(int fd)
+{
+	struct termios tio;
+
+	if (tcgetattr(fd, &tio) != 0) {
+		/* a capture file */
+		return;
+	}
+
+	cfmakeraw(&tio);
+	tio.c_cc[VMIN] = 1;
+	tio.c_cc[VTIME] = 0;
+	tcsetattr(fd, TCSANOW, &tio);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "usage: %s <port or capture file> [output directory]\n",
+				argv[0]);
+		return 2;
+	}
+	const char *dir = argc > 2 ? argv[2] : ".";
+
+	for (int i = 0;i < RECORD_COUNT;i++) {
+		if (parse_format(&types[i]) != 0) {
+			fprintf(stderr, "Bad format for record %d\n", i);
+			return 1;
+		}
+	}
+
+	int fd = open(argv[1], O_RDONLY | O_NOCTTY);
+	if (fd < 0) {
+		fprintf(stderr, "Unable to open %s: %s\n", argv[1], strerror(errno));
+		return 1;
+	}
+	setup_port(fd);
+
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+
+	static uint8_t buf[65536];
+	size_t len = 0;
+	struct stats stats = {0};
+	uint16_t last_seq = 0;
+	bool have_seq = false;
+	int ret = 0;
+
+	while (!stop) {
+		ssize_t n = read(fd, &buf[len], sizeof(buf) - len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			break;
+		}
+		len += n;
+
+		size_t pos = 0;
+		while (pos < len) {
+			int frame_len = check_frame(&buf[pos], len - pos);
+			if (frame_len == 0) {
+				break;
+			}
+			if (frame_len < 0) {
+				/* MAVLink, or a corrupt frame: resync from the next byte */
+				stats.bad_crc += frame_len == -2;
+				stats.skipped++;
+				pos++;
+				continue;
+			}
+
+			struct telemetry_header header;
+			memcpy(&header, &buf[pos], sizeof(header));
+			if (have_seq) {
+				stats.lost += (uint16_t) (header.seq - last_seq - 1);
+			}
+			last_seq = header.seq;
+			have_seq = true;
+			stats.frames++;
+
+			ret = write_record(&types[header.type], dir, &buf[pos + sizeof(header)]);
+			if (ret != 0) {
+				stop = 1;
+				break;
+			}
+			pos += frame_len;
+		}
+
+		memmove(buf, &buf[pos], len - pos);
+		len -= pos;
+	}
+
+	for (int i = 0;i < RECORD_COUNT;i++) {
+		if (types[i].csv != NULL) {
+			fclose(types[i].csv);
+		}
+	}
+	close(fd);
+
+	fprintf(stderr, "%lu frames, %lu lost, %lu bad CRC, %lu bytes skipped\n",
+			stats.frames, stats.lost, stats.bad_crc, stats.skipped);
+	return ret != 0;
+}